@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <functional> // std::function
 #include <utility> // std::pair
 #include <opencv2/opencv.hpp> // all opencv header
 #include "hdrplus/burst.h"
@@ -21,9 +22,29 @@ class align
          * @param aligements alignment in pixel value pair. 
          *      Outer most vector is per alternative image.
          *      Inner most two vector is for horizontle & verticle tiles 
+         * @param on_image_aligned optional callback with the image index, called as soon as
+         *      aligements[ index ] of an alternative image is final (e.g. to start merging it)
          */
         void process( const hdrplus::burst& burst_images, \
-                      std::vector<std::vector<std::vector<std::pair<int, int>>>>& aligements );
+                      std::vector<std::vector<std::vector<std::pair<int, int>>>>& aligements, \
+                      const std::function<void(int)>& on_image_aligned = nullptr );
+
+        // Image index, its finest level alignment (sized for the full image), tile rows [ start, end ) that are final
+        typedef std::function<void(int, const std::vector<std::vector<std::pair<int, int>>>&, int, int)> rows_aligned_callback;
+
+        /**
+         * @brief Same as above on padded grayscale images (or views of the same rows of every image,
+         *      e.g. a horizontal band starting at a multiple of 128 rows)
+         * 
+         * @param on_rows_aligned optional callback, finest level is aligned in blocks of
+         *      block_tile_rows tile rows and the callback runs after each block (e.g. to merge
+         *      the block while its pixels are still in cache). Coarser levels are aligned first.
+         */
+        void process( const std::vector<cv::Mat>& grayscale_images, int reference_image_idx, \
+                      std::vector<std::vector<std::vector<std::pair<int, int>>>>& aligements, \
+                      const std::function<void(int)>& on_image_aligned = nullptr, \
+                      const rows_aligned_callback& on_rows_aligned = nullptr, \
+                      int block_tile_rows = 8 );
 
     private:
         // From original image to coarse image
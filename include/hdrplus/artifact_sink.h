@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <utility> // std::pair
+#include <opencv2/opencv.hpp> // all opencv header
+
+namespace hdrplus
+{
+
+/**
+ * @brief Destination of the intermediate images (debug artifacts) of the pipeline.
+ *      Modules hold a std::shared_ptr to a sink and skip every artifact, conversion included,
+ *      when it is null, so disabled artifacts cost nothing.
+ */
+class artifact_sink
+{
+    public:
+        virtual ~artifact_sink() = default;
+
+        /**
+         * @brief Hand over one artifact
+         *
+         * @param name file name, e.g. "mergedImg.jpg" (extension picks the encoder)
+         * @param image image to store, the caller must not modify its pixels afterwards
+         */
+        virtual void write( const std::string& name, const cv::Mat& image ) = 0;
+
+        // Wait until every artifact handed over so far is stored
+        virtual void flush() {}
+};
+
+/**
+ * @brief Sink encoding artifacts with cv::imwrite on a pool of background threads into a new
+ *      directory per run (output_root/run_<date>_<time>_<n>). At most max_queued artifacts wait
+ *      for a worker, write() blocks beyond that to bound memory.
+ *      Encoding errors are reported on stderr and do not stop the pipeline.
+ */
+class async_file_sink : public artifact_sink
+{
+    public:
+        explicit async_file_sink( const std::string& output_root, int num_threads = 2, int max_queued = 4 );
+
+        // Stores the queued artifacts, then joins the workers
+        ~async_file_sink() override;
+
+        void write( const std::string& name, const cv::Mat& image ) override;
+        void flush() override;
+
+        // Directory of this run
+        const std::string& directory() const { return run_directory; }
+
+    private:
+        std::string run_directory;
+        size_t max_queued;
+
+        std::deque<std::pair<std::string, cv::Mat>> queue;
+        int num_active = 0; // artifacts being encoded
+        bool stopping = false;
+        std::mutex queue_mutex;
+        std::condition_variable work_available; // workers wait for artifacts
+        std::condition_variable space_available; // write() waits for queue space, flush() for completion
+
+        std::vector<std::thread> workers;
+
+        void worker_loop();
+};
+
+} // namespace hdrplus
@@ -18,7 +18,11 @@ class bayer_image
 
         std::pair<double, double> get_noise_params() const;
 
-        std::shared_ptr<LibRaw> libraw_processor;
+        // Drop the raw and grayscale images and the LibRaw context (back to the pool), metadata is kept
+        void release_pixels();
+
+        std::string path;
+        std::shared_ptr<LibRaw> libraw_processor; // pooled context of this frame (libraw_pool), shared by copies of this bayer_image only
         cv::Mat raw_image;
         cv::Mat grayscale_image;
         int width;
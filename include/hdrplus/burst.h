@@ -2,16 +2,45 @@
 
 #include <vector>
 #include <string>
+#include <cstdio> // std::FILE
+#include <memory> // std::shared_ptr
 #include <opencv2/opencv.hpp> // all opencv header
 #include "hdrplus/bayer_image.h"
+#include "hdrplus/params.h"
 
 namespace hdrplus
 {
 
+/**
+ * @brief Frames worth merging for a reference frame. Frame N + 1 is added while both hold:
+ *      the SNR of N merged frames is below options.targetSNR (when > 0), from the noise model at the mean
+ *      brightness of the reference, and its marginal relative SNR gain sqrt(N + 1) / sqrt(N) - 1 is at least
+ *      options.minFrameSNRGain (when > 0). The relative gain does not depend on the scene, the target SNR
+ *      is what lets bright scenes stop earlier than dark ones.
+ *
+ * @param grayscale_image grayscale of the reference (scene brightness)
+ * @param black_level mean black level of the reference
+ * @param lambda_shot, lambda_read noise model of the reference (bayer_image::get_noise_params)
+ * @param binning 2 when frames are 2x2 binned (preview), noise variance of a sample divided by 4
+ * @param max_frames frames in the burst
+ * @return between 1 and max_frames
+ */
+int num_frames_for_snr( const cv::Mat& grayscale_image, double black_level, double lambda_shot, double lambda_read, \
+                        int binning, const hdrplus::Options& options, int max_frames );
+
 class burst
 {
     public:
-        explicit burst( const std::string& burst_path, const std::string& reference_image_path );
+        /**
+         * @brief Decode and pad the burst.
+         *      With options.targetSNR or options.minFrameSNRGain > 0, only the frames num_frames_for_snr
+         *      keeps are decoded, the ones temporally closest to the reference.
+         *      With options.previewScale > 0, every frame is 2x2 binned (preview).
+         *      With options.memoryBudgetMB > 0, the burst is spilled: frames are decoded and padded one
+         *      at a time into temporary files, only their metadata stays in memory (see read_band).
+         */
+        explicit burst( const std::string& burst_path, const std::string& reference_image_path, \
+                        const hdrplus::Options& options = hdrplus::Options() );
         ~burst() = default;
 
         // Reference image index in the array
@@ -33,9 +62,33 @@ class burst
     
         // number of image (including reference) in burst
         int num_images;
+
+        // Bayer images are binned by this factor (2 in preview, see bin_bayer_2x2), 1 at full resolution
+        int binning = 1;
         
         // Bayer image after merging, stored as cv::Mat
         cv::Mat merged_bayer_image;
+
+        // Size of the padded bayer images
+        cv::Size padded_size;
+
+        // Frames are kept in temporary files (options.memoryBudgetMB > 0): bayer_images hold the metadata only,
+        // bayer_images_pad and grayscale_images_pad are empty
+        bool spilled = false;
+
+        /**
+         * @brief Rows [ row_start, row_end ) of a padded bayer frame and the matching grayscale rows
+         *      [ row_start / 2, row_end / 2 ), row_start and row_end even. Views of the padded images,
+         *      or read from the temporary file of the frame when spilled (same values).
+         */
+        void read_band( int img_idx, int row_start, int row_end, cv::Mat& bayer_band, cv::Mat& grayscale_band ) const;
+
+        // Spilled burst: decode the reference frame again (LibRaw context and raw_image, as used by finish)
+        void load_reference();
+
+    private:
+        // Temporary file of every padded bayer frame when spilled, deleted when the last copy of the burst goes
+        std::vector<std::shared_ptr<std::FILE>> spill_files;
 };
 
 } // namespace hdrplus
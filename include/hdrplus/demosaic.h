@@ -0,0 +1,38 @@
+#pragma once
+
+#include <memory> // std::shared_ptr
+#include <opencv2/opencv.hpp> // all opencv header
+#include <libraw/libraw.h>
+#include "hdrplus/params.h"
+
+namespace hdrplus
+{
+
+enum demosaic_algorithm
+{
+    DEMOSAIC_BILINEAR = 0,
+    DEMOSAIC_MHC = 1 // Malvar-He-Cutler, gradient corrected bilinear (5x5)
+};
+
+/**
+ * @brief Native replacement of LibRaw dcraw_process + dcraw_make_mem_image for 2x2 bayer images.
+ *      Black / white level normalization, white balance, demosaic, camera to output color
+ *      matrix and 16 bit RGB output in one multi-threaded pass over blocks of rows.
+ *      Parameters come from the LibRaw metadata read at unpack (rawdata.color, rawdata.sizes,
+ *      rawdata.iparams), dcraw_process is not needed and LibRaw state is not modified.
+ *
+ * @param libraw_processor LibRaw of the frame, unpacked
+ * @param bayer_image raw sized bayer image (raw_height x raw_width, binned size with binning 2), e.g. the merged image
+ * @param rawpyArgs use_camera_wb and output_color (1 sRGB or 0 raw, others throw) are used,
+ *      use_auto_wb is not supported (warning, camera or daylight white balance)
+ * @param algorithm bilinear or Malvar-He-Cutler
+ * @param binning 2 for a 2x2 binned bayer image (bin_bayer_2x2 of the raw image, preview), margins and visible area scaled
+ * @return CV_16UC3 linear RGB image of the visible area (half size with binning 2), same orientation as dcraw_make_mem_image
+ */
+cv::Mat demosaic_process( const std::shared_ptr<LibRaw>& libraw_processor, \
+                          const cv::Mat& bayer_image, \
+                          const RawpyArgs& rawpyArgs, \
+                          demosaic_algorithm algorithm = DEMOSAIC_MHC, \
+                          int binning = 1 );
+
+} // namespace hdrplus
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/opencv.hpp> // all opencv header
+
+namespace hdrplus
+{
+
+/**
+ * @brief Mertens exposure fusion specialized for the two single channel exposures of local tone mapping.
+ *      Same weights as cv::MergeMertens on gray images (contrast * well-exposedness, exponents 1), but on
+ *      the 16 bit exposures directly instead of an 8 bit copy. With two exposures the normalized weights
+ *      are w and 1 - w, so the fused Laplacian pyramid is L(long) + G(w) * L(short - long): three pyramids
+ *      instead of four, no weight sum image.
+ *      Pyramid buffers are kept between calls, an instance is not meant to be shared between threads.
+ */
+class exposure_fusion
+{
+    public:
+        exposure_fusion() = default;
+        ~exposure_fusion() = default;
+
+        /**
+         * @brief Fuse two exposures
+         *
+         * @param short_exposure CV_16UC1 (gamma corrected gray)
+         * @param long_exposure CV_16UC1, same size
+         * @param fused CV_32FC1, 16 bit range mapped to [ 0, 1 ] like the MergeMertens output
+         *      (values can slightly leave [ 0, 1 ])
+         */
+        void process( const cv::Mat& short_exposure, const cv::Mat& long_exposure, cv::Mat& fused );
+
+    private:
+        // Gaussian pyramids, level 0 at full resolution. Turned into the fused pyramid in place.
+        std::vector<cv::Mat> long_pyramid;       // long exposure
+        std::vector<cv::Mat> difference_pyramid; // short - long exposure
+        std::vector<cv::Mat> weight_pyramid;     // normalized weight of the short exposure
+
+        // pyrUp of the next coarser level, one buffer per level so that their sizes stay fixed between calls
+        std::vector<cv::Mat> upsampled_long;
+        std::vector<cv::Mat> upsampled_difference;
+};
+
+} // namespace hdrplus
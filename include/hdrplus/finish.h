@@ -9,15 +9,57 @@
 #include <dirent.h>
 #include <hdrplus/params.h>
 #include <hdrplus/burst.h>
+#include <hdrplus/artifact_sink.h>
+#include <hdrplus/output_encoder.h>
+#include <hdrplus/exposure_fusion.h>
 
 namespace hdrplus
 {
     uint16_t uGammaCompress_1pix(float x, float threshold,float gainMin,float gainMax,float exponent);
     uint16_t uGammaDecompress_1pix(float x, float threshold,float gainMin,float gainMax,float exponent);
-    cv::Mat uGammaCompress_(cv::Mat m,float threshold,float gainMin,float gainMax,float exponent);
-    cv::Mat uGammaDecompress_(cv::Mat m,float threshold,float gainMin,float gainMax,float exponent);
-    cv::Mat gammasRGB(cv::Mat img, bool mode);
-    
+    // in place on CV_16UC1 / CV_16UC3 images
+    void uGammaCompress_(cv::Mat& m,float threshold,float gainMin,float gainMax,float exponent);
+    void uGammaDecompress_(cv::Mat& m,float threshold,float gainMin,float gainMax,float exponent);
+    void gammasRGB(cv::Mat& img, bool mode);
+    // gamma of img into result, reused when it already has the size and type of img
+    void gammasRGB(const cv::Mat& img, cv::Mat& result, bool mode);
+
+    // working images of localToneMap, allocated by the first call and reused by the next ones of the same size.
+    // Not meant to be shared between threads.
+    struct ltm_buffers
+    {
+        cv::Mat ltmImage;  // reduced resolution image (options.ltmDownsample > 1)
+        cv::Mat shortGray; // gray image (short exposure)
+        cv::Mat shortg;    // gamma corrected short exposure
+        cv::Mat longg;     // gamma corrected synthetic long exposure
+        cv::Mat fused;     // exposure fusion output, CV_32FC1
+        cv::Mat fusedg;    // fused exposure, 16 bit
+        cv::Mat fusedGray; // fusedg without gamma
+        cv::Mat guide, gainMap, meanI, meanG, meanIG, meanII, a, b; // guided filter of the reduced resolution gain map
+        exposure_fusion fusion;
+    };
+
+    // working images of the 'opencv' sharpen engine (sharpenTriple), reused like ltm_buffers
+    struct sharpen_buffers
+    {
+        cv::Mat blur0, blur1, blur2; // Gaussian blur per scale
+        cv::Mat low0, low1, low2;    // |blur - image| per scale
+    };
+
+    // finish stages 5 - 7 on a developed CV_16UC3 RGB image
+    // local tone mapping in place, gain is set to the ltm gain used
+    void localToneMap(cv::Mat& image, const Options& options, ltm_buffers& buffers, int& gain);
+    // contrast enhancement (options.gtmContrast) and sRGB gamma in place
+    void globalToneMap(cv::Mat& image, const Options& options);
+    // sharpened image into sharpImage (not image), reused when it already has the size and type of image
+    void sharpenTriple(const cv::Mat& image, cv::Mat& sharpImage, const Tuning& tuning, const Options& options, sharpen_buffers& buffers);
+    // sharpenTriple in two steps, e.g. to encode strips while the next ones are sharpened: full frame blurs
+    // of the 'opencv' engine into buffers (nothing for 'banded'), then rows [rowStart, rowEnd) into the same
+    // rows of sharpImage, already allocated with the size and type of image
+    void sharpenBlurs(const cv::Mat& image, const Tuning& tuning, const Options& options, sharpen_buffers& buffers);
+    void sharpenRows(const cv::Mat& image, cv::Mat& sharpImage, const Tuning& tuning, const Options& options, sharpen_buffers& buffers,
+        int rowStart, int rowEnd);
+
 
 class finish
 {
@@ -27,9 +69,15 @@ class finish
         std::vector<std::string> rawPathList; // a list or array of the path to all burst imgs under burst Path
         int refIdx; // index of the reference img
         Parameters params;
+        std::shared_ptr<artifact_sink> artifacts; // intermediate images selected by params.flags, none when null
+        cv::Mat finalImage; // result of process, CV_16UC3 RGB
+        std::vector<uchar> encodedOutput; // finalImage encoded in params.options.outputFormat, empty for 'mat'
+        std::vector<output_image> scaledOutputs; // downscaled final image and encoding per params.options.outputSizes
+        ltm_buffers ltmBuffers; // local tone mapping working images, reused by the next process of the same size
+        sharpen_buffers sharpenBuffers; // sharpening blurs, reused the same way
         cv::Mat rawReference;
         // LibRaw libraw_processor_finish;
-        bayer_image* refBayer;
+        std::shared_ptr<bayer_image> refBayer;
 
         std::string mergedImgPath;
         finish() = default;
@@ -47,7 +95,7 @@ class finish
             this->burstPath = burstPath;
             this->mergedBayer = loadFromCSV(mergedBayerPath, CV_16UC1);//
             load_rawPathList(burstPath);
-            refBayer= new bayer_image(this->rawPathList[refIdx]);
+            refBayer = std::make_shared<bayer_image>(this->rawPathList[refIdx]);
             this->rawReference = refBayer->raw_image;//;grayscale_image
 
             // initialize parameters in libraw_processor_finish
@@ -63,11 +111,13 @@ class finish
 
         // finish pipeline func
         // void process(std::string burstPath, cv::Mat mergedBayer,int refIdx);
-        void process(const hdrplus::burst& burst_images);
+        // writeFinal: also store the final image (flag writeFinalImage) to options.output, and to the sink when set
+        void process(const hdrplus::burst& burst_images, bool writeFinal = true);
 
         // replace Mat a with Mat b
         void copy_mat_16U(cv::Mat& A, cv::Mat B);
-        void copy_rawImg2libraw(std::shared_ptr<LibRaw>& libraw_ptr, cv::Mat B);
+        // copy B (raw sized bayer image) into the raw buffer of an unpacked LibRaw context
+        void copy_rawImg2libraw(std::shared_ptr<LibRaw>& libraw_ptr, const cv::Mat& B);
 
         // postprocess
         // cv::Mat postprocess(std::shared_ptr<LibRaw>& libraw_ptr);
@@ -1,11 +1,13 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <opencv2/opencv.hpp> // all opencv header
 #include "hdrplus/burst.h"
 #include "hdrplus/align.h"
 #include "hdrplus/merge.h"
 #include "hdrplus/finish.h"
+#include "hdrplus/output_encoder.h"
 
 namespace hdrplus
 {
@@ -13,13 +15,46 @@ namespace hdrplus
 class hdrplus_pipeline
 {
     private:
+        hdrplus::Options options;
         hdrplus::align align_module;
         hdrplus::merge merge_module;
         hdrplus::finish finish_module;
+
+        // Align and merge rows [ row_start, row_end ) of the padded burst, return the merged padded bayer rows
+        cv::Mat align_merge( const hdrplus::burst& burst_images, int row_start, int row_end );
+
+        // Align and merge full frame, or in strips within options.memoryBudgetMB, return the merged bayer image without padding
+        cv::Mat align_merge_strips( const hdrplus::burst& burst_images );
+
+        // Whole pipeline, the final image is left in finish_module (and stored when write_final)
+        void run( const std::string& burst_path, const std::string& reference_image_path, bool write_final );
     
     public:
         void run_pipeline( const std::string& burst_path, const std::string& reference_image_path  );
+
+        /**
+         * @brief Run the pipeline without writing the final image
+         *
+         * @return final 16 bit RGB image and its encoding in options.outputFormat ('mat' leaves encoded empty),
+         *      followed by the downscaled outputs of options.outputSizes in the same order
+         */
+        std::vector<output_image> process( const std::string& burst_path, const std::string& reference_image_path );
+
+        // Align and merge only, the merged bayer image without padding
+        cv::Mat merge_burst( const std::string& burst_path, const std::string& reference_image_path );
+
+        /**
+         * @brief Smallest options.memoryBudgetMB accepted for a burst: the merged frame, plus one strip of
+         *      the row alignment with its halo rows on both sides (bands of every frame, align and merge working set),
+         *      and not below the decoding of one frame
+         *
+         * @param rows, cols padded bayer image size (burst::padded_size)
+         */
+        static int min_memory_budget_mb( int num_images, int rows, int cols, const hdrplus::Options& options );
+
         hdrplus_pipeline() = default;
+        // Options shared by burst (targetSNR), strips (memoryBudgetMB), merge (tilesize, temporalfactor, spatialfactor) and finish
+        explicit hdrplus_pipeline( const hdrplus::Options& options );
         ~hdrplus_pipeline() = default;
 };
 
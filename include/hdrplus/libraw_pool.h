@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory> // std::shared_ptr, std::unique_ptr
+#include <mutex>
+#include <libraw/libraw.h>
+
+namespace hdrplus
+{
+
+/**
+ * @brief Thread safe pool of reusable LibRaw contexts.
+ *      A LibRaw object is large (internal tables), so contexts are kept across frames and bursts
+ *      instead of being allocated per frame. checkout() hands a context to one owner only;
+ *      it goes back to the pool, after recycle(), when the last copy of the returned
+ *      std::shared_ptr is released. At most max_idle contexts are kept, others are freed.
+ */
+class libraw_pool : public std::enable_shared_from_this<libraw_pool>
+{
+    public:
+        // Process wide pool, used by bayer_image and finish
+        static std::shared_ptr<libraw_pool> shared();
+
+        // Pools are always owned by a std::shared_ptr: contexts checked out keep their pool alive (shared_from_this)
+        static std::shared_ptr<libraw_pool> create( size_t max_idle = 16 );
+        ~libraw_pool() = default;
+
+        // Check out an empty context (as after recycle())
+        std::shared_ptr<LibRaw> checkout();
+
+        // Check out a context with raw_path opened and unpacked, throws std::runtime_error on LibRaw errors
+        std::shared_ptr<LibRaw> checkout_unpacked( const std::string& raw_path );
+
+        // Contexts waiting in the pool
+        size_t num_idle() const;
+
+    private:
+        explicit libraw_pool( size_t max_idle );
+
+        size_t max_idle;
+        mutable std::mutex idle_mutex;
+        std::vector<std::unique_ptr<LibRaw>> idle;
+
+        void give_back( LibRaw* context );
+};
+
+} // namespace hdrplus
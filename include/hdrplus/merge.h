@@ -1,21 +1,102 @@
 #pragma once
 
 #include <vector>
+#include <climits> // USHRT_MAX
 #include <opencv2/opencv.hpp> // all opencv header
 #include <cmath>
 #include "hdrplus/burst.h"
-
-#define TILE_SIZE 16
-#define TEMPORAL_FACTOR 75
-#define SPATIAL_FACTOR 0.1
+#include "hdrplus/params.h"
+#include "hdrplus/artifact_sink.h"
 
 namespace hdrplus
 {
 
+/**
+ * @brief Lookup tables shared by every merge kernel of a given tile size.
+ *      Built once on first use and read only afterwards.
+ * 
+ * @tparam tile_size merge tile size (square tile)
+ */
+template< int tile_size >
+struct merge_tables
+{
+    // 2D raised cosine window w(r) * w(c), row major
+    float cosine_window_2d[ tile_size * tile_size ];
+
+    // |w| of every DFT bin, already in ifftshift order, row major
+    float frequency_distances[ tile_size * tile_size ];
+
+    static const merge_tables& get()
+    {
+        // Function local static, initialization is thread safe
+        static const merge_tables tables;
+        return tables;
+    }
+
+    private:
+        merge_tables()
+        {
+            float window_1d[ tile_size ];
+            for ( int i = 0; i < tile_size; ++i )
+            {
+                window_1d[ i ] = 1. / 2. - 1. / 2. * cos( 2 * M_PI * ( i + 1 / 2. ) / tile_size );
+            }
+
+            for ( int row_i = 0; row_i < tile_size; ++row_i )
+            {
+                // Signed frequency of DFT bin after ifftshift
+                int freq_row_i = row_i < tile_size / 2 ? row_i : row_i - tile_size;
+                for ( int col_i = 0; col_i < tile_size; ++col_i )
+                {
+                    int freq_col_i = col_i < tile_size / 2 ? col_i : col_i - tile_size;
+                    cosine_window_2d[ row_i * tile_size + col_i ] = window_1d[ col_i ] * window_1d[ row_i ];
+                    frequency_distances[ row_i * tile_size + col_i ] = \
+                        sqrtf( float( freq_row_i * freq_row_i + freq_col_i * freq_col_i ) );
+                }
+            }
+        }
+};
+
+/**
+ * @brief Read only view of one bayer channel inside a bayer image, nothing is copied.
+ *      Channel i sits at (row, col) offset (i % 2, i / 2) of every 2x2 bayer block,
+ *      same channel order as extract_rgb_from_bayer. Pixel (row, col) is ptr( row )[ 2 * col ].
+ */
+struct bayer_channel_view
+{
+    const uint16_t* data; // first pixel of the channel
+    size_t step;          // uint16_t between two channel rows (two bayer rows)
+    int rows;
+    int cols;
+
+    bayer_channel_view( const cv::Mat& bayer_image, int channel ) : \
+        data( bayer_image.ptr<uint16_t>( channel & 1 ) + ( channel >> 1 ) ), \
+        step( bayer_image.step1() * 2 ), \
+        rows( bayer_image.rows / 2 ), \
+        cols( bayer_image.cols / 2 ) {}
+
+    const uint16_t* ptr( int row ) const { return data + row * step; }
+};
+
+// Tiles that took a shortcut in a merge (options.skipTrivialTiles), over the four bayer channels
+struct merge_skip_stats
+{
+    long long num_tiles = 0;              // tiles of a frame
+    long long num_alternate_tiles = 0;    // tiles of the alternate frames
+    long long num_clipped_tiles = 0;      // reference saturated, copied as is
+    long long num_dark_tiles = 0;         // dark reference and every alternate static, plain average
+    long long num_skipped_alternates = 0; // alternate tiles merged without DFT (clipped or static)
+
+    double skipped_fraction() const { return num_alternate_tiles > 0 ? double( num_skipped_alternates ) / num_alternate_tiles : 0; }
+};
+
 class merge
 {
     public:
-        int offset = TILE_SIZE / 2;
+        // temporalfactor, spatialfactor, tilesize (8, 16, 32), mergeEngine and skipTrivialTiles are used by merge
+        Options options;
+        std::shared_ptr<artifact_sink> artifacts; // ref.png and merged.png (16 bit bayer), none when null
+        merge_skip_stats skip_stats; // of the last finalize()
         float baseline_lambda_shot = 3.24 * pow( 10, -4 );
         float baseline_lambda_read = 4.3 * pow( 10, -6 );
 
@@ -31,154 +112,110 @@ class merge
          *      Inner most two vector is for horizontal & vertical tiles 
          */
         void process( hdrplus::burst& burst_images, \
-                      std::vector<std::vector<std::vector<std::pair<int, int>>>>& alignments);
-
-
-        /*
-        std::vector<cv::Mat> get_other_tiles(); //return the other tile list T_1 to T_n
-
-        std::vector<cv::Mat> vector_math(string operation, reference_tile, other_tile_list); //for loop allowing operations across single element and list
-
-        std::vector<cv::Mat> scalar_vector_math(string operation, scalar num, std::vector<cv::Mat> tile_list); //for loop allowing operations across single element and list
-
-        std::vector<cv::Mat> average_vector(std::vector<cv::Mat> tile_list); //take average of vector elements
-
-        */
+                      const std::vector<std::vector<std::vector<std::pair<int, int>>>>& alignments );
 
-    private:
-        float tileRMS(cv::Mat tile) {
-            cv::Mat squared;
-            cv::multiply(tile, tile, squared);
-            return sqrt(cv::mean(squared)[0]);
-        }
 
-        std::vector<float> getNoiseVariance(std::vector<cv::Mat> tiles, float lambda_shot, float lambda_read) {
-            std::vector<float> noise_variance;
-            for (auto tile : tiles) {
-                noise_variance.push_back(lambda_shot * tileRMS(tile) + lambda_read);
-            }
-            return noise_variance;
-        }
-    
-        cv::Mat cosineWindow1D(cv::Mat input, int window_size = TILE_SIZE) {
-            cv::Mat output = input.clone();
-            for (int i = 0; i < input.cols; ++i) {
-                output.at<float>(0, i) = 1. / 2. - 1. / 2. * cos(2 * M_PI * (input.at<float>(0, i) + 1 / 2.) / window_size);
-            }
-            return output;
-        }
-
-        cv::Mat cosineWindow2D(cv::Mat tile) {
-            int window_size = tile.rows; // Assuming square tile
-            cv::Mat output_tile = tile.clone();
-
-            cv::Mat window = cv::Mat::zeros(1, window_size, CV_32F);
-            for(int i = 0; i < window_size; ++i) {
-                window.at<float>(i) = i;
-            }
-
-            cv::Mat window_x = cosineWindow1D(window, window_size);
-            window_x = cv::repeat(window_x, window_size, 1);
-            cv::Mat window_2d = window_x.mul(window_x.t());
-
-            cv::Mat window_applied;
-            cv::multiply(tile, window_2d, window_applied, 1, CV_32F);
-            return window_applied;
-        }
-
-        cv::Mat cat2Dtiles(std::vector<std::vector<cv::Mat>> tiles) {
-            std::vector<cv::Mat> rows;
-            for (auto row_tiles : tiles) {
-                cv::Mat row;
-                cv::hconcat(row_tiles, row);
-                rows.push_back(row);
-            }
-            cv::Mat img;
-            cv::vconcat(rows, img);
-            return img;
-        }
-
-        void circshift(cv::Mat &out, const cv::Point &delta)
-        {
-            cv::Size sz = out.size();
-
-            // error checking
-            assert(sz.height > 0 && sz.width > 0);
-
-            // no need to shift
-            if ((sz.height == 1 && sz.width == 1) || (delta.x == 0 && delta.y == 0))
-                return;
-
-            // delta transform
-            int x = delta.x;
-            int y = delta.y;
-            if (x > 0) x = x % sz.width;
-            if (y > 0) y = y % sz.height;
-            if (x < 0) x = x % sz.width + sz.width;
-            if (y < 0) y = y % sz.height + sz.height;
+        /**
+         * @brief Start an incremental merge with the reference frame.
+         *      Only the reference frame and the per tile accumulators stay resident.
+         * 
+         * @param reference_image padded reference bayer image
+         * @param lambda_shot shot noise parameter of reference image
+         * @param lambda_read read noise parameter of reference image
+         * @param white_level clipping level, used by options.skipTrivialTiles
+         * @param black_level black level, used by options.skipTrivialTiles
+         */
+        void init( const cv::Mat& reference_image, double lambda_shot, double lambda_read, \
+                   int white_level = USHRT_MAX, int black_level = 0 );
 
+        /**
+         * @brief Fold one alternate frame into the accumulators (4.2 temporal denoising).
+         *      Can be called as soon as the alignment of this frame is available.
+         * 
+         * @param alternate_image padded alternate bayer image
+         * @param alignment alignment of this frame, per grayscale tile
+         */
+        void add_frame( const cv::Mat& alternate_image, \
+                        const std::vector<std::vector<std::pair<int, int>>>& alignment );
 
-            // in case of multiple dimensions
-            std::vector<cv::Mat> planes;
-            split(out, planes);
+        /**
+         * @brief Fold the tiles of one alternate frame that use the alignment tile rows
+         *      [ align_row_start, align_row_end ) into the accumulators. Once every alignment
+         *      tile row of the frame went through this, call end_frame().
+         *      Same result as add_frame(), for fused align and merge.
+         */
+        void add_frame( const cv::Mat& alternate_image, \
+                        const std::vector<std::vector<std::pair<int, int>>>& alignment, \
+                        int align_row_start, int align_row_end );
 
-            for (size_t i = 0; i < planes.size(); i++)
-            {
-                // vertical
-                cv::Mat tmp0, tmp1, tmp2, tmp3;
-                cv::Mat q0(planes[i], cv::Rect(0, 0, sz.width, sz.height - y));
-                cv::Mat q1(planes[i], cv::Rect(0, sz.height - y, sz.width, y));
-                q0.copyTo(tmp0);
-                q1.copyTo(tmp1);
-                tmp0.copyTo(planes[i](cv::Rect(0, y, sz.width, sz.height - y)));
-                tmp1.copyTo(planes[i](cv::Rect(0, 0, sz.width, y)));
-
-                // horizontal
-                cv::Mat q2(planes[i], cv::Rect(0, 0, sz.width - x, sz.height));
-                cv::Mat q3(planes[i], cv::Rect(sz.width - x, 0, x, sz.height));
-                q2.copyTo(tmp2);
-                q3.copyTo(tmp3);
-                tmp2.copyTo(planes[i](cv::Rect(x, 0, sz.width - x, sz.height)));
-                tmp3.copyTo(planes[i](cv::Rect(0, 0, x, sz.height)));
-            }
+        void end_frame();
 
-            cv::merge(planes, out);
-        }
+        /**
+         * @brief Spatial denoising, cosine window merging of all tiles and release of the accumulators.
+         * 
+         * @return merged padded bayer image
+         */
+        cv::Mat finalize();
 
-        void fftshift(cv::Mat &out)
-        {
-            cv::Size sz = out.size();
-            cv::Point pt(0, 0);
-            pt.x = (int) floor(sz.width / 2.0);
-            pt.y = (int) floor(sz.height / 2.0);
-            circshift(out, pt);
-        }
+        /**
+         * @brief Same as finalize(), and store the merged bayer image without padding in burst_images
+         */
+        void finalize( hdrplus::burst& burst_images );
 
-        void ifftshift(cv::Mat &out)
+    private:
+        // How a tile is merged when options.skipTrivialTiles is set
+        enum tile_class_t : uint8_t
         {
-            cv::Size sz = out.size();
-            cv::Point pt(0, 0);
-            pt.x = (int) ceil(sz.width / 2.0);
-            pt.y = (int) ceil(sz.height / 2.0);
-            circshift(out, pt);
-        }
-
-        std::vector<cv::Mat> getReferenceTiles(cv::Mat reference_image);
+            TILE_MERGE = 0, // regular merge
+            TILE_CLIPPED,   // reference saturated at white level, copied as is
+            TILE_DARK,      // reference within noise of black level, plain average while every alternate is static
+            TILE_STATIC     // regular merge, some alternates matched within noise and were summed in spatial domain
+        };
+
+        // Incremental merge state, set by init()
+        cv::Mat reference_image;   // padded reference bayer image
+        int white_level = USHRT_MAX;
+        int black_level = 0;
+        int merge_tile_size = 0;   // options.tilesize at init()
+        bool spatial_engine = false; // options.mergeEngine at init()
+        int num_frames = 0;        // number of frames merged, including reference
+        int num_tiles_row = 0;
+        int num_tiles_col = 0;
+
+        // Per bayer channel, flat per tile arrays (tile (y, x) at y * num_tiles_col + x)
+        std::vector<float> noise_variance[ 4 ];
+        std::vector<float> reference_tiles_DFT[ 4 ]; // tile_size * tile_size complex per tile
+        std::vector<float> merged_tiles_DFT[ 4 ];    // running sum of the pairwise merged tiles
+        std::vector<float> merged_tiles[ 4 ];        // tile_size * tile_size running sum per tile (spatial engine, skipped tiles)
+        std::vector<uint8_t> tile_class[ 4 ];        // tile_class_t per tile
+
+        // Skipped tile counts over all channels
+        long long num_clipped_tiles = 0;
+        long long num_dark_tiles = 0;
+        long long num_static_tiles = 0;
 
-        cv::Mat mergeTiles(std::vector<cv::Mat> tiles, int rows, int cols);
-
-        cv::Mat processChannel( hdrplus::burst& burst_images, \
-                      std::vector<std::vector<std::vector<std::pair<int, int>>>>& alignments, \
-                      cv::Mat channel_image, \
-                      std::vector<cv::Mat> alternate_channel_i_list,\
-                      float lambda_shot, \
-                      float lambda_read);
+        /**
+         * @brief Noise variance of every reference tile (sigma**2 = lambda_shot * tileRMS + lambda_read)
+         *      computed in a single pass over the channel image.
+         * 
+         * @param tile_range if not null, filled with the (min, max) pixel value of every tile from the same pass
+         * @return flat array, tile (y, x) at index y * num_tiles_col + x
+         */
+        template< int tile_size >
+        std::vector<float> getNoiseVariance(const bayer_channel_view& channel_image, float lambda_shot, float lambda_read, \
+                                            std::vector<std::pair<uint16_t, uint16_t>>* tile_range = nullptr);
 
-        //temporal denoise
-        std::vector<cv::Mat> temporal_denoise(std::vector<cv::Mat> tiles, std::vector<std::vector<cv::Mat>> alt_tiles, std::vector<float> noise_variance, float temporal_factor);
-        std::vector<cv::Mat> spatial_denoise(std::vector<cv::Mat> tiles, int num_alts, std::vector<float> noise_variance, float spatial_factor);
+        // Tile size is a template argument, instantiated for 8, 16 and 32 in merge.cpp
+        template< int tile_size >
+        void initTiles( float lambda_shot, float lambda_read );
 
+        template< int tile_size >
+        void addFrameTiles( const cv::Mat& alternate_image, \
+                            const std::vector<std::vector<std::pair<int, int>>>& alignment, \
+                            int align_row_start, int align_row_end );
 
+        template< int tile_size >
+        cv::Mat finalizeTiles();
 };
 
 } // namespace hdrplus
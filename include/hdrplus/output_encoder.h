@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <future> // std::future
+#include <opencv2/opencv.hpp> // all opencv header
+
+namespace hdrplus
+{
+
+/**
+ * @brief Final image of a run, kept in memory
+ */
+struct output_image
+{
+    cv::Mat image;                // CV_16UC3 RGB, sharpened final image
+    std::vector<uchar> encoded;   // file content in Options::outputFormat, empty for 'mat'
+};
+
+/**
+ * @brief Baseline JPEG encoder working on horizontal strips of the image in parallel.
+ *      Every strip is encoded on its own thread as soon as it is added, then the entropy coded
+ *      segments are joined with restart markers (the restart interval is the number of MCUs of
+ *      a strip) under the header of the first strip. The result is one standard JPEG file.
+ */
+class jpeg_strip_encoder
+{
+    public:
+        jpeg_strip_encoder( int rows, int cols, int quality );
+        ~jpeg_strip_encoder() = default;
+
+        // Image rows per strip, every strip but the last has exactly this many rows
+        int strip_rows() const { return rows_per_strip; }
+
+        /**
+         * @brief Start encoding the next strip
+         *
+         * @param bgr_strip CV_8UC3 BGR rows [ i * strip_rows(), ... ) of the image, strips added in order
+         */
+        void add_strip( const cv::Mat& bgr_strip );
+
+        // Wait for every strip and return the JPEG file
+        std::vector<uchar> finish();
+
+    private:
+        int rows;
+        int cols;
+        int quality;
+        int rows_per_strip;
+        int mcus_per_strip = 0;   // restart interval, 0 when the image is encoded as a single strip
+        std::vector<std::future<std::vector<uchar>>> strips;
+};
+
+/**
+ * @brief Encode the final 16 bit RGB image
+ *
+ * @param format 'mat' (nothing to encode, returns empty), 'jpeg' (8 bit, parallel strips), 'png' (8 bit) or 'tiff' (16 bit)
+ * @param jpeg_quality JPEG quality 0 - 100
+ */
+std::vector<uchar> encode_output( const cv::Mat& rgb_image, const std::string& format, int jpeg_quality );
+
+/**
+ * @brief Downscaled copies of the final image from one decimating pyramid. The image is halved with
+ *      cv::pyrDown while a level stays at least twice the target size, the last step to the exact size
+ *      is a cv::resize INTER_AREA of less than 2x. Smaller outputs continue from the levels of larger ones.
+ *
+ * @param image final 16 bit image
+ * @param long_sides size of the long image side of every output, outputs not smaller than image share its pixels
+ * @return one image per long_sides entry, same type as image
+ */
+std::vector<cv::Mat> downscale_outputs( const cv::Mat& image, const std::vector<int>& long_sides );
+
+} // namespace hdrplus
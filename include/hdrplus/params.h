@@ -1,7 +1,8 @@
 #pragma once
 
 #include <string>
-#include <memory> // std::shared_ptr
+#include <vector>
+#include <memory> // std::shared_ptr, std::unique_ptr
 #include <opencv2/opencv.hpp> // all opencv header
 #include <libraw/libraw.h>
 
@@ -22,13 +23,28 @@ class RawpyArgs{
 class Options{
     public:
         std::string input = "";
-        std::string output = "";
+        std::string output = ""; // final image path, FinalImage.<outputFormat extension> when empty (also copied to the artifact sink as jpeg)
+        std::string outputFormat = "mat"; // final image kept in memory 'mat' (16 bit RGB only) or also encoded as 'jpeg' 'png' 'tiff' (16 bit), 'jpeg' strips encoded while the next ones are sharpened
+        int jpegQuality = 95; // JPEG quality 0 - 100 of outputFormat 'jpeg'
+        std::vector<int> outputSizes; // long side of downscaled outputs made along with the full size one, e.g. {2048, 320}
+        std::string artifactDir = ""; // intermediate images encoded in the background into artifactDir/run_*/, empty disables them
         std::string mode = "full"; //'full' 'align' 'merge' 'finish'
         int reference = 0;
         float temporalfactor=75.0;
         float spatialfactor = 0.1;
+        int tilesize = 16; // merge tile size (8, 16, 32)
+        std::string mergeEngine = "dft"; // 'dft' (Fourier domain Wiener merge) 'spatial' (fast, no FFT)
+        bool skipTrivialTiles = false; // merge shortcut for clipped, black and static tiles
+        float targetSNR = 0; // burst keeps the frames needed to reach this merged SNR, 0 keeps every frame
+        float minFrameSNRGain = 0; // burst stops adding frames once one adds less relative SNR (e.g. 0.05), 0 keeps every frame
+        int memoryBudgetMB = 0; // align and merge in strips within this many MB, frames spilled to temporary files (minimum: hdrplus_pipeline::min_memory_budget_mb), 0 for full frame in memory
+        int fusedTileRows = 0; // merge every block of this many finest level tile rows right after aligning it, 0 merges whole frames
+        int previewScale = 0; // preview on 2x2 binned bayer quads, merge tiles halved, finish at 1/2 (2) or 1/4 (4) size; 0 full resolution
+        std::string frontEnd = "libraw"; // finish raw front end 'libraw' (dcraw_process, reference) 'mhc' 'bilinear' (native demosaic)
         int ltmGain=-1;
+        int ltmDownsample = 1; // local tone map fusion and gains at 1/ltmDownsample resolution (4, 8), guided upsampling; 1 full resolution
         double gtmContrast=0.075;
+        std::string sharpenEngine = "opencv"; // 'opencv' (GaussianBlur and full frame passes, reference) 'banded' (single pass over row bands, may differ near thresholds)
         int verbose=2; // (0, 1, 2, 3, 4, 5)
 
 };
@@ -45,8 +61,8 @@ class Tuning{
 class Parameters{
     public:
         std::unordered_map<std::string,bool> flags{
-            {"writeReferenceImage",true},
-            {"writeGammaReference", true},
+            {"writeReferenceImage",false},
+            {"writeGammaReference", false},
             {"writeMergedImage", true},
             {"writeGammaMerged", true},
             {"writeShortExposure", true},
@@ -55,8 +71,9 @@ class Parameters{
             {"writeLTMImage", true},
             {"writeLTMGamma", true},
             {"writeGTMImage", true},
-            {"writeReferenceFinal", true},
-            {"writeFinalImage", true}
+            {"writeReferenceFinal", false}, // reference comparison branch (with the two above), runs concurrently with the merged image
+            {"writeFinalImage", true},
+            {"writeMergedCSV", false} // debug export of the merged bayer image as merged.csv
         };
 
         RawpyArgs rawpyArgs;
@@ -67,6 +84,13 @@ class Parameters{
 
 };
 
+// Owner of an image made by LibRaw dcraw_make_mem_image / dcraw_make_mem_thumb
+struct libraw_image_deleter{
+    void operator()(libraw_processed_image_t* image) const { LibRaw::dcraw_clear_mem(image); }
+};
+typedef std::unique_ptr<libraw_processed_image_t, libraw_image_deleter> libraw_image_ptr;
+
+// dcraw_process of libraw_ptr with rawpyArgs, returns a copy of the developed image (LibRaw memory is released)
 cv::Mat postprocess(std::shared_ptr<LibRaw>& libraw_ptr, RawpyArgs rawpyArgs);
 void setParams(std::shared_ptr<LibRaw>& libraw_ptr, RawpyArgs rawpyArgs);
 
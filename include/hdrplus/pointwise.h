@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <functional> // std::function
+#include <opencv2/opencv.hpp> // all opencv header
+
+namespace hdrplus
+{
+
+/**
+ * @brief Chain of pointwise stages on 16 bit values (gamma, contrast curve, gain ...) fused into a single pass.
+ *      Stages are composed into one 65536 entry lookup table when they are appended. Every stage sees the
+ *      16 bit value produced by the previous one, so applying the chain gives the same result as running
+ *      the stages one after the other over the whole image, with one read and one write.
+ */
+class pointwise_chain
+{
+    public:
+        typedef std::function<uint16_t(uint16_t)> stage_t;
+
+        pointwise_chain();
+        ~pointwise_chain() = default;
+
+        /**
+         * @brief Append a stage (evaluated 65536 times here, never per pixel)
+         *
+         * @return *this, to append stages in one expression
+         */
+        pointwise_chain& then( const stage_t& stage );
+
+        /**
+         * @brief Apply the chain to a CV_16UC1 or CV_16UC3 image, multi-threaded over blocks of rows
+         *
+         * @param depth CV_16U, or CV_8U to fold the 16 to 8 bit conversion of convert16bit2_8bit_ in the same pass
+         * @param swap_rb swap channel 0 and 2 of 3 channel images in the same pass (RGB to BGR for imwrite)
+         * @return new image, input is not modified
+         */
+        cv::Mat apply( const cv::Mat& image, int depth = CV_16U, bool swap_rb = false ) const;
+
+        // Same as above into result, which is reused when it already has the output size and type (may be image for CV_16U)
+        void apply( const cv::Mat& image, cv::Mat& result, int depth = CV_16U, bool swap_rb = false ) const;
+
+        // Same as apply() with 16 bit output, written back into image
+        void apply_inplace( cv::Mat& image, bool swap_rb = false ) const;
+
+        // Composed lookup table, entry v is the chain applied to v
+        const std::vector<uint16_t>& table() const { return lut; }
+
+    private:
+        std::vector<uint16_t> lut;
+};
+
+} // namespace hdrplus
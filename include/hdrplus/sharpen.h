@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/opencv.hpp> // all opencv header
+
+namespace hdrplus
+{
+
+/**
+ * @brief Thresholded three scale unsharp masking of finish in a single pass. Blurs are computed in float
+ *      and rounded, not with cv::GaussianBlur's kernels, so a blur may differ by one unit: the result matches
+ *      sharpenTriple_ within one unit except where |blur - image| is within one unit of a threshold, there
+ *      the two may choose different sides of it and differ by the sharpening amount.
+ *      Rows are processed in bands per thread. For every output row the three separable Gaussian
+ *      blurs share the reads of the input rows of the largest kernel, and the unsharp combine runs
+ *      on the blurred row buffers right away. No full frame intermediate image is allocated.
+ *
+ * @param image CV_16U image, any number of channels
+ * @param amounts sharpening amount per scale
+ * @param sigmas Gaussian sigma per scale (kernel size as cv::GaussianBlur with Size(0, 0) on 16 bit data)
+ * @param thresholds per scale, sharpening is applied where |blur - image| >= threshold * 65535
+ * @return sharpened image, same type as image
+ */
+cv::Mat sharpen_triple_banded( const cv::Mat& image, \
+                               const std::vector<float>& amounts, \
+                               const std::vector<float>& sigmas, \
+                               const std::vector<float>& thresholds );
+
+/**
+ * @brief Same as above for output rows [ row_start, row_end ) only, written into result.
+ *      Input rows outside the range are read as the blur support, so consecutive row ranges give
+ *      the full frame result, e.g. to hand finished strips to an encoder while the next ones are sharpened.
+ *
+ * @param result preallocated with the size and type of image
+ */
+void sharpen_triple_banded( const cv::Mat& image, \
+                            const std::vector<float>& amounts, \
+                            const std::vector<float>& sigmas, \
+                            const std::vector<float>& thresholds, \
+                            cv::Mat& result, int row_start, int row_end );
+
+} // namespace hdrplus
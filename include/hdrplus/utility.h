@@ -29,6 +29,24 @@
 namespace hdrplus
 {
 
+/**
+ * @brief Reflect 101 border index (OpenCV BORDER_DEFAULT, cv::borderInterpolate): mirror into [ 0, size )
+ *      without repeating the edge, so bayer parity is kept. Offsets larger than the image reflect again.
+ */
+inline int reflect_101( int i, int size )
+{
+    if ( size == 1 )
+        return 0;
+    while ( i < 0 || i >= size )
+    {
+        if ( i < 0 )
+            i = -i;
+        if ( i >= size )
+            i = 2 * ( size - 1 ) - i;
+    }
+    return i;
+}
+
 
 template <typename T, int kernel>
 cv::Mat box_filter_kxk( const cv::Mat& src_image )
@@ -78,6 +96,38 @@ cv::Mat box_filter_kxk( const cv::Mat& src_image )
 }
 
 
+/**
+ * @brief 2x2 binning of a bayer image keeping the bayer pattern (preview).
+ *      Every 4x4 block of 2x2 bayer quads becomes one quad, each sample the rounded mean
+ *      of the four samples of its color in the block. Output is ( rows / 4 * 2, cols / 4 * 2 ).
+ */
+template <typename T>
+cv::Mat bin_bayer_2x2( const cv::Mat& bayer_image )
+{
+    cv::Mat binned_image( bayer_image.rows / 4 * 2, bayer_image.cols / 4 * 2, bayer_image.type() );
+
+    #pragma omp parallel for
+    for ( int row_i = 0; row_i < binned_image.rows; ++row_i )
+    {
+        // Source rows of the same color: same parity, two rows apart
+        int src_row_i = ( row_i / 2 ) * 4 + ( row_i % 2 );
+        const T* src_row_0 = bayer_image.ptr<T>( src_row_i );
+        const T* src_row_1 = bayer_image.ptr<T>( src_row_i + 2 );
+        T* binned_row = binned_image.ptr<T>( row_i );
+
+        for ( int col_i = 0; col_i < binned_image.cols; ++col_i )
+        {
+            int src_col_i = ( col_i / 2 ) * 4 + ( col_i % 2 );
+            int sum = int( src_row_0[ src_col_i ] ) + src_row_0[ src_col_i + 2 ] + \
+                      src_row_1[ src_col_i ] + src_row_1[ src_col_i + 2 ];
+            binned_row[ col_i ] = T( ( sum + 2 ) / 4 );
+        }
+    }
+
+    return binned_image;
+}
+
+
 template <typename T, int kernel>
 cv::Mat downsample_nearest_neighbour( const cv::Mat& src_image )
 {
@@ -3,6 +3,7 @@
 #include <limits>
 #include <cstdio>
 #include <utility> // std::make_pair
+#include <algorithm> // std::min
 #include <stdexcept> // std::runtime_error
 #include <opencv2/opencv.hpp> // all opencv header
 #include <omp.h>
@@ -50,7 +51,9 @@ static void align_image_level( \
     int curr_tile_size, \
     int prev_tile_size, \
     int search_radiou, \
-    int distance_type );
+    int distance_type, \
+    const std::function<void(int, int)>& on_rows_aligned = nullptr, \
+    int block_tile_rows = 0 );
 
 
 // Function Implementations
@@ -447,7 +450,9 @@ void align_image_level( \
     int curr_tile_size, \
     int prev_tile_size, \
     int search_radiou, \
-    int distance_type )
+    int distance_type, \
+    const std::function<void(int, int)>& on_rows_aligned, \
+    int block_tile_rows )
 {
     // Every align image level share the same distance function. 
     // Use function ptr to reduce if else overhead inside for loop
@@ -660,128 +665,141 @@ void align_image_level( \
     std::vector<std::vector<uint16_t>> distances( num_tiles_h, std::vector<uint16_t>( num_tiles_w, 0 ));
 
     /* Iterate through all reference tile & compute distance */
-    #pragma omp parallel for collapse(2)
-    for ( int ref_tile_row_i = 0; ref_tile_row_i < num_tiles_h; ref_tile_row_i++ )
+    // Tile rows are processed in blocks when on_rows_aligned is set, the callback runs after each
+    // block while its pixels are still in cache
+    int block_rows = ( on_rows_aligned && block_tile_rows > 0 ) ? block_tile_rows : num_tiles_h;
+    for ( int block_row_start = 0; block_row_start < num_tiles_h; block_row_start += block_rows )
     {
-        for ( int ref_tile_col_i = 0; ref_tile_col_i < num_tiles_w; ref_tile_col_i++ )
-        {
-            // Upper left index of reference tile
-            int ref_tile_row_start_idx_i = ref_tile_row_i * curr_tile_size / 2;
-            int ref_tile_col_start_idx_i = ref_tile_col_i * curr_tile_size / 2;
-
-            // printf("\nRef img tile [%d, %d] -> start idx [%d, %d] (row, col)\n", \
-            //    ref_tile_row_i, ref_tile_col_i, ref_tile_row_start_idx_i, ref_tile_col_start_idx_i );
-            // printf("\nRef img tile [%d, %d]\n", ref_tile_row_i, ref_tile_col_i );
-            // print_tile<uint16_t>( ref_img, curr_tile_size, ref_tile_row_start_idx_i, ref_tile_col_start_idx_i );
-
-            // Upsampled alignment at this tile
-            // Alignment are relative displacement in pixel value
-            int prev_alignment_row_i = upsampled_prev_aligement.at( ref_tile_row_i ).at( ref_tile_col_i ).first;
-            int prev_alignment_col_i = upsampled_prev_aligement.at( ref_tile_row_i ).at( ref_tile_col_i ).second;
-
-            // Alternative image tile start idx
-            int alt_tile_row_start_idx_i = ref_tile_row_start_idx_i + prev_alignment_row_i;
-            int alt_tile_col_start_idx_i = ref_tile_col_start_idx_i + prev_alignment_col_i;
-
-            // Ensure alternative image tile within range
-            if ( alt_tile_row_start_idx_i < 0 )
-                alt_tile_row_start_idx_i = 0;
-            if ( alt_tile_col_start_idx_i < 0 )
-                alt_tile_col_start_idx_i = 0;
-            if ( alt_tile_row_start_idx_i > alt_tile_row_idx_max )
-            {
-                // int before = alt_tile_row_start_idx_i;
-                alt_tile_row_start_idx_i = alt_tile_row_idx_max;
-                // printf("@@ change start x from %d to %d\n", before, alt_tile_row_idx_max);
-            }
-            if ( alt_tile_col_start_idx_i > alt_tile_col_idx_max )
-            {
-                // int before = alt_tile_col_start_idx_i;
-                alt_tile_col_start_idx_i = alt_tile_col_idx_max;
-                // printf("@@ change start y from %d to %d\n", before, alt_tile_col_idx_max );
-            }
+        int block_row_end = std::min( block_row_start + block_rows, num_tiles_h );
 
-            // Explicitly caching reference image tile
-            cv::Mat ref_img_tile_i = extract_ref_img_tile( ref_img, ref_tile_row_start_idx_i, ref_tile_col_start_idx_i );
-            cv::Mat alt_img_search_i = extract_alt_img_search( alt_img_pad, alt_tile_row_start_idx_i, alt_tile_col_start_idx_i );
-
-            // Because alternative image is padded with search radious. 
-            // Using same coordinate with reference image will automatically considered search radious * 2
-            // printf("Alt image tile [%d, %d]-> start idx [%d, %d]\n", \
-            //     ref_tile_row_i, ref_tile_col_i, alt_tile_row_start_idx_i, alt_tile_col_start_idx_i );
-            // printf("\nAlt image tile [%d, %d]\n", ref_tile_row_i, ref_tile_col_i );
-            // print_tile<uint16_t>( alt_img_pad, curr_tile_size + 2 * search_radiou, alt_tile_row_start_idx_i, alt_tile_col_start_idx_i );
-
-            // Search based on L1/L2 distance
-            unsigned long long min_distance_i = ULONG_LONG_MAX;
-            int min_distance_row_i = -1;
-            int min_distance_col_i = -1;
-            for ( int search_row_j = 0; search_row_j < ( search_radiou * 2 + 1 ); search_row_j++ )
+        #pragma omp parallel for collapse(2)
+        for ( int ref_tile_row_i = block_row_start; ref_tile_row_i < block_row_end; ref_tile_row_i++ )
+        {
+            for ( int ref_tile_col_i = 0; ref_tile_col_i < num_tiles_w; ref_tile_col_i++ )
             {
-                for ( int search_col_j = 0; search_col_j < ( search_radiou * 2 + 1 ); search_col_j++ )
+                // Upper left index of reference tile
+                int ref_tile_row_start_idx_i = ref_tile_row_i * curr_tile_size / 2;
+                int ref_tile_col_start_idx_i = ref_tile_col_i * curr_tile_size / 2;
+
+                // printf("\nRef img tile [%d, %d] -> start idx [%d, %d] (row, col)\n", \
+                //    ref_tile_row_i, ref_tile_col_i, ref_tile_row_start_idx_i, ref_tile_col_start_idx_i );
+                // printf("\nRef img tile [%d, %d]\n", ref_tile_row_i, ref_tile_col_i );
+                // print_tile<uint16_t>( ref_img, curr_tile_size, ref_tile_row_start_idx_i, ref_tile_col_start_idx_i );
+
+                // Upsampled alignment at this tile
+                // Alignment are relative displacement in pixel value
+                int prev_alignment_row_i = upsampled_prev_aligement.at( ref_tile_row_i ).at( ref_tile_col_i ).first;
+                int prev_alignment_col_i = upsampled_prev_aligement.at( ref_tile_row_i ).at( ref_tile_col_i ).second;
+
+                // Alternative image tile start idx
+                int alt_tile_row_start_idx_i = ref_tile_row_start_idx_i + prev_alignment_row_i;
+                int alt_tile_col_start_idx_i = ref_tile_col_start_idx_i + prev_alignment_col_i;
+
+                // Ensure alternative image tile within range
+                if ( alt_tile_row_start_idx_i < 0 )
+                    alt_tile_row_start_idx_i = 0;
+                if ( alt_tile_col_start_idx_i < 0 )
+                    alt_tile_col_start_idx_i = 0;
+                if ( alt_tile_row_start_idx_i > alt_tile_row_idx_max )
                 {
-                    // printf("\n--->tile at [%d, %d] search (%d, %d)\n", \
-                    //     ref_tile_row_i, ref_tile_col_i, search_row_j - search_radiou, search_col_j - search_radiou );
-
-                    // unsigned long long distance_j = distance_func_ptr( ref_img, alt_img_pad, \
-                    //     ref_tile_row_start_idx_i, ref_tile_col_start_idx_i, \
-                    //     alt_tile_row_start_idx_i + search_row_j, alt_tile_col_start_idx_i + search_col_j );
-
-                    // unsigned long long distance_j = distance_func_ptr( ref_img_tile_i, alt_img_pad, \
-                    //     0, 0, \
-                    //     alt_tile_row_start_idx_i + search_row_j, alt_tile_col_start_idx_i + search_col_j );
+                    // int before = alt_tile_row_start_idx_i;
+                    alt_tile_row_start_idx_i = alt_tile_row_idx_max;
+                    // printf("@@ change start x from %d to %d\n", before, alt_tile_row_idx_max);
+                }
+                if ( alt_tile_col_start_idx_i > alt_tile_col_idx_max )
+                {
+                    // int before = alt_tile_col_start_idx_i;
+                    alt_tile_col_start_idx_i = alt_tile_col_idx_max;
+                    // printf("@@ change start y from %d to %d\n", before, alt_tile_col_idx_max );
+                }
 
-                    unsigned long long distance_j = distance_func_ptr( ref_img_tile_i, alt_img_search_i, \
-                        0, 0, \
-                        search_row_j, search_col_j );
+                // Explicitly caching reference image tile
+                cv::Mat ref_img_tile_i = extract_ref_img_tile( ref_img, ref_tile_row_start_idx_i, ref_tile_col_start_idx_i );
+                cv::Mat alt_img_search_i = extract_alt_img_search( alt_img_pad, alt_tile_row_start_idx_i, alt_tile_col_start_idx_i );
+
+                // Because alternative image is padded with search radious. 
+                // Using same coordinate with reference image will automatically considered search radious * 2
+                // printf("Alt image tile [%d, %d]-> start idx [%d, %d]\n", \
+                //     ref_tile_row_i, ref_tile_col_i, alt_tile_row_start_idx_i, alt_tile_col_start_idx_i );
+                // printf("\nAlt image tile [%d, %d]\n", ref_tile_row_i, ref_tile_col_i );
+                // print_tile<uint16_t>( alt_img_pad, curr_tile_size + 2 * search_radiou, alt_tile_row_start_idx_i, alt_tile_col_start_idx_i );
+
+                // Search based on L1/L2 distance
+                unsigned long long min_distance_i = ULONG_LONG_MAX;
+                int min_distance_row_i = -1;
+                int min_distance_col_i = -1;
+                for ( int search_row_j = 0; search_row_j < ( search_radiou * 2 + 1 ); search_row_j++ )
+                {
+                    for ( int search_col_j = 0; search_col_j < ( search_radiou * 2 + 1 ); search_col_j++ )
+                    {
+                        // printf("\n--->tile at [%d, %d] search (%d, %d)\n", \
+                        //     ref_tile_row_i, ref_tile_col_i, search_row_j - search_radiou, search_col_j - search_radiou );
 
-                    // printf("<---tile at [%d, %d] search (%d, %d), new dis %llu, old dis %llu\n", \
-                    //     ref_tile_row_i, ref_tile_col_i, search_row_j - search_radiou, search_col_j - search_radiou, distance_j, min_distance_i );
+                        // unsigned long long distance_j = distance_func_ptr( ref_img, alt_img_pad, \
+                        //     ref_tile_row_start_idx_i, ref_tile_col_start_idx_i, \
+                        //     alt_tile_row_start_idx_i + search_row_j, alt_tile_col_start_idx_i + search_col_j );
 
-                    // If this is smaller distance
-                    if ( distance_j < min_distance_i )
-                    {
-                        min_distance_i = distance_j;
-                        min_distance_col_i = search_col_j;
-                        min_distance_row_i = search_row_j;
-                    }
+                        // unsigned long long distance_j = distance_func_ptr( ref_img_tile_i, alt_img_pad, \
+                        //     0, 0, \
+                        //     alt_tile_row_start_idx_i + search_row_j, alt_tile_col_start_idx_i + search_col_j );
 
-                    // If same value, choose the one closer to the original tile location
-                    if ( distance_j == min_distance_i && min_distance_row_i != -1 && min_distance_col_i != -1 )
-                    {
-                        int prev_distance_row_2_ref = min_distance_row_i - search_radiou;
-                        int prev_distance_col_2_ref = min_distance_col_i - search_radiou;
-                        int curr_distance_row_2_ref = search_row_j - search_radiou;
-                        int curr_distance_col_2_ref = search_col_j - search_radiou;
+                        unsigned long long distance_j = distance_func_ptr( ref_img_tile_i, alt_img_search_i, \
+                            0, 0, \
+                            search_row_j, search_col_j );
 
-                        int prev_distance_2_ref_sqr = prev_distance_row_2_ref * prev_distance_row_2_ref + prev_distance_col_2_ref * prev_distance_col_2_ref;
-                        int curr_distance_2_ref_sqr = curr_distance_row_2_ref * curr_distance_row_2_ref + curr_distance_col_2_ref * curr_distance_col_2_ref;
+                        // printf("<---tile at [%d, %d] search (%d, %d), new dis %llu, old dis %llu\n", \
+                        //     ref_tile_row_i, ref_tile_col_i, search_row_j - search_radiou, search_col_j - search_radiou, distance_j, min_distance_i );
 
-                        // previous min distance idx is farther away from ref tile start location
-                        if ( prev_distance_2_ref_sqr > curr_distance_2_ref_sqr )
+                        // If this is smaller distance
+                        if ( distance_j < min_distance_i )
                         {
-                            // printf("@@@ Same distance %d, choose closer one (%d, %d) instead of (%d, %d)\n", \
-                            //     distance_j, search_row_j, search_col_j, min_distance_row_i, min_distance_col_i);
+                            min_distance_i = distance_j;
                             min_distance_col_i = search_col_j;
                             min_distance_row_i = search_row_j;
                         }
+
+                        // If same value, choose the one closer to the original tile location
+                        if ( distance_j == min_distance_i && min_distance_row_i != -1 && min_distance_col_i != -1 )
+                        {
+                            int prev_distance_row_2_ref = min_distance_row_i - search_radiou;
+                            int prev_distance_col_2_ref = min_distance_col_i - search_radiou;
+                            int curr_distance_row_2_ref = search_row_j - search_radiou;
+                            int curr_distance_col_2_ref = search_col_j - search_radiou;
+
+                            int prev_distance_2_ref_sqr = prev_distance_row_2_ref * prev_distance_row_2_ref + prev_distance_col_2_ref * prev_distance_col_2_ref;
+                            int curr_distance_2_ref_sqr = curr_distance_row_2_ref * curr_distance_row_2_ref + curr_distance_col_2_ref * curr_distance_col_2_ref;
+
+                            // previous min distance idx is farther away from ref tile start location
+                            if ( prev_distance_2_ref_sqr > curr_distance_2_ref_sqr )
+                            {
+                                // printf("@@@ Same distance %d, choose closer one (%d, %d) instead of (%d, %d)\n", \
+                                //     distance_j, search_row_j, search_col_j, min_distance_row_i, min_distance_col_i);
+                                min_distance_col_i = search_col_j;
+                                min_distance_row_i = search_row_j;
+                            }
+                        }
                     }
                 }
-            }
 
-            // printf("tile at (%d, %d) alignment (%d, %d)\n", \
-            //    ref_tile_row_i, ref_tile_col_i, min_distance_row_i, min_distance_col_i );
+                // printf("tile at (%d, %d) alignment (%d, %d)\n", \
+                //    ref_tile_row_i, ref_tile_col_i, min_distance_row_i, min_distance_col_i );
 
-            int alignment_row_i = prev_alignment_row_i + min_distance_row_i - search_radiou;
-            int alignment_col_i = prev_alignment_col_i + min_distance_col_i - search_radiou;
+                int alignment_row_i = prev_alignment_row_i + min_distance_row_i - search_radiou;
+                int alignment_col_i = prev_alignment_col_i + min_distance_col_i - search_radiou;
 
-            std::pair<int, int> alignment_i( alignment_row_i, alignment_col_i );
+                std::pair<int, int> alignment_i( alignment_row_i, alignment_col_i );
 
-            // Add min_distance_i's corresbonding idx as min
-            curr_alignment.at( ref_tile_row_i ).at( ref_tile_col_i ) = alignment_i;
-            distances.at( ref_tile_row_i ).at( ref_tile_col_i ) = min_distance_i;
+                // Add min_distance_i's corresbonding idx as min
+                curr_alignment.at( ref_tile_row_i ).at( ref_tile_col_i ) = alignment_i;
+                distances.at( ref_tile_row_i ).at( ref_tile_col_i ) = min_distance_i;
+            }
         }
-    }
+
+        if ( on_rows_aligned )
+        {
+            on_rows_aligned( block_row_start, block_row_end );
+        }
+    } // for block of tile rows
 
     // printf("\n!!!!!Min distance for each tile \n");
     // for ( int tile_row = 0; tile_row < num_tiles_h; tile_row++ )
@@ -809,35 +827,51 @@ void align_image_level( \
 
 
 void align::process( const hdrplus::burst& burst_images, \
-                     std::vector<std::vector<std::vector<std::pair<int, int>>>>& images_alignment )
+                     std::vector<std::vector<std::vector<std::pair<int, int>>>>& images_alignment, \
+                     const std::function<void(int)>& on_image_aligned )
+{
+    if ( burst_images.spilled )
+    {
+        throw std::runtime_error("align needs the padded frames in memory, the burst is spilled (read_band)");
+    }
+    process( burst_images.grayscale_images_pad, burst_images.reference_image_idx, images_alignment, on_image_aligned );
+}
+
+
+void align::process( const std::vector<cv::Mat>& grayscale_images, int reference_image_idx, \
+                     std::vector<std::vector<std::vector<std::pair<int, int>>>>& images_alignment, \
+                     const std::function<void(int)>& on_image_aligned, \
+                     const rows_aligned_callback& on_rows_aligned, \
+                     int block_tile_rows )
 {
     #ifndef NDEBUG
     printf("%s::%s align::process start\n", __FILE__, __func__ ); fflush(stdout);
     #endif
 
+    int num_images = grayscale_images.size();
     images_alignment.clear();
-    images_alignment.resize( burst_images.num_images );
+    images_alignment.resize( num_images );
 
     // image pyramid per image, per pyramid level
     std::vector<std::vector<cv::Mat>> per_grayimg_pyramid;
 
 	// printf("!!!!! ref bayer padded\n");
-    // print_img<uint16_t>( burst_images.bayer_images_pad.at( burst_images.reference_image_idx) );
+    // print_img<uint16_t>( burst_images.bayer_images_pad.at( reference_image_idx) );
     // exit(1);
 
 	// printf("!!!!! ref gray padded\n");
-    // print_img<uint16_t>( burst_images.grayscale_images_pad.at( burst_images.reference_image_idx) );
+    // print_img<uint16_t>( burst_images.grayscale_images_pad.at( reference_image_idx) );
     // exit(1);
 
-    per_grayimg_pyramid.resize( burst_images.num_images );
+    per_grayimg_pyramid.resize( num_images );
 
     #pragma omp parallel for
-    for ( int img_idx = 0; img_idx < burst_images.num_images; ++img_idx )
+    for ( int img_idx = 0; img_idx < num_images; ++img_idx )
     {
         // per_grayimg_pyramid[ img_idx ][ 0 ] is the original image
         // per_grayimg_pyramid[ img_idx ][ 3 ] is the coarsest image
         build_per_grayimg_pyramid( per_grayimg_pyramid.at( img_idx ), \
-                                   burst_images.grayscale_images_pad.at( img_idx ), \
+                                   grayscale_images.at( img_idx ), \
                                    this->inv_scale_factors );
     }
 
@@ -855,16 +889,16 @@ void align::process( const hdrplus::burst& burst_images, \
     // for ( int level_i; level_i < num_levels; ++level_i )
     // {
     //     printf("\n\n!!!!! ref gray pyramid level %d img : \n" , level_i );
-    //     print_img<uint16_t>( per_grayimg_pyramid[ burst_images.reference_image_idx ][ level_i ] );
+    //     print_img<uint16_t>( per_grayimg_pyramid[ reference_image_idx ][ level_i ] );
     // }
     // exit(-1);
 
     // Align every image
-    const std::vector<cv::Mat>& ref_grayimg_pyramid = per_grayimg_pyramid[ burst_images.reference_image_idx ];
-    for ( int img_idx = 0; img_idx < burst_images.num_images; ++img_idx )
+    const std::vector<cv::Mat>& ref_grayimg_pyramid = per_grayimg_pyramid[ reference_image_idx ];
+    for ( int img_idx = 0; img_idx < num_images; ++img_idx )
     {
         // Do not align with reference image
-        if ( img_idx == burst_images.reference_image_idx )
+        if ( img_idx == reference_image_idx )
             continue;
 
         const std::vector<cv::Mat>& alt_grayimg_pyramid = per_grayimg_pyramid[ img_idx ];
@@ -874,6 +908,12 @@ void align::process( const hdrplus::burst& burst_images, \
         // level 3 : coarsest level
         std::vector<std::vector<std::pair<int, int>>> curr_alignment;
         std::vector<std::vector<std::pair<int, int>>> prev_alignment;
+
+        // Finest level alignment is final block by block
+        std::function<void(int, int)> on_level0_rows_aligned = [&]( int tile_row_start, int tile_row_end )
+        {
+            on_rows_aligned( img_idx, curr_alignment, tile_row_start, tile_row_end );
+        };
         for ( int level_i = num_levels - 1; level_i >= 0; level_i-- ) // 3,2,1,0
         {
             // make curr alignment as previous alignment
@@ -890,7 +930,9 @@ void align::process( const hdrplus::burst& burst_images, \
                 grayimg_tile_sizes[ level_i ],     // current level tile size
                 ( level_i == ( num_levels - 1 ) ? -1 : grayimg_tile_sizes[ level_i + 1 ] ), // previous level tile size
                 grayimg_search_radious[ level_i ], // search radious
-                distances[ level_i ] );            // L1/L2 distance
+                distances[ level_i ],              // L1/L2 distance
+                level_i == 0 && on_rows_aligned ? on_level0_rows_aligned : nullptr, // finest level blocks
+                block_tile_rows );
            
             // printf("@@@Alignment at level %d is h=%d, w=%d", level_i, curr_alignment.size(), curr_alignment.at(0).size() );
 
@@ -900,6 +942,11 @@ void align::process( const hdrplus::burst& burst_images, \
         // Alignment at grayscale image
         images_alignment.at( img_idx ).swap( curr_alignment );
 
+        if ( on_image_aligned )
+        {
+            on_image_aligned( img_idx );
+        }
+
         // printf("\n!!!!!Alternative Image Alignment\n");
         // for ( int tile_row = 0; tile_row < images_alignment.at( img_idx ).size(); tile_row++ )
         // {
@@ -0,0 +1,128 @@
+#include <cstdio>
+#include <cerrno>
+#include <cstring> // strerror
+#include <ctime>
+#include <atomic>
+#include <string>
+#include <algorithm> // std::max
+#include <stdexcept> // std::runtime_error
+#include <sys/stat.h> // mkdir
+#include <opencv2/opencv.hpp> // all opencv header
+#include "hdrplus/artifact_sink.h"
+
+namespace hdrplus
+{
+
+// Create output_root (if needed) and a new run directory inside it
+static std::string create_run_directory( const std::string& output_root )
+{
+    if ( mkdir( output_root.c_str(), 0755 ) != 0 && errno != EEXIST )
+    {
+        throw std::runtime_error("Error creating artifact directory " + output_root + " " + strerror( errno ));
+    }
+
+    char timestamp[ 32 ];
+    time_t now = time( nullptr );
+    struct tm local_time;
+    localtime_r( &now, &local_time );
+    strftime( timestamp, sizeof( timestamp ), "%Y%m%d_%H%M%S", &local_time );
+
+    // Several runs (or sinks) can start within the same second
+    static std::atomic<int> run_counter( 0 );
+    while ( true )
+    {
+        std::string run_directory = output_root + "/run_" + timestamp + "_" + std::to_string( run_counter++ );
+        if ( mkdir( run_directory.c_str(), 0755 ) == 0 )
+        {
+            return run_directory;
+        }
+        if ( errno != EEXIST )
+        {
+            throw std::runtime_error("Error creating artifact directory " + run_directory + " " + strerror( errno ));
+        }
+    }
+}
+
+async_file_sink::async_file_sink( const std::string& output_root, int num_threads, int max_queued ) : \
+    run_directory( create_run_directory( output_root ) ), \
+    max_queued( std::max( max_queued, 1 ) )
+{
+    for ( int thread_i = 0; thread_i < std::max( num_threads, 1 ); ++thread_i )
+    {
+        workers.emplace_back( &async_file_sink::worker_loop, this );
+    }
+
+    #ifndef NDEBUG
+    printf("%s::%s artifacts go to %s\n", __FILE__, __func__, run_directory.c_str() );
+    #endif
+}
+
+async_file_sink::~async_file_sink()
+{
+    {
+        std::lock_guard<std::mutex> lock( queue_mutex );
+        stopping = true;
+    }
+    work_available.notify_all();
+    for ( auto& worker : workers )
+    {
+        worker.join();
+    }
+}
+
+void async_file_sink::write( const std::string& name, const cv::Mat& image )
+{
+    std::unique_lock<std::mutex> lock( queue_mutex );
+    space_available.wait( lock, [ this ]() { return queue.size() < max_queued; } );
+    queue.emplace_back( name, image );
+    lock.unlock();
+    work_available.notify_one();
+}
+
+void async_file_sink::flush()
+{
+    std::unique_lock<std::mutex> lock( queue_mutex );
+    space_available.wait( lock, [ this ]() { return queue.empty() && num_active == 0; } );
+}
+
+void async_file_sink::worker_loop()
+{
+    while ( true )
+    {
+        std::pair<std::string, cv::Mat> artifact;
+        {
+            std::unique_lock<std::mutex> lock( queue_mutex );
+            // Queued artifacts are still stored after the destructor asked to stop
+            work_available.wait( lock, [ this ]() { return stopping || !queue.empty(); } );
+            if ( queue.empty() )
+            {
+                return;
+            }
+            artifact = std::move( queue.front() );
+            queue.pop_front();
+            ++num_active;
+        }
+        space_available.notify_all();
+
+        std::string path = run_directory + "/" + artifact.first;
+        try
+        {
+            if ( !cv::imwrite( path, artifact.second ) )
+            {
+                fprintf( stderr, "%s::%s failed to write %s\n", __FILE__, __func__, path.c_str() );
+            }
+        }
+        catch ( const cv::Exception& e )
+        {
+            fprintf( stderr, "%s::%s failed to write %s: %s\n", __FILE__, __func__, path.c_str(), e.what() );
+        }
+
+        {
+            std::lock_guard<std::mutex> lock( queue_mutex );
+            --num_active;
+        }
+        space_available.notify_all();
+    }
+}
+
+} // namespace hdrplus
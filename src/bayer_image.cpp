@@ -7,27 +7,16 @@
 #include <libraw/libraw.h>
 #include <exiv2/exiv2.hpp> // exiv2
 #include "hdrplus/bayer_image.h"
+#include "hdrplus/libraw_pool.h"
 #include "hdrplus/utility.h" // box_filter_kxk
 namespace hdrplus
 {
 
 bayer_image::bayer_image( const std::string& bayer_image_path )
 {
-    libraw_processor = std::make_shared<LibRaw>();
-
-    // Open RAW image file
-    int return_code;
-    if ( ( return_code = libraw_processor->open_file( bayer_image_path.c_str() ) ) != LIBRAW_SUCCESS )
-    {
-        libraw_processor->recycle();
-        throw std::runtime_error("Error opening file " + bayer_image_path + " " + libraw_strerror( return_code ));
-    }
-
-    // Unpack the raw image
-    if ( ( return_code = libraw_processor->unpack() ) != LIBRAW_SUCCESS )
-    {
-        throw std::runtime_error("Error unpack file " + bayer_image_path + " " + libraw_strerror( return_code ));
-    }
+    // Open and unpack the RAW image in a pooled LibRaw context owned by this frame
+    path = bayer_image_path;
+    libraw_processor = libraw_pool::shared()->checkout_unpacked( bayer_image_path );
 
     // Get image basic info
     width = int( libraw_processor->imgdata.rawdata.sizes.raw_width );
@@ -55,7 +44,8 @@ bayer_image::bayer_image( const std::string& bayer_image_path )
     // Create CV mat
     // https://answers.opencv.org/question/105972/de-bayering-a-cr2-image/
     // https://www.libraw.org/node/2141
-    raw_image = cv::Mat( height, width, CV_16U, libraw_processor->imgdata.rawdata.raw_image ).clone(); // changed the order of width and height
+    raw_image = cv::Mat( height, width, CV_16U, libraw_processor->imgdata.rawdata.raw_image, \
+                         libraw_processor->imgdata.rawdata.sizes.raw_pitch ).clone(); // changed the order of width and height
 
     // 2x2 box filter
     grayscale_image = box_filter_kxk<uint16_t, 2>( raw_image );
@@ -68,6 +58,13 @@ bayer_image::bayer_image( const std::string& bayer_image_path )
     #endif
 }
 
+void bayer_image::release_pixels()
+{
+    raw_image.release();
+    grayscale_image.release();
+    libraw_processor.reset();
+}
+
 std::pair<double, double> bayer_image::get_noise_params() const
 {
     // Set ISO to 100 if not positive
@@ -1,14 +1,84 @@
 #include <cstdio>
+#include <cmath>
 #include <string>
+#include <algorithm> // std::stable_sort
+#include <memory> // std::shared_ptr
+#include <stdexcept> // std::runtime_error
+#include <unistd.h> // pread
 #include <omp.h>
 #include <opencv2/opencv.hpp> // all opencv header
 #include "hdrplus/burst.h"
 #include "hdrplus/utility.h"
+#include "hdrplus/libraw_pool.h"
 
 namespace hdrplus
 {
 
-burst::burst( const std::string& burst_path, const std::string& reference_image_path ) 
+int num_frames_for_snr( const cv::Mat& grayscale_image, double black_level, double lambda_shot, double lambda_read, \
+                        int binning, const hdrplus::Options& options, int max_frames )
+{
+    // Noise model of one sample (sigma**2 = lambda_shot * signal + lambda_read) at the mean signal above black,
+    // a binned sample is the mean of binning**2 samples of its color
+    double signal = std::max( cv::mean( grayscale_image )[ 0 ] - black_level, 1.0 );
+    double noise_variance = ( lambda_shot * signal + lambda_read ) / ( binning * binning );
+    double single_frame_snr = signal / std::sqrt( noise_variance );
+
+    // Averaging N frames scales SNR by sqrt(N): frame N + 1 adds sqrt(N + 1) / sqrt(N) - 1 relative SNR
+    int num_frames = 1;
+    while ( num_frames < max_frames )
+    {
+        double merged_snr = single_frame_snr * std::sqrt( double( num_frames ) );
+        double relative_gain = std::sqrt( double( num_frames + 1 ) / num_frames ) - 1;
+        if ( options.targetSNR > 0 && merged_snr >= options.targetSNR )
+            break;
+        if ( options.minFrameSNRGain > 0 && relative_gain < options.minFrameSNRGain )
+            break;
+        num_frames++;
+    }
+
+    #ifndef NDEBUG
+    printf("%s::%s single frame snr %.2f, target snr %.2f, min frame snr gain %.3f, keep %d of %d frames\n", \
+        __FILE__, __func__, single_frame_snr, options.targetSNR, options.minFrameSNRGain, num_frames, max_frames );
+    #endif
+
+    return num_frames;
+}
+
+// Padded frame (cv::copyMakeBorder with BORDER_REFLECT) written row by row to a temporary file,
+// no padded copy of the frame is held in memory
+static std::shared_ptr<std::FILE> spill_padded( const cv::Mat& raw_image, const std::vector<int>& padding )
+{
+    std::shared_ptr<std::FILE> file( std::tmpfile(), []( std::FILE* spill_file )
+    {
+        if ( spill_file )
+            std::fclose( spill_file );
+    });
+    if ( !file )
+    {
+        throw std::runtime_error("Error creating a temporary file for a spilled frame");
+    }
+
+    int padded_rows = raw_image.rows + padding[ 0 ] + padding[ 1 ];
+    cv::Mat padded_row;
+    for ( int row = 0; row < padded_rows; ++row )
+    {
+        int raw_row = cv::borderInterpolate( row - padding[ 0 ], raw_image.rows, cv::BORDER_REFLECT );
+        cv::copyMakeBorder( raw_image.row( raw_row ), padded_row, 0, 0, padding[ 2 ], padding[ 3 ], \
+                            cv::BORDER_REFLECT | cv::BORDER_ISOLATED );
+        if ( std::fwrite( padded_row.data, sizeof( uint16_t ), padded_row.cols, file.get() ) != size_t( padded_row.cols ) )
+        {
+            throw std::runtime_error("Error writing a spilled frame");
+        }
+    }
+    if ( std::fflush( file.get() ) != 0 )
+    {
+        throw std::runtime_error("Error writing a spilled frame");
+    }
+    return file;
+}
+
+burst::burst( const std::string& burst_path, const std::string& reference_image_path, \
+              const hdrplus::Options& options )
 {
     std::vector<cv::String> bayer_image_paths;
     // Search through the input path directory to get all input image path
@@ -55,50 +125,202 @@ burst::burst( const std::string& burst_path, const std::string& reference_image_
         __FILE__, __func__, reference_image_idx );
     #endif
 
-    // Get source bayer image
-    // Downsample original bayer image by 2x2 box filter
-    for ( const auto& bayer_image_path_i : bayer_image_paths )
+    // Decode reference first, its noise model and brightness decide how many frames are needed
+    hdrplus::bayer_image reference_image( bayer_image_paths[ reference_image_idx ] );
+
+    // Preview: every frame binned to 2x2 bayer quads, half resolution with the same bayer pattern,
+    // the grayscale image for alignment is then at a quarter of the full resolution
+    if ( options.previewScale > 0 )
     {
-        bayer_images.emplace_back( bayer_image_path_i );
+        if ( options.previewScale != 2 && options.previewScale != 4 )
+        {
+            throw std::runtime_error("preview scale must be 2 or 4, got " + std::to_string( options.previewScale ));
+        }
+        binning = 2;
+    }
+
+    if ( ( options.targetSNR > 0 || options.minFrameSNRGain > 0 ) && num_images > 1 )
+    {
+        double lambda_shot, lambda_read;
+        std::tie( lambda_shot, lambda_read ) = reference_image.get_noise_params();
+        double black_level = ( reference_image.black_level_per_channel[ 0 ] + \
+                               reference_image.black_level_per_channel[ 1 ] + \
+                               reference_image.black_level_per_channel[ 2 ] + \
+                               reference_image.black_level_per_channel[ 3 ] ) / 4.0;
+        int num_frames = num_frames_for_snr( reference_image.grayscale_image, black_level, lambda_shot, lambda_read, \
+                                             binning, options, num_images );
+
+        // Keep frames temporally closest to the reference, in burst order
+        std::vector<int> frame_order( num_images );
+        for ( int i = 0; i < num_images; ++i )
+        {
+            frame_order[ i ] = i;
+        }
+        std::stable_sort( frame_order.begin(), frame_order.end(), [&]( int a, int b )
+        {
+            return std::abs( a - reference_image_idx ) < std::abs( b - reference_image_idx );
+        });
+        frame_order.resize( num_frames );
+        std::sort( frame_order.begin(), frame_order.end() );
+
+        std::vector<cv::String> selected_paths;
+        for ( int i : frame_order )
+        {
+            if ( i == reference_image_idx )
+            {
+                reference_image_idx = selected_paths.size();
+            }
+            selected_paths.push_back( bayer_image_paths[ i ] );
+        }
+        bayer_image_paths.swap( selected_paths );
+        num_images = num_frames;
+
+        #ifndef NDEBUG
+        printf("%s::%s keep %d frames, reference image idx %d\n", \
+            __FILE__, __func__, num_images, reference_image_idx );
+        #endif
     }
 
-    // Pad information
+    auto bin_frame = [ this ]( hdrplus::bayer_image& bayer_image_i )
+    {
+        if ( binning == 1 )
+            return;
+        bayer_image_i.raw_image = bin_bayer_2x2<uint16_t>( bayer_image_i.raw_image );
+        bayer_image_i.grayscale_image = box_filter_kxk<uint16_t, 2>( bayer_image_i.raw_image );
+        bayer_image_i.height = bayer_image_i.raw_image.rows;
+        bayer_image_i.width = bayer_image_i.raw_image.cols;
+    };
+    bin_frame( reference_image );
+
+    // Pad information, every frame has the size of the reference
     int tile_size_bayer = 32;
     int padding_top = tile_size_bayer / 2;
     int padding_bottom = tile_size_bayer / 2 + \
-        ( (bayer_images[ 0 ].height % tile_size_bayer) == 0 ? \
-        0 : tile_size_bayer - bayer_images[ 0 ].height % tile_size_bayer );
+        ( (reference_image.height % tile_size_bayer) == 0 ? \
+        0 : tile_size_bayer - reference_image.height % tile_size_bayer );
     int padding_left = tile_size_bayer / 2;
     int padding_right = tile_size_bayer / 2 + \
-        ( (bayer_images[ 0 ].width % tile_size_bayer) == 0 ? \
-        0 : tile_size_bayer - bayer_images[ 0 ].width % tile_size_bayer );
+        ( (reference_image.width % tile_size_bayer) == 0 ? \
+        0 : tile_size_bayer - reference_image.width % tile_size_bayer );
     padding_info_bayer = std::vector<int>{ padding_top, padding_bottom, padding_left, padding_right };
+    padded_size = cv::Size( reference_image.width + padding_left + padding_right, \
+                            reference_image.height + padding_top + padding_bottom );
 
-    // Pad bayer image
-    for ( const auto& bayer_image_i : bayer_images )
+    // Get source bayer image, decoded, binned and padded one at a time
+    // Downsample original bayer image by 2x2 box filter
+    spilled = options.memoryBudgetMB > 0;
+    if ( spilled )
+    {
+        // reference first, so that at most one decoded frame is held at a time
+        spill_files.resize( num_images );
+        spill_files[ reference_image_idx ] = spill_padded( reference_image.raw_image, padding_info_bayer );
+        reference_image.release_pixels();
+    }
+    for ( int i = 0; i < num_images; ++i )
     {
-        cv::Mat bayer_image_pad_i;
-        cv::copyMakeBorder( bayer_image_i.raw_image, \
-                            bayer_image_pad_i, \
-                            padding_top, padding_bottom, padding_left, padding_right, \
-                            cv::BORDER_REFLECT );
+        hdrplus::bayer_image bayer_image_i = reference_image;
+        if ( i != reference_image_idx )
+        {
+            bayer_image_i = hdrplus::bayer_image( bayer_image_paths[ i ] );
+            bin_frame( bayer_image_i );
+        }
 
-        // cv::Mat use internal reference count
-        bayer_images_pad.emplace_back( bayer_image_pad_i );
-        grayscale_images_pad.emplace_back( box_filter_kxk<uint16_t, 2>( bayer_image_pad_i ) );
+        if ( spilled )
+        {
+            if ( i != reference_image_idx )
+            {
+                spill_files[ i ] = spill_padded( bayer_image_i.raw_image, padding_info_bayer );
+                bayer_image_i.release_pixels();
+            }
+        }
+        else
+        {
+            cv::Mat bayer_image_pad_i;
+            cv::copyMakeBorder( bayer_image_i.raw_image, \
+                                bayer_image_pad_i, \
+                                padding_top, padding_bottom, padding_left, padding_right, \
+                                cv::BORDER_REFLECT );
+
+            // cv::Mat use internal reference count
+            bayer_images_pad.emplace_back( bayer_image_pad_i );
+            grayscale_images_pad.emplace_back( box_filter_kxk<uint16_t, 2>( bayer_image_pad_i ) );
+        }
+        bayer_images.push_back( bayer_image_i );
     }
 
+    #ifndef NDEBUG
+    if ( binning > 1 )
+    {
+        printf("%s::%s preview, bayer images binned to (%d, %d)\n", \
+            __FILE__, __func__, bayer_images[ 0 ].height, bayer_images[ 0 ].width );
+    }
+    if ( spilled )
+    {
+        printf("%s::%s %d frames spilled to temporary files\n", __FILE__, __func__, num_images );
+    }
+    #endif
+
     #ifndef NDEBUG
     printf("%s::%s Pad bayer image from (%d, %d) -> (%d, %d)\n", \
         __FILE__, __func__, \
         bayer_images[ 0 ].height, \
         bayer_images[ 0 ].width, \
-        bayer_images_pad[ 0 ].size().height, \
-        bayer_images_pad[ 0 ].size().width );
+        padded_size.height, \
+        padded_size.width );
     printf("%s::%s pad top %d, buttom %d, left %d, right %d\n", \
         __FILE__, __func__, \
         padding_top, padding_bottom, padding_left, padding_right );
     #endif
 }
 
+void burst::read_band( int img_idx, int row_start, int row_end, cv::Mat& bayer_band, cv::Mat& grayscale_band ) const
+{
+    if ( row_start % 2 != 0 || row_end % 2 != 0 || row_start < 0 || row_end > padded_size.height || row_start >= row_end )
+    {
+        throw std::runtime_error("band rows must be an even, non empty range of the padded image");
+    }
+    if ( !spilled )
+    {
+        bayer_band = bayer_images_pad[ img_idx ].rowRange( row_start, row_end );
+        grayscale_band = grayscale_images_pad[ img_idx ].rowRange( row_start / 2, row_end / 2 );
+        return;
+    }
+
+    // pread does not move a shared file position, bands of different frames can be read concurrently
+    bayer_band.create( row_end - row_start, padded_size.width, CV_16U );
+    char* band_data = reinterpret_cast<char*>( bayer_band.data );
+    size_t remaining = bayer_band.total() * sizeof( uint16_t );
+    off_t offset = off_t( row_start ) * padded_size.width * sizeof( uint16_t );
+    int spill_fd = fileno( spill_files[ img_idx ].get() );
+    while ( remaining > 0 )
+    {
+        ssize_t num_read = pread( spill_fd, band_data, remaining, offset );
+        if ( num_read <= 0 )
+        {
+            throw std::runtime_error("Error reading a spilled frame");
+        }
+        band_data += num_read;
+        offset += num_read;
+        remaining -= num_read;
+    }
+
+    // The 2x2 box filter only reads the band rows (row_start is even), same rows as the full frame grayscale image
+    grayscale_band = box_filter_kxk<uint16_t, 2>( bayer_band );
+}
+
+void burst::load_reference()
+{
+    hdrplus::bayer_image& reference_image = bayer_images[ reference_image_idx ];
+    if ( !spilled || !reference_image.raw_image.empty() )
+    {
+        return;
+    }
+
+    reference_image.libraw_processor = libraw_pool::shared()->checkout_unpacked( reference_image.path );
+    cv::Mat bayer_band, grayscale_band;
+    read_band( reference_image_idx, 0, padded_size.height, bayer_band, grayscale_band );
+    reference_image.raw_image = bayer_band( cv::Range( padding_info_bayer[ 0 ], padding_info_bayer[ 0 ] + reference_image.height ), \
+                                            cv::Range( padding_info_bayer[ 2 ], padding_info_bayer[ 2 ] + reference_image.width ) ).clone();
+}
+
 } // namespace hdrplus
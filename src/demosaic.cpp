@@ -0,0 +1,297 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm> // std::min, std::max
+#include <stdexcept> // std::runtime_error
+#include <opencv2/opencv.hpp> // all opencv header
+#include <libraw/libraw.h>
+#include "hdrplus/demosaic.h"
+#include "hdrplus/utility.h" // reflect_101
+
+namespace hdrplus
+{
+
+// Output rows per block. Normalized samples of a block and its halo stay in cache
+// between normalization and demosaic.
+static const int block_rows = 32;
+
+// Malvar-He-Cutler kernel radius (5x5), bilinear only needs 1
+static const int halo = 2;
+
+// Margin of a 2x2 binned bayer image (bin_bayer_2x2), about half the raw margin with the same parity
+static inline int binned_margin( int margin )
+{
+    int binned = margin / 2;
+    return binned + ( ( binned - margin ) & 1 );
+}
+
+// Camera RGB of one row from normalized samples, one loop per column parity: every pixel of a loop has the same
+// bayer color, so the loops have no per pixel branch (color dependent choices are loop invariant selects).
+// sample_row points at column 0 of the row, stride is the row stride of the samples,
+// row_pattern the bayer color of even / odd columns (0 R, 1 G, 2 B).
+#define P( dy, dx ) p[ ( dy ) * stride + ( dx ) ]
+
+template< bool mhc >
+static inline void interpolate_green( const float* sample_row, int stride, int col_start, int width, \
+                                      bool red_horizontal, float* red, float* green, float* blue )
+{
+    for ( int col = col_start; col < width; col += 2 )
+    {
+        const float* p = sample_row + col;
+        float horizontal, vertical;
+        if ( mhc )
+        {
+            float center = 5 * P( 0, 0 ) - ( P( -1, -1 ) + P( -1, 1 ) + P( 1, -1 ) + P( 1, 1 ) );
+            horizontal = ( center + 4 * ( P( 0, -1 ) + P( 0, 1 ) ) - ( P( 0, -2 ) + P( 0, 2 ) ) + 0.5f * ( P( -2, 0 ) + P( 2, 0 ) ) ) / 8;
+            vertical   = ( center + 4 * ( P( -1, 0 ) + P( 1, 0 ) ) - ( P( -2, 0 ) + P( 2, 0 ) ) + 0.5f * ( P( 0, -2 ) + P( 0, 2 ) ) ) / 8;
+        }
+        else
+        {
+            horizontal = ( P( 0, -1 ) + P( 0, 1 ) ) / 2;
+            vertical = ( P( -1, 0 ) + P( 1, 0 ) ) / 2;
+        }
+        green[ col ] = P( 0, 0 );
+        red[ col ] = red_horizontal ? horizontal : vertical;
+        blue[ col ] = red_horizontal ? vertical : horizontal;
+    }
+}
+
+template< bool mhc >
+static inline void interpolate_red_blue( const float* sample_row, int stride, int col_start, int width, \
+                                         bool is_red, float* red, float* green, float* blue )
+{
+    for ( int col = col_start; col < width; col += 2 )
+    {
+        const float* p = sample_row + col;
+        float cross = P( -1, 0 ) + P( 1, 0 ) + P( 0, -1 ) + P( 0, 1 );
+        float diagonal = P( -1, -1 ) + P( -1, 1 ) + P( 1, -1 ) + P( 1, 1 );
+        float green_value, other;
+        if ( mhc )
+        {
+            float axial = P( -2, 0 ) + P( 2, 0 ) + P( 0, -2 ) + P( 0, 2 );
+            green_value = ( 4 * P( 0, 0 ) + 2 * cross - axial ) / 8;
+            other = ( 6 * P( 0, 0 ) + 2 * diagonal - 1.5f * axial ) / 8;
+        }
+        else
+        {
+            green_value = cross / 4;
+            other = diagonal / 4;
+        }
+        green[ col ] = green_value;
+        red[ col ] = is_red ? P( 0, 0 ) : other;
+        blue[ col ] = is_red ? other : P( 0, 0 );
+    }
+}
+
+#undef P
+
+template< bool mhc >
+static void demosaic_block( const float* samples, int samples_stride, \
+                            const int pattern[ 2 ][ 2 ], const float color_matrix[ 3 ][ 3 ], \
+                            cv::Mat& rgb_image, int row_start, int row_end, \
+                            float* red, float* green, float* blue )
+{
+    int width = rgb_image.cols;
+    for ( int row = row_start; row < row_end; ++row )
+    {
+        const float* sample_row = samples + ( row - row_start + halo ) * samples_stride + halo;
+        const int* row_pattern = pattern[ row & 1 ];
+        for ( int parity = 0; parity < 2; ++parity )
+        {
+            int color = row_pattern[ parity ];
+            if ( color == 1 )
+                interpolate_green<mhc>( sample_row, samples_stride, parity, width, row_pattern[ 1 - parity ] == 0, red, green, blue );
+            else
+                interpolate_red_blue<mhc>( sample_row, samples_stride, parity, width, color == 0, red, green, blue );
+        }
+
+        // Clip, color matrix and rounding to 16 bit RGB
+        uint16_t* rgb_row = rgb_image.ptr<uint16_t>( row );
+        for ( int col = 0; col < width; ++col )
+        {
+            float cam[ 3 ] = { std::min( std::max( red[ col ], 0.f ), 65535.f ), \
+                               std::min( std::max( green[ col ], 0.f ), 65535.f ), \
+                               std::min( std::max( blue[ col ], 0.f ), 65535.f ) };
+            for ( int c = 0; c < 3; ++c )
+            {
+                float out = color_matrix[ c ][ 0 ] * cam[ 0 ] + color_matrix[ c ][ 1 ] * cam[ 1 ] + color_matrix[ c ][ 2 ] * cam[ 2 ];
+                rgb_row[ 3 * col + c ] = uint16_t( std::min( std::max( out, 0.f ), 65535.f ) + 0.5f );
+            }
+        }
+    }
+}
+
+cv::Mat demosaic_process( const std::shared_ptr<LibRaw>& libraw_processor, \
+                          const cv::Mat& bayer_image, \
+                          const RawpyArgs& rawpyArgs, \
+                          demosaic_algorithm algorithm, \
+                          int binning )
+{
+    // Metadata as read by unpack, not modified by dcraw_process
+    const libraw_image_sizes_t& sizes = libraw_processor->imgdata.rawdata.sizes;
+    const libraw_colordata_t& color = libraw_processor->imgdata.rawdata.color;
+    unsigned filters = libraw_processor->imgdata.rawdata.iparams.filters;
+
+    // Raw layout, scaled for a binned bayer image. Binned margins keep the parity of the raw ones,
+    // so the bayer pattern in visible area coordinates is unchanged.
+    int raw_height = sizes.raw_height;
+    int raw_width = sizes.raw_width;
+    int top_margin = sizes.top_margin;
+    int left_margin = sizes.left_margin;
+    int height = sizes.height;
+    int width = sizes.width;
+    if ( binning == 2 )
+    {
+        raw_height = sizes.raw_height / 4 * 2;
+        raw_width = sizes.raw_width / 4 * 2;
+        top_margin = binned_margin( sizes.top_margin );
+        left_margin = binned_margin( sizes.left_margin );
+        height = std::min( sizes.height / 4 * 2, raw_height - top_margin );
+        width = std::min( sizes.width / 4 * 2, raw_width - left_margin );
+    }
+    else if ( binning != 1 )
+    {
+        throw std::runtime_error("native demosaic supports binning 1 or 2, got " + std::to_string( binning ));
+    }
+
+    if ( bayer_image.type() != CV_16UC1 || bayer_image.rows != raw_height || bayer_image.cols != raw_width )
+    {
+        throw std::runtime_error("bayer image does not match LibRaw raw image size");
+    }
+
+    // 2x2 bayer pattern repeats the same byte for every row pair
+    if ( filters == 0 || filters != ( filters & 0xff ) * 0x01010101u )
+    {
+        throw std::runtime_error("native demosaic only supports 2x2 bayer pattern, use dcraw_process");
+    }
+
+    // Bayer color per row / col parity in visible area coordinates (LibRaw FC), 3 is second green
+    int raw_pattern[ 2 ][ 2 ];
+    int pattern[ 2 ][ 2 ];
+    for ( int row = 0; row < 2; ++row )
+    {
+        for ( int col = 0; col < 2; ++col )
+        {
+            raw_pattern[ row ][ col ] = ( filters >> ( ( ( ( row << 1 ) & 14 ) | ( col & 1 ) ) << 1 ) ) & 3;
+            pattern[ row ][ col ] = raw_pattern[ row ][ col ] == 3 ? 1 : raw_pattern[ row ][ col ];
+        }
+    }
+
+    // White balance multipliers normalized by the smallest one (dcraw without highlight recovery)
+    if ( rawpyArgs.use_auto_wb )
+    {
+        printf("%s::%s use_auto_wb is not supported by the native demosaic, %s white balance used instead\n", \
+            __FILE__, __func__, rawpyArgs.use_camera_wb ? "camera" : "daylight" );
+    }
+    float multipliers[ 4 ];
+    bool use_camera_wb = rawpyArgs.use_camera_wb && color.cam_mul[ 0 ] > 0;
+    for ( int c = 0; c < 4; ++c )
+    {
+        multipliers[ c ] = use_camera_wb ? color.cam_mul[ c ] : color.pre_mul[ c ];
+    }
+    if ( multipliers[ 3 ] <= 0 )
+    {
+        multipliers[ 3 ] = multipliers[ 1 ];
+    }
+    float min_multiplier = *std::min_element( multipliers, multipliers + 4 );
+    if ( min_multiplier <= 0 )
+    {
+        throw std::runtime_error("invalid white balance multipliers in LibRaw metadata");
+    }
+
+    // Black level and scale to 16 bit per row / col parity
+    float black[ 2 ][ 2 ];
+    float scale[ 2 ][ 2 ];
+    for ( int row = 0; row < 2; ++row )
+    {
+        for ( int col = 0; col < 2; ++col )
+        {
+            int c = raw_pattern[ row ][ col ];
+            float black_level = color.black + color.cblack[ c ];
+            if ( color.cblack[ 4 ] > 0 && color.cblack[ 5 ] > 0 && color.cblack[ 4 ] <= 2 && color.cblack[ 5 ] <= 2 )
+            {
+                black_level += color.cblack[ 6 + ( row % color.cblack[ 4 ] ) * color.cblack[ 5 ] + col % color.cblack[ 5 ] ];
+            }
+            black[ row ][ col ] = black_level;
+            scale[ row ][ col ] = multipliers[ c ] / min_multiplier * 65535.f / ( color.maximum - black_level );
+        }
+    }
+
+    // Camera to output color (dcraw output_color 0 raw, 1 sRGB), rgb_cam is camera to sRGB
+    if ( rawpyArgs.output_color != 0 && rawpyArgs.output_color != LIBRAW_COLORSPACE_sRGB )
+    {
+        throw std::runtime_error("native demosaic only supports raw (0) or sRGB (1) output color, got " + \
+            std::to_string( rawpyArgs.output_color ) + ", use dcraw_process");
+    }
+    float color_matrix[ 3 ][ 3 ];
+    for ( int i = 0; i < 3; ++i )
+    {
+        for ( int j = 0; j < 3; ++j )
+        {
+            color_matrix[ i ][ j ] = rawpyArgs.output_color == LIBRAW_COLORSPACE_sRGB ? color.rgb_cam[ i ][ j ] : float( i == j );
+        }
+    }
+
+    cv::Mat rgb_image( height, width, CV_16UC3 );
+    int num_blocks = ( height + block_rows - 1 ) / block_rows;
+
+    #pragma omp parallel
+    {
+        int samples_stride = width + 2 * halo;
+        std::vector<float> samples( ( block_rows + 2 * halo ) * samples_stride );
+        std::vector<float> red( width ), green( width ), blue( width ); // camera RGB of one row
+
+        #pragma omp for schedule( dynamic )
+        for ( int block_i = 0; block_i < num_blocks; ++block_i )
+        {
+            int row_start = block_i * block_rows;
+            int row_end = std::min( row_start + block_rows, height );
+
+            // Black / white level and white balance of the block rows and their halo
+            for ( int sample_row_i = 0; sample_row_i < row_end - row_start + 2 * halo; ++sample_row_i )
+            {
+                int row = reflect_101( row_start + sample_row_i - halo, height );
+                const uint16_t* raw_row = bayer_image.ptr<uint16_t>( row + top_margin ) + left_margin;
+                float* sample_row = samples.data() + sample_row_i * samples_stride + halo;
+                const float* row_black = black[ row & 1 ];
+                const float* row_scale = scale[ row & 1 ];
+
+                for ( int col = 0; col < width; ++col )
+                {
+                    float value = ( raw_row[ col ] - row_black[ col & 1 ] ) * row_scale[ col & 1 ];
+                    sample_row[ col ] = std::min( std::max( value, 0.f ), 65535.f );
+                }
+                for ( int col = 1; col <= halo; ++col )
+                {
+                    sample_row[ -col ] = sample_row[ reflect_101( -col, width ) ];
+                    sample_row[ width - 1 + col ] = sample_row[ reflect_101( width - 1 + col, width ) ];
+                }
+            }
+
+            // Demosaic and color matrix, 16 bit RGB out
+            if ( algorithm == DEMOSAIC_MHC )
+                demosaic_block<true>( samples.data(), samples_stride, pattern, color_matrix, rgb_image, row_start, row_end, \
+                                      red.data(), green.data(), blue.data() );
+            else
+                demosaic_block<false>( samples.data(), samples_stride, pattern, color_matrix, rgb_image, row_start, row_end, \
+                                       red.data(), green.data(), blue.data() );
+        }
+    }
+
+    // Orientation as dcraw_make_mem_image (flip bits 1 horizontal, 2 vertical, 4 transpose)
+    if ( sizes.flip & 3 )
+    {
+        int flip_code = ( sizes.flip & 3 ) == 3 ? -1 : ( ( sizes.flip & 2 ) ? 0 : 1 );
+        cv::flip( rgb_image, rgb_image, flip_code );
+    }
+    if ( sizes.flip & 4 )
+    {
+        cv::Mat transposed_image;
+        cv::transpose( rgb_image, transposed_image );
+        rgb_image = transposed_image;
+    }
+
+    return rgb_image;
+}
+
+} // namespace hdrplus
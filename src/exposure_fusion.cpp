@@ -0,0 +1,136 @@
+#include <vector>
+#include <cmath>
+#include <climits> // USHRT_MAX
+#include <stdexcept> // std::runtime_error
+#include <opencv2/opencv.hpp> // all opencv header
+#include "hdrplus/exposure_fusion.h"
+#include "hdrplus/utility.h" // reflect_101
+
+namespace hdrplus
+{
+
+// Mertens weight of one pixel: |3x3 Laplacian| * well-exposedness, as MergeMertens with unit exponents
+static inline float mertens_weight( float center, float up, float down, float left, float right )
+{
+    float contrast = std::fabs( up + down + left + right - 4 * center );
+    float well_exposedness = std::exp( -( center - 0.5f ) * ( center - 0.5f ) / 0.08f );
+    return contrast * well_exposedness + 1e-12f;
+}
+
+void exposure_fusion::process( const cv::Mat& short_exposure, const cv::Mat& long_exposure, cv::Mat& fused )
+{
+    if ( short_exposure.type() != CV_16UC1 || long_exposure.type() != CV_16UC1 || \
+         short_exposure.size() != long_exposure.size() )
+    {
+        throw std::runtime_error("exposure_fusion expects two CV_16UC1 exposures of the same size");
+    }
+
+    int height = short_exposure.rows;
+    int width = short_exposure.cols;
+    if ( height < 2 || width < 2 )
+    {
+        throw std::runtime_error("exposure_fusion expects images of at least 2x2 pixels");
+    }
+
+    // Same number of levels as MergeMertens
+    int max_level = static_cast<int>( logf( static_cast<float>( std::min( width, height ) ) ) / logf( 2.0f ) );
+    long_pyramid.resize( max_level + 1 );
+    difference_pyramid.resize( max_level + 1 );
+    weight_pyramid.resize( max_level + 1 );
+    upsampled_long.resize( max_level );
+    upsampled_difference.resize( max_level );
+
+    // Level 0 of the three pyramids and the weights in one pass
+    long_pyramid[ 0 ].create( height, width, CV_32FC1 );
+    difference_pyramid[ 0 ].create( height, width, CV_32FC1 );
+    weight_pyramid[ 0 ].create( height, width, CV_32FC1 );
+    const float scale = 1.f / USHRT_MAX;
+
+    #pragma omp parallel for
+    for ( int row = 0; row < height; ++row )
+    {
+        const uint16_t* short_rows[ 3 ] = { short_exposure.ptr<uint16_t>( reflect_101( row - 1, height ) ), \
+                                            short_exposure.ptr<uint16_t>( row ), \
+                                            short_exposure.ptr<uint16_t>( reflect_101( row + 1, height ) ) };
+        const uint16_t* long_rows[ 3 ] = { long_exposure.ptr<uint16_t>( reflect_101( row - 1, height ) ), \
+                                           long_exposure.ptr<uint16_t>( row ), \
+                                           long_exposure.ptr<uint16_t>( reflect_101( row + 1, height ) ) };
+        float* long_row = long_pyramid[ 0 ].ptr<float>( row );
+        float* difference_row = difference_pyramid[ 0 ].ptr<float>( row );
+        float* weight_row = weight_pyramid[ 0 ].ptr<float>( row );
+
+        for ( int col = 0; col < width; ++col )
+        {
+            int col_left = reflect_101( col - 1, width );
+            int col_right = reflect_101( col + 1, width );
+
+            float short_value = short_rows[ 1 ][ col ] * scale;
+            float long_value = long_rows[ 1 ][ col ] * scale;
+
+            float short_weight = mertens_weight( short_value, short_rows[ 0 ][ col ] * scale, short_rows[ 2 ][ col ] * scale, \
+                                                 short_rows[ 1 ][ col_left ] * scale, short_rows[ 1 ][ col_right ] * scale );
+            float long_weight = mertens_weight( long_value, long_rows[ 0 ][ col ] * scale, long_rows[ 2 ][ col ] * scale, \
+                                                long_rows[ 1 ][ col_left ] * scale, long_rows[ 1 ][ col_right ] * scale );
+
+            long_row[ col ] = long_value;
+            difference_row[ col ] = short_value - long_value;
+            weight_row[ col ] = short_weight / ( short_weight + long_weight );
+        }
+    }
+
+    // Gaussian pyramids, buffers are reused when the size did not change
+    for ( int level = 0; level < max_level; ++level )
+    {
+        cv::pyrDown( long_pyramid[ level ], long_pyramid[ level + 1 ] );
+        cv::pyrDown( difference_pyramid[ level ], difference_pyramid[ level + 1 ] );
+        cv::pyrDown( weight_pyramid[ level ], weight_pyramid[ level + 1 ] );
+    }
+
+    // Fused Laplacian pyramid, fine to coarse so that level + 1 is still Gaussian when level is computed.
+    // L(long) + G(w) * L(short - long) is stored in long_pyramid.
+    for ( int level = 0; level <= max_level; ++level )
+    {
+        cv::Mat& long_level = long_pyramid[ level ];
+        const cv::Mat& difference_level = difference_pyramid[ level ];
+        const cv::Mat& weight_level = weight_pyramid[ level ];
+        bool is_top = level == max_level;
+        if ( !is_top )
+        {
+            cv::pyrUp( long_pyramid[ level + 1 ], upsampled_long[ level ], long_level.size() );
+            cv::pyrUp( difference_pyramid[ level + 1 ], upsampled_difference[ level ], long_level.size() );
+        }
+
+        #pragma omp parallel for
+        for ( int row = 0; row < long_level.rows; ++row )
+        {
+            float* long_row = long_level.ptr<float>( row );
+            const float* difference_row = difference_level.ptr<float>( row );
+            const float* weight_row = weight_level.ptr<float>( row );
+            const float* upsampled_long_row = is_top ? nullptr : upsampled_long[ level ].ptr<float>( row );
+            const float* upsampled_difference_row = is_top ? nullptr : upsampled_difference[ level ].ptr<float>( row );
+
+            for ( int col = 0; col < long_level.cols; ++col )
+            {
+                float long_laplacian = long_row[ col ];
+                float difference_laplacian = difference_row[ col ];
+                if ( !is_top )
+                {
+                    long_laplacian -= upsampled_long_row[ col ];
+                    difference_laplacian -= upsampled_difference_row[ col ];
+                }
+                long_row[ col ] = long_laplacian + weight_row[ col ] * difference_laplacian;
+            }
+        }
+    }
+
+    // Collapse
+    for ( int level = max_level; level > 0; --level )
+    {
+        cv::pyrUp( long_pyramid[ level ], upsampled_long[ level - 1 ], long_pyramid[ level - 1 ].size() );
+        long_pyramid[ level - 1 ] += upsampled_long[ level - 1 ];
+    }
+
+    long_pyramid[ 0 ].copyTo( fused );
+}
+
+} // namespace hdrplus
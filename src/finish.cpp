@@ -1,7 +1,17 @@
 #include <opencv2/opencv.hpp> // all opencv header
 #include "hdrplus/finish.h"
 #include "hdrplus/utility.h"
+#include "hdrplus/demosaic.h"
+#include "hdrplus/pointwise.h"
+#include "hdrplus/exposure_fusion.h"
+#include "hdrplus/sharpen.h"
+#include "hdrplus/artifact_sink.h"
+#include "hdrplus/output_encoder.h"
+#include "hdrplus/libraw_pool.h"
 #include <cmath>
+#include <cstring> // memcpy
+#include <stdexcept> // std::runtime_error
+#include <future> // std::async, std::promise
 
 // #include <type_traits>
 
@@ -9,30 +19,21 @@ namespace hdrplus
 {
     
 
-    cv::Mat convert16bit2_8bit_(cv::Mat ans){
-        if(ans.type()==CV_16UC3){
-            cv::MatIterator_<cv::Vec3w> it, end;
-            for( it = ans.begin<cv::Vec3w>(), end = ans.end<cv::Vec3w>(); it != end; ++it)
-            {
-                // std::cout<<sizeof (*it)[0] <<std::endl;
-                (*it)[0] *=(255.0/USHRT_MAX);
-                (*it)[1] *=(255.0/USHRT_MAX);
-                (*it)[2] *=(255.0/USHRT_MAX);
-            }
-            ans.convertTo(ans, CV_8UC3);
-        }else if(ans.type()==CV_16UC1){
-            u_int16_t* ptr = (u_int16_t*)ans.data;
-            int end = ans.rows*ans.cols;
-            for(int i=0;i<end;i++){
-                *(ptr+i) *=(255.0/USHRT_MAX);
-            }
-            ans.convertTo(ans, CV_8UC1);
+    cv::Mat convert16bit2_8bit_(const cv::Mat& ans){
+        if(ans.type()==CV_16UC3 || ans.type()==CV_16UC1){
+            static const pointwise_chain identity;
+            return identity.apply(ans, CV_8U);
         }else{
             std::cout<<"Unsupported Data Type"<<std::endl;
         }
         return ans;
     }
 
+    // 16 bit RGB to 8 bit BGR for imwrite in one pass, after the pointwise stages of chain
+    cv::Mat convert16bitRGB2_8bitBGR_(const cv::Mat& img, const pointwise_chain& chain = pointwise_chain()){
+        return chain.apply(img, CV_8U, true);
+    }
+
     cv::Mat convert8bit2_16bit_(cv::Mat ans){
         if(ans.type()==CV_8UC3){
             ans.convertTo(ans, CV_16UC3);
@@ -118,57 +119,58 @@ namespace hdrplus
         return (uint16_t)x;
     }
 
-    cv::Mat uGammaCompress_(cv::Mat m,float threshold,float gainMin,float gainMax,float exponent){
-        if(m.type()==CV_16UC3){
-            cv::MatIterator_<cv::Vec3w> it, end;
-            for( it = m.begin<cv::Vec3w>(), end = m.end<cv::Vec3w>(); it != end; ++it)
-            {
-                (*it)[0] =uGammaCompress_1pix((*it)[0],threshold,gainMin,gainMax,exponent);
-                (*it)[1] =uGammaCompress_1pix((*it)[1],threshold,gainMin,gainMax,exponent);
-                (*it)[2] =uGammaCompress_1pix((*it)[2],threshold,gainMin,gainMax,exponent);
-            }
-        }else if(m.type()==CV_16UC1){
-            u_int16_t* ptr = (u_int16_t*)m.data;
-            int end = m.rows*m.cols;
-            for(int i=0;i<end;i++){
-                *(ptr+i) = uGammaCompress_1pix(*(ptr+i),threshold,gainMin,gainMax,exponent);
-            }
+    pointwise_chain::stage_t uGammaCompress_stage(float threshold,float gainMin,float gainMax,float exponent){
+        return [=](uint16_t x){ return uGammaCompress_1pix(x,threshold,gainMin,gainMax,exponent); };
+    }
+
+    pointwise_chain::stage_t uGammaDecompress_stage(float threshold,float gainMin,float gainMax,float exponent){
+        return [=](uint16_t x){ return uGammaDecompress_1pix(x,threshold,gainMin,gainMax,exponent); };
+    }
 
+    void uGammaCompress_(cv::Mat& m,float threshold,float gainMin,float gainMax,float exponent){
+        if(m.type()==CV_16UC3 || m.type()==CV_16UC1){
+            pointwise_chain().then(uGammaCompress_stage(threshold,gainMin,gainMax,exponent)).apply_inplace(m);
         }else{
             std::cout<<"Unsupported Data Type"<<std::endl;
         }
-        return m;
     }
 
-    cv::Mat uGammaDecompress_(cv::Mat m,float threshold,float gainMin,float gainMax,float exponent){
-        if(m.type()==CV_16UC3){
-            cv::MatIterator_<cv::Vec3w> it, end;
-            for( it = m.begin<cv::Vec3w>(), end = m.end<cv::Vec3w>(); it != end; ++it)
-            {
-                (*it)[0] =uGammaDecompress_1pix((*it)[0],threshold,gainMin,gainMax,exponent);
-                (*it)[1] =uGammaDecompress_1pix((*it)[1],threshold,gainMin,gainMax,exponent);
-                (*it)[2] =uGammaDecompress_1pix((*it)[2],threshold,gainMin,gainMax,exponent);
-            }
-        }else if(m.type()==CV_16UC1){
-            u_int16_t* ptr = (u_int16_t*)m.data;
-            int end = m.rows*m.cols;
-            for(int i=0;i<end;i++){
-                *(ptr+i) = uGammaDecompress_1pix(*(ptr+i),threshold,gainMin,gainMax,exponent);
-            }
-
+    void uGammaDecompress_(cv::Mat& m,float threshold,float gainMin,float gainMax,float exponent){
+        if(m.type()==CV_16UC3 || m.type()==CV_16UC1){
+            pointwise_chain().then(uGammaDecompress_stage(threshold,gainMin,gainMax,exponent)).apply_inplace(m);
         }else{
             std::cout<<"Unsupported Data Type"<<std::endl;
         }
-        
-        return m;
     }
 
-    cv::Mat gammasRGB(cv::Mat img, bool mode){
+    pointwise_chain::stage_t gammasRGB_stage(bool mode){
         if(mode){// compress
-            return uGammaCompress_(img,0.0031308, 12.92, 1.055, 1. / 2.4);
+            return uGammaCompress_stage(0.0031308, 12.92, 1.055, 1. / 2.4);
         }else{ // decompress
-            return uGammaDecompress_(img, 0.04045, 12.92, 1.055, 2.4);
+            return uGammaDecompress_stage(0.04045, 12.92, 1.055, 2.4);
+        }
+    }
+
+    // tables are built once and shared by every gammasRGB call
+    const pointwise_chain& gammasRGB_chain(bool mode){
+        static const pointwise_chain compress = pointwise_chain().then(gammasRGB_stage(true));
+        static const pointwise_chain decompress = pointwise_chain().then(gammasRGB_stage(false));
+        return mode ? compress : decompress;
+    }
+
+    void gammasRGB(cv::Mat& img, bool mode){
+        if(img.type()!=CV_16UC3 && img.type()!=CV_16UC1){
+            std::cout<<"Unsupported Data Type"<<std::endl;
+            return;
+        }
+        gammasRGB_chain(mode).apply_inplace(img);
+    }
+
+    void gammasRGB(const cv::Mat& img, cv::Mat& result, bool mode){
+        if(img.type()!=CV_16UC3 && img.type()!=CV_16UC1){
+            throw std::runtime_error("gammasRGB only supports CV_16UC1 and CV_16UC3 images");
         }
+        gammasRGB_chain(mode).apply(img, result);
     }
 
     void copy_mat_16U_2(u_int16_t* ptr_A, cv::Mat B){
@@ -181,28 +183,21 @@ namespace hdrplus
         }
     }
 
-    cv::Mat mean_(cv::Mat img){
-        // initialize processedImg
-        int H = img.rows;
-        int W = img.cols;
-        cv::Mat processedImg = cv::Mat(H,W,CV_16UC1);
-        u_int16_t* ptr = (u_int16_t*)processedImg.data;
-        
-        // traverse img
-        int idx = 0;
-        cv::MatIterator_<cv::Vec3w> it, end;
-        for( it = img.begin<cv::Vec3w>(), end = img.end<cv::Vec3w>(); it != end; ++it)
-        {
-            uint32_t tmp = (*it)[0]+(*it)[1]+(*it)[2];
-            uint16_t avg_val = tmp/3;
-            *(ptr+idx) = avg_val;
-            idx++;
+    // channel mean of a CV_16UC3 image into gray (CV_16UC1, reused when it already has the image size)
+    void mean_(const cv::Mat& img, cv::Mat& gray){
+        gray.create(img.rows, img.cols, CV_16UC1);
+        #pragma omp parallel for
+        for(int r=0;r<img.rows;r++){
+            const u_int16_t* ptr_img = img.ptr<u_int16_t>(r);
+            u_int16_t* ptr = gray.ptr<u_int16_t>(r);
+            for(int c=0;c<img.cols;c++){
+                uint32_t tmp = (uint32_t)ptr_img[3*c]+ptr_img[3*c+1]+ptr_img[3*c+2];
+                ptr[c] = tmp/3;
+            }
         }
-
-        return processedImg;
     }
 
-    double getMean(cv::Mat img){
+    double getMean(const cv::Mat& img){
         u_int16_t* ptr = (u_int16_t*)img.data;
         int max_idx = img.rows*img.cols*img.channels();
         double sum=0;
@@ -214,23 +209,23 @@ namespace hdrplus
         return sum;
     }
 
-    cv::Mat matMultiply_scalar(cv::Mat img,float gain){
-        u_int16_t* ptr = (u_int16_t*)img.data;
-        int max_idx = img.rows*img.cols*img.channels();
-        for(int i=0;i<max_idx;i++){
-            double tmp = *(ptr+i)*gain;
+    pointwise_chain::stage_t matMultiply_scalar_stage(float gain){
+        return [=](uint16_t x){
+            double tmp = x*gain;
             if(tmp<0){
-                *(ptr+i)=0;
+                return (u_int16_t)0;
             }else if(tmp>USHRT_MAX){
-                *(ptr+i) = USHRT_MAX;
-            }else{
-                *(ptr+i)=(u_int16_t)tmp;
+                return (u_int16_t)USHRT_MAX;
             }
-        }
-        return img;
+            return (u_int16_t)tmp;
+        };
     }
 
-    double getSaturated(cv::Mat img, double threshold){
+    void matMultiply_scalar(cv::Mat& img,float gain){
+        pointwise_chain().then(matMultiply_scalar_stage(gain)).apply_inplace(img);
+    }
+
+    double getSaturated(const cv::Mat& img, double threshold){
         threshold *= USHRT_MAX;
         double count=0;
         u_int16_t* ptr = (u_int16_t*)img.data;
@@ -244,87 +239,211 @@ namespace hdrplus
 
     }
 
-    cv::Mat meanGain_(cv::Mat img,int gain){
-        if(img.channels()!=3){
-            std::cout<<"unsupport img type in meanGain_()"<<std::endl;
-            return cv::Mat();
-        }else{ // RGB img
-            int H = img.rows;
-            int W = img.cols;
-            cv::Mat processedImg = cv::Mat(H,W,CV_16UC1);
-            u_int16_t* ptr = (u_int16_t*)processedImg.data;
-            int idx=0;
-
-            cv::MatIterator_<cv::Vec3w> it, end;
-            for( it = img.begin<cv::Vec3w>(), end = img.end<cv::Vec3w>(); it != end; ++it)
-            {
-                double sum = 0;
-                // R
-                double tmp = (*it)[0]*gain;
-                if(tmp<0) tmp=0;
-                if(tmp>USHRT_MAX) tmp = USHRT_MAX;
-                sum+=tmp;
-
-                // G
-                tmp = (*it)[1]*gain;
-                if(tmp<0) tmp=0;
-                if(tmp>USHRT_MAX) tmp = USHRT_MAX;
-                sum+=tmp;
+    // (value, pixel count) of every non empty bin of the 16 bit histogram of a CV_16UC1 image
+    std::vector<std::pair<uint16_t,double>> histogram16_(const cv::Mat& img){
+        std::vector<double> hist(USHRT_MAX+1, 0);
+        for(int r=0;r<img.rows;r++){
+            const u_int16_t* ptr = img.ptr<u_int16_t>(r);
+            for(int c=0;c<img.cols;c++){
+                hist[ptr[c]]++;
+            }
+        }
+        std::vector<std::pair<uint16_t,double>> bins;
+        for(int v=0;v<=USHRT_MAX;v++){
+            if(hist[v]>0){
+                bins.emplace_back(v,hist[v]);
+            }
+        }
+        return bins;
+    }
 
-                // B
-                tmp = (*it)[2]*gain;
-                if(tmp<0) tmp=0;
-                if(tmp>USHRT_MAX) tmp = USHRT_MAX;
-                sum+=tmp;
+    // getMean(gammasRGB(img*gain)) and getSaturated(gammasRGB(img*gain),threshold) from the histogram of img,
+    // same values as the per pixel computation (img*gain saturates like cv::Mat * int)
+    void gainGammaStats_(const std::vector<std::pair<uint16_t,double>>& bins, int gain, double threshold,
+         double& mean, double& saturated){
+        const std::vector<uint16_t>& gamma = gammasRGB_chain(true).table();
+        threshold *= USHRT_MAX;
+        double sum = 0, count = 0, total = 0;
+        for(const auto& bin : bins){
+            uint16_t v = gamma[std::min(bin.first*gain, (int)USHRT_MAX)];
+            sum += v*bin.second;
+            if(v>threshold){
+                count += bin.second;
+            }
+            total += bin.second;
+        }
+        mean = sum/total/USHRT_MAX;
+        saturated = count/total;
+    }
 
-                // put into processedImg
-                uint16_t avg_val = sum/3;
-                *(ptr+idx) = avg_val;
-                idx++;
+    // channel mean of a CV_16UC3 image multiplied by gain (each channel saturated first) into gray,
+    // CV_16UC1 reused when it already has the image size
+    void meanGain_(const cv::Mat& img,int gain,cv::Mat& gray){
+        if(img.type()!=CV_16UC3){
+            throw std::runtime_error("meanGain_ expects a CV_16UC3 image");
+        }
+        gray.create(img.rows, img.cols, CV_16UC1);
+        uint32_t g = std::max(gain, 0);
+        #pragma omp parallel for
+        for(int r=0;r<img.rows;r++){
+            const u_int16_t* ptr_img = img.ptr<u_int16_t>(r);
+            u_int16_t* ptr = gray.ptr<u_int16_t>(r);
+            for(int c=0;c<img.cols;c++){
+                uint32_t sum = 0;
+                for(int ch=0;ch<3;ch++){
+                    sum += std::min(ptr_img[3*c+ch]*g, (uint32_t)USHRT_MAX);
+                }
+                ptr[c] = sum/3;
             }
-            return processedImg;
         }
+    }
 
+    // scale the channels of image in place by fusedGray / shortGray (1 where shortGray is 0)
+    void applyScaling_(cv::Mat& image, const cv::Mat& shortGray, const cv::Mat& fusedGray){
+        int n_channels = image.channels();
+        #pragma omp parallel for
+        for(int r=0;r<image.rows;r++){
+            const u_int16_t* ptr_shortg = shortGray.ptr<u_int16_t>(r);
+            const u_int16_t* ptr_fusedg = fusedGray.ptr<u_int16_t>(r);
+            u_int16_t* ptr = image.ptr<u_int16_t>(r);
+            for(int c=0;c<image.cols;c++){
+                double s = 1;
+                if(ptr_shortg[c]!=0){
+                    s = ptr_fusedg[c];
+                    s/=ptr_shortg[c];
+                }
+                for(int ch=0;ch<n_channels;ch++){
+                    double tmp = ptr[c*n_channels+ch]*s;
+                    if(tmp<0){
+                        ptr[c*n_channels+ch] = 0;
+                    }else if(tmp>USHRT_MAX){
+                        ptr[c*n_channels+ch] = USHRT_MAX;
+                    }else{
+                        ptr[c*n_channels+ch] = tmp;
+                    }
+                }
+            }
+        }
     }
 
-    cv::Mat applyScaling_(cv::Mat mergedImage, cv::Mat shortGray, cv::Mat fusedGray){
-        cv::Mat result = mergedImage.clone();
-        u_int16_t* ptr_shortg = (u_int16_t*)shortGray.data;
-        u_int16_t* ptr_fusedg = (u_int16_t*)fusedGray.data;
-        int count = 0;
-        cv::MatIterator_<cv::Vec3w> it, end;
-        for( it = result.begin<cv::Vec3w>(), end = result.end<cv::Vec3w>(); it != end; ++it)
-        {
-            double s = 1;
-            if(*(ptr_shortg+count)!=0){
-                s = *(ptr_fusedg+count);
-                s/=*(ptr_shortg+count);
-            }
-            for(int c=0;c<mergedImage.channels();c++){
-                double tmp = (*it)[c]*s;
-                if(tmp<0){
-                    (*it)[c] = 0;
-                }else if(tmp>USHRT_MAX){
-                    (*it)[c] = USHRT_MAX;
-                }else{
-                    (*it)[c] = tmp;
+    // guided filter constants of the reduced resolution gain map (radius in low resolution pixels, guide in [0, 1])
+    static const int ltmGuidedRadius = 2;
+    static const float ltmGuidedEps = 1e-4;
+
+    // Scale the channels of a full resolution image by a gain map computed at low resolution.
+    // The gain fusedGray / shortGray is upsampled with a guided filter whose guide is the gamma corrected gray
+    // (shortg at low resolution, recomputed per pixel at full resolution), in the same pass as the scaling.
+    void applyGainMap_(cv::Mat& image, const cv::Mat& shortg, const cv::Mat& shortGray, const cv::Mat& fusedGray, ltm_buffers& buffers){
+        int H = shortGray.rows;
+        int W = shortGray.cols;
+
+        // low resolution guide and gain
+        cv::Mat& guide = buffers.guide;
+        cv::Mat& gainMap = buffers.gainMap;
+        guide.create(H,W,CV_32F);
+        gainMap.create(H,W,CV_32F);
+        for(int r=0;r<H;r++){
+            const u_int16_t* ptr_shortg = shortg.ptr<u_int16_t>(r);
+            const u_int16_t* ptr_short = shortGray.ptr<u_int16_t>(r);
+            const u_int16_t* ptr_fused = fusedGray.ptr<u_int16_t>(r);
+            float* ptr_guide = guide.ptr<float>(r);
+            float* ptr_gain = gainMap.ptr<float>(r);
+            for(int c=0;c<W;c++){
+                ptr_guide[c] = ptr_shortg[c]/(float)USHRT_MAX;
+                ptr_gain[c] = ptr_short[c]!=0 ? ptr_fused[c]/(float)ptr_short[c] : 1.f;
+            }
+        }
+
+        // guided filter coefficients, gain ~ a * guide + b in every window
+        cv::Size window(2*ltmGuidedRadius+1, 2*ltmGuidedRadius+1);
+        cv::Mat& meanI = buffers.meanI;
+        cv::Mat& meanG = buffers.meanG;
+        cv::Mat& meanIG = buffers.meanIG;
+        cv::Mat& meanII = buffers.meanII;
+        cv::Mat& a = buffers.a;
+        cv::Mat& b = buffers.b;
+        cv::boxFilter(guide, meanI, CV_32F, window);
+        cv::boxFilter(gainMap, meanG, CV_32F, window);
+        cv::multiply(guide, gainMap, meanIG);
+        cv::boxFilter(meanIG, meanIG, CV_32F, window);
+        cv::multiply(guide, guide, meanII);
+        cv::boxFilter(meanII, meanII, CV_32F, window);
+        a.create(H,W,CV_32F);
+        b.create(H,W,CV_32F);
+        for(int r=0;r<H;r++){
+            const float* ptr_meanI = meanI.ptr<float>(r);
+            const float* ptr_meanG = meanG.ptr<float>(r);
+            const float* ptr_meanIG = meanIG.ptr<float>(r);
+            const float* ptr_meanII = meanII.ptr<float>(r);
+            float* ptr_a = a.ptr<float>(r);
+            float* ptr_b = b.ptr<float>(r);
+            for(int c=0;c<W;c++){
+                ptr_a[c] = (ptr_meanIG[c]-ptr_meanI[c]*ptr_meanG[c])/(ptr_meanII[c]-ptr_meanI[c]*ptr_meanI[c]+ltmGuidedEps);
+                ptr_b[c] = ptr_meanG[c]-ptr_a[c]*ptr_meanI[c];
+            }
+        }
+        cv::boxFilter(a, a, CV_32F, window);
+        cv::boxFilter(b, b, CV_32F, window);
+
+        // bilinear sample positions of every full resolution column (pixel centers aligned)
+        std::vector<int> col0(image.cols), col1(image.cols);
+        std::vector<float> colWeight(image.cols);
+        for(int c=0;c<image.cols;c++){
+            float x = std::min(std::max((c+0.5f)*W/image.cols-0.5f, 0.f), (float)(W-1));
+            col0[c] = (int)x;
+            col1[c] = std::min(col0[c]+1, W-1);
+            colWeight[c] = x-col0[c];
+        }
+
+        // single full resolution pass: guide, upsampled coefficients, channel scaling
+        const std::vector<uint16_t>& gamma = gammasRGB_chain(true).table();
+        #pragma omp parallel for
+        for(int r=0;r<image.rows;r++){
+            float y = std::min(std::max((r+0.5f)*H/image.rows-0.5f, 0.f), (float)(H-1));
+            int row0 = (int)y;
+            int row1 = std::min(row0+1, H-1);
+            float rowWeight = y-row0;
+            const float* a0 = a.ptr<float>(row0);
+            const float* a1 = a.ptr<float>(row1);
+            const float* b0 = b.ptr<float>(row0);
+            const float* b1 = b.ptr<float>(row1);
+            u_int16_t* ptr = image.ptr<u_int16_t>(r);
+            for(int c=0;c<image.cols;c++){
+                u_int16_t* pix = ptr+3*c;
+                uint32_t gray = ((uint32_t)pix[0]+pix[1]+pix[2])/3; // as mean_
+                float I = gamma[gray]/(float)USHRT_MAX;
+                int x0 = col0[c], x1 = col1[c];
+                float wx = colWeight[c];
+                float aTop = a0[x0]+wx*(a0[x1]-a0[x0]), aBottom = a1[x0]+wx*(a1[x1]-a1[x0]);
+                float bTop = b0[x0]+wx*(b0[x1]-b0[x0]), bBottom = b1[x0]+wx*(b1[x1]-b1[x0]);
+                float s = (aTop+rowWeight*(aBottom-aTop))*I + bTop+rowWeight*(bBottom-bTop);
+                if(s<0) s=0;
+                for(int ch=0;ch<3;ch++){
+                    float tmp = pix[ch]*s;
+                    pix[ch] = tmp>USHRT_MAX ? USHRT_MAX : (u_int16_t)tmp;
                 }
             }
         }
-        return result;
     }
 
-    void localToneMap(cv::Mat& mergedImage, Options options, cv::Mat& shortg,
-         cv::Mat& longg, cv::Mat& fusedg, int& gain){
+    void localToneMap(cv::Mat& mergedImage, const Options& options, ltm_buffers& buffers, int& gain){
         std::cout<<"HDR Tone Mapping..."<<std::endl;
+        // tone map gains are smooth: optionally fuse and compute the gains at reduced resolution
+        int downsample = std::max(options.ltmDownsample, 1);
+        cv::Mat ltmImage = mergedImage;
+        if(downsample>1){
+            cv::resize(mergedImage, buffers.ltmImage, cv::Size(std::max(mergedImage.cols/downsample,2), std::max(mergedImage.rows/downsample,2)), 0, 0, cv::INTER_AREA);
+            ltmImage = buffers.ltmImage;
+        }
         // # Work with grayscale images
-        cv::Mat shortGray = rgb_2_gray<uint16_t, uint16_t, CV_16U>(mergedImage); //mean_(mergedImage);
+        cv::Mat& shortGray = buffers.shortGray;
+        mean_(ltmImage, shortGray);
         std::cout<<"--- Compute grayscale image"<<std::endl;
 
         // compute gain
         gain = 0;
         if(options.ltmGain==-1){
-            double dsFactor = 25;
+            double dsFactor = 25.0/downsample; // same search image size at any ltm resolution
             int down_height = round(shortGray.rows/dsFactor);
             int down_width = round(shortGray.cols/dsFactor);
             cv::Mat shortS;
@@ -334,16 +453,17 @@ namespace hdrplus
             bool bestGain = false;
             double compression = 1.0;
             double saturated = 0.0;
-            cv::Mat shortSg = gammasRGB(shortS.clone(), true);
-            double sSMean = getMean(shortSg);
+            // every candidate gain is evaluated over the histogram bins, the image is scanned once
+            std::vector<std::pair<uint16_t,double>> shortSHist = histogram16_(shortS);
+            double sSMean, sSSaturated;
+            gainGammaStats_(shortSHist, 1, 0.95, sSMean, sSSaturated);
 
             while((compression < 1.9 && saturated < .95)||((!bestGain) && (compression < 6) && (gain < 30) && (saturated < 0.33))){
                 gain += 2;
-                cv::Mat longSg = gammasRGB(shortS.clone()*gain, true);
-                double lSMean = getMean(longSg);
+                double lSMean;
+                gainGammaStats_(shortSHist, gain, 0.95, lSMean, saturated);
                 compression = lSMean / sSMean;
                 bestGain = lSMean > (1 - sSMean) / 2;  // only works if burst underexposed
-                saturated = getSaturated(longSg,0.95);
                 if(options.verbose==4){
 
                 }
@@ -355,31 +475,29 @@ namespace hdrplus
             }
         }
         std::cout<<"--- Compute gain"<<std::endl;
-        // create a synthetic long exposure
-        cv::Mat longGray = meanGain_(mergedImage.clone(),gain);
+        // create a synthetic long exposure (gamma corrected in place below)
+        meanGain_(ltmImage,gain,buffers.longg);
         std::cout<<"--- Synthetic long expo"<<std::endl;
         // apply gamma correction to both
-        longg = gammasRGB(longGray.clone(), true);
-        shortg = gammasRGB(shortGray.clone(),true);
+        gammasRGB(buffers.longg, true);
+        gammasRGB(shortGray, buffers.shortg, true);
         std::cout<<"--- Apply Gamma correction"<<std::endl;
         // perform tone mapping by exposure fusion in grayscale
-        cv::Ptr<cv::MergeMertens> mergeMertens = cv::createMergeMertens();
-        std::cout<<"--- Create Mertens"<<std::endl;
-        // hack: cv2 mergeMertens expects inputs between 0 and 255
-	    // but the result is scaled between 0 and 1 (some values can actually be greater than 1!)
-        std::vector<cv::Mat> src_expos;
-        src_expos.push_back(convert16bit2_8bit_(shortg.clone()));
-        src_expos.push_back(convert16bit2_8bit_(longg.clone()));
-        mergeMertens->process(src_expos, fusedg);
-        fusedg = fusedg*USHRT_MAX;
-        fusedg.convertTo(fusedg, CV_16UC1);
+        // two exposure Mertens on the 16 bit exposures, pyramid buffers reused between calls
+        // the result is scaled between 0 and 1 (some values can actually be greater than 1!)
+        buffers.fusion.process(buffers.shortg, buffers.longg, buffers.fused);
+        buffers.fused.convertTo(buffers.fusedg, CV_16U, USHRT_MAX);
         std::cout<<"--- Apply Mertens"<<std::endl;
         // undo gamma correction
-        cv::Mat fusedGray = gammasRGB(fusedg.clone(), false);
+        gammasRGB(buffers.fusedg, buffers.fusedGray, false);
         // cv::imwrite("fusedg_degamma.png", fusedGray);
         std::cout<<"--- Un-apply Gamma correction"<<std::endl;
         // scale each RGB channel of the short exposure accordingly
-        mergedImage = applyScaling_(mergedImage, shortGray, fusedGray);
+        if(downsample>1){
+            applyGainMap_(mergedImage, buffers.shortg, shortGray, buffers.fusedGray, buffers);
+        }else{
+            applyScaling_(mergedImage, shortGray, buffers.fusedGray);
+        }
         std::cout<<"--- Scale channels"<<std::endl;
     }
 
@@ -396,23 +514,39 @@ namespace hdrplus
         return result;
     }
 
-    cv::Mat enhanceContrast(cv::Mat image, Options options){
+    // append the GTM stage to chain, false (and chain unchanged) when the contrast ratio is out of range
+    bool enhanceContrast_stage(pointwise_chain& chain, const Options& options){
         if(options.gtmContrast>=0 && options.gtmContrast<=1){
-            u_int16_t* ptr = (u_int16_t*)image.data;
-            int end = image.rows*image.cols*image.channels();
-            for(int idx = 0;idx<end;idx++){
-                *(ptr+idx) = enhanceContrast_1pix(*(ptr+idx),options.gtmContrast);
-            }
-        }else{
-            std::cout<<"GTM ignored, expected a contrast enhancement ratio between 0 and 1"<<std::endl;
+            double gain = options.gtmContrast;
+            chain.then([=](uint16_t x){ return enhanceContrast_1pix(x,gain); });
+            return true;
+        }
+        std::cout<<"GTM ignored, expected a contrast enhancement ratio between 0 and 1"<<std::endl;
+        return false;
+    }
+
+    void enhanceContrast(cv::Mat& image, const Options& options){
+        pointwise_chain chain;
+        if(enhanceContrast_stage(chain, options)){
+            chain.apply_inplace(image);
         }
-        return image;
     }
 
-    cv::Mat distL1_(cv::Mat X, cv::Mat Y){
+    void globalToneMap(cv::Mat& image, const Options& options){
+        pointwise_chain toneCurve;
+        if(options.gtmContrast && enhanceContrast_stage(toneCurve, options)){
+            std::cout<<"STEP 6 -- Apply GTM"<<std::endl;
+        }
+        toneCurve.then(gammasRGB_stage(true));
+        toneCurve.apply_inplace(image);
+        std::cout<<"-- Apply Gamma"<<std::endl;
+    }
+
+    // |X - Y| into result, reused when it already has the size and type of X
+    void distL1_(const cv::Mat& X, const cv::Mat& Y, cv::Mat& result){
         int end_x = X.rows*X.cols*X.channels();
         int end_y = Y.rows*Y.cols*Y.channels();
-        cv::Mat result = cv::Mat(X.rows,X.cols,X.type());
+        result.create(X.rows,X.cols,X.type());
         if(end_x==end_y){
             u_int16_t* ptr_x = (u_int16_t*)X.data;
             u_int16_t* ptr_y = (u_int16_t*)Y.data;
@@ -427,15 +561,14 @@ namespace hdrplus
         }else{
             std::cout<<"Mat size not match. distL1_ failed!"<<std::endl;
         }
-        return result;
     }
 
-    cv::Mat sharpenTriple_(cv::Mat image,
-        cv::Mat blur0, cv::Mat low0, float th0, float k0,
-        cv::Mat blur1, cv::Mat low1, float th1, float k1,
-        cv::Mat blur2, cv::Mat low2, float th2, float k2){
-            // create result mat
-            cv::Mat result = cv::Mat(image.rows,image.cols,image.type());
+    void sharpenTriple_(const cv::Mat& image, cv::Mat& result,
+        const cv::Mat& blur0, const cv::Mat& low0, float th0, float k0,
+        const cv::Mat& blur1, const cv::Mat& low1, float th1, float k1,
+        const cv::Mat& blur2, const cv::Mat& low2, float th2, float k2){
+            // result mat, reused when it already has the image size and type
+            result.create(image.rows,image.cols,image.type());
             // initialize iteraters
             u_int16_t* ptr_r = (u_int16_t*)result.data;
             u_int16_t* ptr_img = (u_int16_t*)image.data;
@@ -465,34 +598,54 @@ namespace hdrplus
                 if(r>USHRT_MAX) r = USHRT_MAX;
                 *(ptr_r+idx) = (u_int16_t)r;
             }
-            return result;
         }
 
-    cv::Mat sharpenTriple(cv::Mat image, Tuning tuning, Options options){
-        // sharpen the image using unsharp masking
-        std::vector<float> amounts = tuning.sharpenAmount;
-        std::vector<float> sigmas = tuning.sharpenSigma;
-        std::vector<float> thresholds = tuning.sharpenThreshold;
-        // Compute all Gaussian blur
-        cv::Mat blur0,blur1,blur2;
-        cv::GaussianBlur(image,blur0,cv::Size(0,0),sigmas[0]);
-        cv::GaussianBlur(image,blur1,cv::Size(0,0),sigmas[1]);
-        cv::GaussianBlur(image,blur2,cv::Size(0,0),sigmas[2]);
+    void sharpenBlurs(const cv::Mat& image, const Tuning& tuning, const Options& options, sharpen_buffers& buffers){
+        if(options.sharpenEngine == "banded"){
+            return;
+        }else if(options.sharpenEngine != "opencv"){
+            throw std::runtime_error("sharpen engine " + options.sharpenEngine + " not supported, use banded or opencv");
+        }
+        const std::vector<float>& sigmas = tuning.sharpenSigma;
+        // Compute all Gaussian blur (reference engine) into the reused buffers
+        cv::GaussianBlur(image,buffers.blur0,cv::Size(0,0),sigmas[0]);
+        cv::GaussianBlur(image,buffers.blur1,cv::Size(0,0),sigmas[1]);
+        cv::GaussianBlur(image,buffers.blur2,cv::Size(0,0),sigmas[2]);
         std::cout<<" --- gaussian blur"<<std::endl;
         // cv::imwrite("blur2.png", blur2);
         // Compute all low contrast images
-        cv::Mat low0 = distL1_(blur0, image);
-        cv::Mat low1 = distL1_(blur1, image);
-        cv::Mat low2 = distL1_(blur2, image);
+        distL1_(buffers.blur0, image, buffers.low0);
+        distL1_(buffers.blur1, image, buffers.low1);
+        distL1_(buffers.blur2, image, buffers.low2);
         std::cout<<" --- low contrast"<<std::endl;
         // cv::imwrite("low2.png", low2);
-        // Compute the triple sharpen
-        cv::Mat sharpImage = sharpenTriple_(image,
-         blur0, low0, thresholds[0], amounts[0],
-         blur1, low1, thresholds[1], amounts[1],
-         blur2, low2, thresholds[2], amounts[2]);
-        std::cout<<" --- sharpen"<<std::endl;
-        return sharpImage;
+    }
+
+    void sharpenRows(const cv::Mat& image, cv::Mat& sharpImage, const Tuning& tuning, const Options& options, sharpen_buffers& buffers,
+        int rowStart, int rowEnd){
+        const std::vector<float>& amounts = tuning.sharpenAmount;
+        const std::vector<float>& thresholds = tuning.sharpenThreshold;
+        if(options.sharpenEngine == "banded"){
+            sharpen_triple_banded(image, amounts, tuning.sharpenSigma, thresholds, sharpImage, rowStart, rowEnd);
+            return;
+        }
+        // Compute the triple sharpen of the rows, full width row ranges are continuous
+        cv::Mat sharpRows = sharpImage.rowRange(rowStart, rowEnd);
+        sharpenTriple_(image.rowRange(rowStart, rowEnd), sharpRows,
+         buffers.blur0.rowRange(rowStart, rowEnd), buffers.low0.rowRange(rowStart, rowEnd), thresholds[0], amounts[0],
+         buffers.blur1.rowRange(rowStart, rowEnd), buffers.low1.rowRange(rowStart, rowEnd), thresholds[1], amounts[1],
+         buffers.blur2.rowRange(rowStart, rowEnd), buffers.low2.rowRange(rowStart, rowEnd), thresholds[2], amounts[2]);
+    }
+
+    void sharpenTriple(const cv::Mat& image, cv::Mat& sharpImage, const Tuning& tuning, const Options& options, sharpen_buffers& buffers){
+        // sharpen the image using unsharp masking
+        if(sharpImage.data == image.data){
+            throw std::runtime_error("sharpenTriple cannot sharpen in place");
+        }
+        sharpenBlurs(image, tuning, options, buffers);
+        sharpImage.create(image.rows, image.cols, image.type());
+        sharpenRows(image, sharpImage, tuning, options, buffers, 0, image.rows);
+        std::cout<<" --- sharpen ("<<options.sharpenEngine<<")"<<std::endl;
     }
 
     void copy_mat_16U_3(u_int16_t* ptr_A, cv::Mat B){
@@ -554,159 +707,247 @@ namespace hdrplus
         myfile.close();
     }
 
-    void finish::process(const hdrplus::burst& burst_images){
-        // copy mergedBayer to rawReference
-        std::cout<<"finish pipeline start ..."<<std::endl;
-
-        // save merged Image value
-        writeCSV("merged.csv",burst_images.merged_bayer_image);
-
-        this->refIdx = burst_images.reference_image_idx;
-        // this->burstPath = burstPath;
-        // std::cout<<"processMerged:"<<std::endl;
-        // show20_20(mergedB);
-        
-        // this->mergedBayer = processMergedMat(mergedB,CV_16UC1);//loadFromCSV("merged.csv", CV_16UC1);
-        // std::cout<<"processMerged:"<<std::endl;
-        // show20_20(this->mergedBayer);
-        this->mergedBayer = loadFromCSV("merged.csv", CV_16UC1);
-
-        // std::cout<<"csv:"<<std::endl;
-        // show20_20(this->mergedBayer);
-        // load_rawPathList(burstPath);
-
-        
-
-// read in ref img
-        // bayer_image* ref = new bayer_image(rawPathList[refIdx]);
-        bayer_image* ref = new bayer_image(burst_images.bayer_images[burst_images.reference_image_idx]);
-        cv::Mat processedRefImage = postprocess(ref->libraw_processor,params.rawpyArgs);
+    // raw front end: LibRaw dcraw_process (reference mode) or native demosaic of bayer_image
+    // preview: bayer_image is 2x2 binned (native demosaic only), previewScale 4 halves the developed image again
+    cv::Mat developRaw(std::shared_ptr<LibRaw>& libraw_ptr, const cv::Mat& bayer_image, const Parameters& params){
+        int binning = params.options.previewScale > 0 ? 2 : 1;
+        cv::Mat developed;
+        if(params.options.frontEnd == "libraw"){
+            if(binning != 1){
+                throw std::runtime_error("preview needs a native demosaic front end, use mhc or bilinear");
+            }
+            return postprocess(libraw_ptr,params.rawpyArgs);
+        }else if(params.options.frontEnd == "mhc"){
+            developed = demosaic_process(libraw_ptr,bayer_image,params.rawpyArgs,DEMOSAIC_MHC,binning);
+        }else if(params.options.frontEnd == "bilinear"){
+            developed = demosaic_process(libraw_ptr,bayer_image,params.rawpyArgs,DEMOSAIC_BILINEAR,binning);
+        }else{
+            throw std::runtime_error("front end " + params.options.frontEnd + " not supported, use libraw, mhc or bilinear");
+        }
+        if(params.options.previewScale == 4){
+            cv::Mat quarter;
+            cv::resize(developed, quarter, cv::Size(developed.cols/2, developed.rows/2), 0, 0, cv::INTER_AREA);
+            developed = quarter;
+        }
+        return developed;
+    }
 
+    // reference comparison outputs: developed reference, its gamma version and the reference through the same finish
+    // as the merged image, tone mapped with the ltm gain of the merged image
+    void finishReference_(cv::Mat processedRefImage, Parameters params, std::shared_future<int> ltmGain,
+         std::shared_ptr<artifact_sink> artifacts, bool writeReferenceImage, bool writeGammaReference, bool writeReferenceFinal){
         std::cout<<"size ref: "<<processedRefImage.rows<<"*"<<processedRefImage.cols<<std::endl;
 
 // write reference image
-        if(params.flags["writeReferenceImage"]){
+        if(writeReferenceImage){
             std::cout<<"writing reference img ..."<<std::endl;
-            cv::Mat outputImg = convert16bit2_8bit_(processedRefImage.clone());
-            cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-            // cv::imshow("test",processedImage);
-            cv::imwrite("processedRef.jpg", outputImg);
-            // cv::waitKey(0);
+            artifacts->write("processedRef.jpg", convert16bitRGB2_8bitBGR_(processedRefImage));
         }
 
 // write gamma reference
-        if(params.flags["writeGammaReference"]){
+        if(writeGammaReference){
             std::cout<<"writing Gamma reference img ..."<<std::endl;
-            cv::Mat outputImg = gammasRGB(processedRefImage.clone(),true);
-            outputImg = convert16bit2_8bit_(outputImg);
-            cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-            cv::imwrite("processedRefGamma.jpg", outputImg);
+            artifacts->write("processedRefGamma.jpg", convert16bitRGB2_8bitBGR_(processedRefImage, pointwise_chain().then(gammasRGB_stage(true))));
+        }
+
+// write final ref
+        if(writeReferenceFinal){
+            int gain = ltmGain.get();
+            std::cout<<"writing Final Ref Image ..."<<std::endl;
+            if(params.options.ltmGain){
+                params.options.ltmGain = gain;
+            }
+            // buffers of its own, the task runs concurrently with the merged image
+            ltm_buffers refBuffers;
+            localToneMap(processedRefImage, params.options, refBuffers, gain);
+            globalToneMap(processedRefImage, params.options);
+            // sharpen
+            cv::Mat finalRefImage;
+            sharpen_buffers refSharpenBuffers;
+            sharpenTriple(processedRefImage, finalRefImage, params.tuning, params.options, refSharpenBuffers);
+            artifacts->write("FinalReference.jpg", convert16bitRGB2_8bitBGR_(finalRefImage));
         }
+    }
+
+    // store one final output (suffix "" for the full size one): 8 bit JPEG to the sink when there is one, else the
+    // encoded bytes (8 bit JPEG for 'mat') at options.output or FinalImage.<format>, suffix inserted before the extension
+    void writeFinal_(const std::string& suffix, const cv::Mat& image, const std::vector<uchar>& encoded,
+         const Options& options, const std::shared_ptr<artifact_sink>& artifacts){
+        // options.output (or FinalImage.<ext>) is always written, the sink gets a jpeg copy with the other artifacts
+        if(artifacts){
+            artifacts->write("FinalImage" + suffix + ".jpg", convert16bitRGB2_8bitBGR_(image));
+        }
+        std::string extension = encoded.empty() || options.outputFormat == "jpeg" ? ".jpg" : "." + options.outputFormat;
+        std::string outputPath = "FinalImage" + suffix + extension;
+        if(!options.output.empty()){
+            size_t dot = options.output.find_last_of('.');
+            size_t slash = options.output.find_last_of('/');
+            bool hasExtension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+            outputPath = hasExtension ? options.output.substr(0, dot) + suffix + options.output.substr(dot) : options.output + suffix;
+        }
+        if(encoded.empty()){
+            cv::imwrite(outputPath, convert16bitRGB2_8bitBGR_(image));
+            return;
+        }
+        std::ofstream outputFile(outputPath, std::ios::binary);
+        outputFile.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+        if(!outputFile){
+            throw std::runtime_error("Error writing final image " + outputPath);
+        }
+    }
 
-// get the bayer_image of the merged image
-        // bayer_image* mergedImg = new bayer_image(rawPathList[refIdx]);
-        bayer_image* mergedImg  = new bayer_image(burst_images.bayer_images[this->refIdx]);
-        mergedImg->libraw_processor->imgdata.rawdata.raw_image = (uint16_t*)this->mergedBayer.data;
-        // copy_mat_16U_3(mergedImg->libraw_processor->imgdata.rawdata.raw_image,this->mergedBayer);
-        cv::Mat processedMerge = postprocess(mergedImg->libraw_processor,params.rawpyArgs);
+    void finish::process(const hdrplus::burst& burst_images, bool writeFinal){
+        // copy mergedBayer to rawReference
+        std::cout<<"finish pipeline start ..."<<std::endl;
+
+        // merged bayer image is handed over in memory, csv is a debug export only
+        if(params.flags["writeMergedCSV"]){
+            writeCSV("merged.csv",burst_images.merged_bayer_image);
+        }
+        this->mergedBayer = burst_images.merged_bayer_image;
+        this->refIdx = burst_images.reference_image_idx;
+
+// reference comparison branch (opt-in): developed and finished as an independent task, concurrent with the merged image
+        bool writeReferenceImage = artifacts && params.flags["writeReferenceImage"];
+        bool writeGammaReference = artifacts && params.flags["writeGammaReference"];
+        bool writeReferenceFinal = artifacts && params.flags["writeReferenceFinal"];
+        // declared before the gain promise: if the merged branch throws, the promise is broken first and the task can end
+        std::future<void> referenceTask;
+        std::promise<int> ltmGainPromise;
+        if(writeReferenceImage || writeGammaReference || writeReferenceFinal){
+            std::shared_ptr<LibRaw> refLibraw = burst_images.bayer_images[this->refIdx].libraw_processor;
+            const cv::Mat& refBayer = burst_images.bayer_images[this->refIdx].raw_image;
+            std::shared_future<int> ltmGain = ltmGainPromise.get_future().share();
+            Parameters refParams = params;
+            // the reference frame context is used by this task only, the merged image has its own
+            referenceTask = std::async(std::launch::async, [=]() mutable {
+                cv::Mat processedRefImage = developRaw(refLibraw,refBayer,refParams);
+                finishReference_(processedRefImage, refParams, ltmGain, artifacts, writeReferenceImage, writeGammaReference, writeReferenceFinal);
+            });
+        }
+
+// LibRaw context of the merged image. The native demosaic only reads the reference frame metadata. dcraw_process
+// develops the raw image of the context, overwritten with the merged bayer image: the reference frame context when
+// the reference task does not use it, the reference raw image is copied back after; otherwise a pooled context of
+// its own, the reference raw unpacked again
+        const hdrplus::bayer_image& refFrame = burst_images.bayer_images[this->refIdx];
+        std::shared_ptr<LibRaw> mergedLibraw = refFrame.libraw_processor;
+        bool borrowedLibraw = false;
+        if(params.options.frontEnd == "libraw"){
+            if(referenceTask.valid() || refFrame.raw_image.empty()){
+                mergedLibraw = libraw_pool::shared()->checkout_unpacked(refFrame.path);
+            }else{
+                borrowedLibraw = true;
+            }
+            copy_rawImg2libraw(mergedLibraw,this->mergedBayer);
+        }
+        cv::Mat processedMerge;
+        try{
+            processedMerge = developRaw(mergedLibraw,this->mergedBayer,params);
+        }catch(...){
+            if(borrowedLibraw){
+                copy_rawImg2libraw(mergedLibraw,refFrame.raw_image);
+            }
+            throw;
+        }
+        if(borrowedLibraw){
+            copy_rawImg2libraw(mergedLibraw,refFrame.raw_image);
+        }
+        mergedLibraw.reset(); // back to the pool when checked out
 
 // write merged image
-        if(params.flags["writeMergedImage"]){
+        if(artifacts && params.flags["writeMergedImage"]){
             std::cout<<"writing Merged img ..."<<std::endl;
-            cv::Mat outputImg = convert16bit2_8bit_(processedMerge.clone());
-            cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-            cv::imwrite("mergedImg.jpg", outputImg);
+            artifacts->write("mergedImg.jpg", convert16bitRGB2_8bitBGR_(processedMerge));
         }
 
 // write gamma merged image
-        if(params.flags["writeMergedImage"]){
+        if(artifacts && params.flags["writeGammaMerged"]){
             std::cout<<"writing Gamma Merged img ..."<<std::endl;
-            cv::Mat outputImg = gammasRGB(processedMerge.clone(),true);
-            outputImg = convert16bit2_8bit_(outputImg);
-            cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-            cv::imwrite("mergedImgGamma.jpg", outputImg);
+            artifacts->write("mergedImgGamma.jpg", convert16bitRGB2_8bitBGR_(processedMerge, pointwise_chain().then(gammasRGB_stage(true))));
         }
 
 // step 5. HDR tone mapping
 // processedImage, gain, shortExposure, longExposure, fusedExposure = localToneMap(burstPath, processedImage, options)
-        int gain;
+        int gain = 0;
         if(params.options.ltmGain){
-            cv::Mat shortExposure, longExposure, fusedExposure;
-            
-            localToneMap(processedMerge, params.options,shortExposure,longExposure,fusedExposure,gain);
+            localToneMap(processedMerge, params.options, ltmBuffers, gain);
             std::cout<<"gain="<< gain<<std::endl;
-            if(params.flags["writeShortExposure"]){
+            if(artifacts && params.flags["writeShortExposure"]){
                 std::cout<<"writing ShortExposure img ..."<<std::endl;
-                cv::Mat outputImg = convert16bit2_8bit_(shortExposure);
-                cv::imwrite("shortg.jpg", outputImg);
+                artifacts->write("shortg.jpg", convert16bit2_8bit_(ltmBuffers.shortg));
             }
-            if(params.flags["writeLongExposure"]){
+            if(artifacts && params.flags["writeLongExposure"]){
                 std::cout<<"writing LongExposure img ..."<<std::endl;
-                cv::Mat outputImg = convert16bit2_8bit_(longExposure);
-                cv::imwrite("longg.jpg", outputImg);
+                artifacts->write("longg.jpg", convert16bit2_8bit_(ltmBuffers.longg));
             }
-            if(params.flags["writeFusedExposure"]){
+            if(artifacts && params.flags["writeFusedExposure"]){
                 std::cout<<"writing FusedExposure img ..."<<std::endl;
-                cv::Mat outputImg = convert16bit2_8bit_(fusedExposure);
-                cv::imwrite("fusedg.jpg", outputImg);
+                artifacts->write("fusedg.jpg", convert16bit2_8bit_(ltmBuffers.fusedg));
             }
-            if(params.flags["writeLTMImage"]){
+            if(artifacts && params.flags["writeLTMImage"]){
                 std::cout<<"writing LTMImage ..."<<std::endl;
-                cv::Mat outputImg = convert16bit2_8bit_(processedMerge.clone());
-                cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-                cv::imwrite("ltmGain.jpg", outputImg);
+                artifacts->write("ltmGain.jpg", convert16bitRGB2_8bitBGR_(processedMerge));
             }
-            if(params.flags["writeLTMGamma"]){
+            if(artifacts && params.flags["writeLTMGamma"]){
                 std::cout<<"writing LTMImage Gamma ..."<<std::endl;
-                cv::Mat outputImg = gammasRGB(processedMerge.clone(),true);
-                outputImg = convert16bit2_8bit_(outputImg);
-                cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-                cv::imwrite("ltmGain_gamma.jpg", outputImg);
+                artifacts->write("ltmGain_gamma.jpg", convert16bitRGB2_8bitBGR_(processedMerge, pointwise_chain().then(gammasRGB_stage(true))));
             }
         }
+        // the reference branch tone maps with the same gain
+        ltmGainPromise.set_value(gain);
 
-// step 6 GTM: contrast enhancement / global tone mapping
-        if(params.options.gtmContrast){
-            processedMerge = enhanceContrast(processedMerge, params.options);
-            std::cout<<"STEP 6 -- Apply GTM"<<std::endl;
-        }
+// step 6 GTM: contrast enhancement / global tone mapping, fused with the final sRGB gamma curve in one pass
+        globalToneMap(processedMerge, params.options);
 
-        // apply the final sRGB gamma curve
-        processedMerge = gammasRGB(processedMerge.clone(),true);
-        std::cout<<"-- Apply Gamma"<<std::endl;
-
-        if(params.flags["writeGTMImage"]){
+        if(artifacts && params.flags["writeGTMImage"]){
             std::cout<<"writing GTMImage ..."<<std::endl;
-            cv::Mat outputImg = convert16bit2_8bit_(processedMerge.clone());
-            cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-            cv::imwrite("GTM_gamma.jpg", outputImg);
+            artifacts->write("GTM_gamma.jpg", convert16bitRGB2_8bitBGR_(processedMerge));
+        }
+
+// Step 7: sharpen, the final image is kept (finalImage) and encoded in params.options.outputFormat (encodedOutput).
+// Allocated per run unlike the tone mapping buffers: callers keep it beyond the next run.
+        cv::Mat processedImage;
+        std::unique_ptr<jpeg_strip_encoder> stripEncoder;
+        if(params.options.outputFormat == "jpeg"){
+            // strips are sharpened in turn, each strip is JPEG encoded on its own thread while the next ones are sharpened
+            // (the opencv engine blurs the full frame first, its per pixel pass runs strip by strip)
+            sharpenBlurs(processedMerge, params.tuning, params.options, sharpenBuffers);
+            processedImage.create(processedMerge.size(), processedMerge.type());
+            stripEncoder.reset(new jpeg_strip_encoder(processedMerge.rows, processedMerge.cols, params.options.jpegQuality));
+            for(int rowStart = 0; rowStart < processedMerge.rows; rowStart += stripEncoder->strip_rows()){
+                int rowEnd = std::min(rowStart + stripEncoder->strip_rows(), processedMerge.rows);
+                sharpenRows(processedMerge, processedImage, params.tuning, params.options, sharpenBuffers, rowStart, rowEnd);
+                stripEncoder->add_strip(convert16bitRGB2_8bitBGR_(processedImage.rowRange(rowStart, rowEnd)));
+            }
+            std::cout<<" --- sharpen ("<<params.options.sharpenEngine<<") and JPEG encode"<<std::endl;
+        }else{
+            sharpenTriple(processedMerge, processedImage, params.tuning, params.options, sharpenBuffers);
         }
+        this->finalImage = processedImage;
 
-// Step 7: sharpen
-        cv::Mat processedImage = sharpenTriple(processedMerge.clone(), params.tuning, params.options);
-        if(params.flags["writeFinalImage"]){
-            std::cout<<"writing FinalImage ..."<<std::endl;
-            cv::Mat outputImg = convert16bit2_8bit_(processedImage.clone());
-            cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-            cv::imwrite("FinalImage.jpg", outputImg);
+        // downscaled outputs from one pyramid of the sharpened 16 bit image, every output encoded on its own thread
+        std::vector<cv::Mat> scaledImages = downscale_outputs(processedImage, params.options.outputSizes);
+        std::vector<std::future<std::vector<uchar>>> scaledEncodes;
+        for(const cv::Mat& scaledImage : scaledImages){
+            scaledEncodes.push_back(std::async(std::launch::async, encode_output, scaledImage, params.options.outputFormat, params.options.jpegQuality));
         }
-// write final ref
-        if(params.flags["writeReferenceFinal"]){
-            std::cout<<"writing Final Ref Image ..."<<std::endl;
-            if(params.options.ltmGain){
-                params.options.ltmGain = gain;
-            }
-            cv::Mat shortExposureRef, longExposureRef, fusedExposureRef;
-            localToneMap(processedRefImage, params.options,shortExposureRef,longExposureRef,fusedExposureRef,gain);
-            if(params.options.gtmContrast){ // contrast enhancement / global tone mapping
-                processedRefImage = enhanceContrast(processedRefImage, params.options);
+        this->encodedOutput = stripEncoder ? stripEncoder->finish() : encode_output(processedImage, params.options.outputFormat, params.options.jpegQuality);
+        this->scaledOutputs.clear();
+        for(size_t i = 0; i < scaledImages.size(); i++){
+            this->scaledOutputs.push_back(output_image{scaledImages[i], scaledEncodes[i].get()});
+        }
+
+        // the final images are the result, not intermediates: written in place of the run when there is no sink
+        if(writeFinal && params.flags["writeFinalImage"]){
+            std::cout<<"writing FinalImage ..."<<std::endl;
+            writeFinal_("", this->finalImage, this->encodedOutput, params.options, artifacts);
+            for(size_t i = 0; i < this->scaledOutputs.size(); i++){
+                writeFinal_("_" + std::to_string(params.options.outputSizes[i]), this->scaledOutputs[i].image, this->scaledOutputs[i].encoded, params.options, artifacts);
             }
-            processedRefImage = gammasRGB(processedRefImage.clone(),true);
-            // sharpen
-            processedRefImage = sharpenTriple(processedRefImage.clone(), params.tuning, params.options);
-            cv::Mat outputImg = convert16bit2_8bit_(processedRefImage.clone());
-            cv::cvtColor(outputImg, outputImg, cv::COLOR_RGB2BGR);
-            cv::imwrite("FinalReference.jpg", outputImg);
+        }
+        if(referenceTask.valid()){
+            referenceTask.get();
         }
 // End of finishing
     }
@@ -723,15 +964,23 @@ namespace hdrplus
 
     
 
-    void finish::copy_rawImg2libraw(std::shared_ptr<LibRaw>& libraw_ptr, cv::Mat B){
+    void finish::copy_rawImg2libraw(std::shared_ptr<LibRaw>& libraw_ptr, const cv::Mat& B){
+        int raw_width = libraw_ptr->imgdata.rawdata.sizes.raw_width;
+        int raw_height = libraw_ptr->imgdata.rawdata.sizes.raw_height;
+        if(libraw_ptr->imgdata.rawdata.raw_image == nullptr){
+            throw std::runtime_error("LibRaw context holds no bayer raw image");
+        }
+        if(B.rows != raw_height || B.cols != raw_width || B.type() != CV_16UC1){
+            throw std::runtime_error("merged bayer image does not match LibRaw raw image size");
+        }
+
+        // copied into the raw buffer owned by the context (rows raw_pitch bytes apart), LibRaw never points at B
         u_int16_t* ptr_A = (u_int16_t*)libraw_ptr->imgdata.rawdata.raw_image;
-        u_int16_t* ptr_B = (u_int16_t*)B.data;
+        size_t pitch = libraw_ptr->imgdata.rawdata.sizes.raw_pitch / sizeof(u_int16_t);
+        #pragma omp parallel for
         for(int r = 0; r < B.rows; r++) {
-            for(int c = 0; c < B.cols; c++) {
-                *(ptr_A+r*B.cols+c) = *(ptr_B+r*B.cols+c);
-            }
+            memcpy(ptr_A + r * pitch, B.ptr<u_int16_t>(r), raw_width * sizeof(u_int16_t));
         }
-
     }
     
     
@@ -2,33 +2,291 @@
 #include <string>
 #include <vector>
 #include <utility> // std::pair
+#include <future> // std::async
+#include <cmath> // std::ceil
+#include <algorithm> // std::min, std::max
+#include <stdexcept> // std::runtime_error
 #include <opencv2/opencv.hpp> // all opencv header
 #include "hdrplus/hdrplus_pipeline.h"
 #include "hdrplus/burst.h"
 #include "hdrplus/align.h"
 #include "hdrplus/merge.h"
 #include "hdrplus/finish.h"
+#include "hdrplus/artifact_sink.h"
 #include <fstream>
 
 namespace hdrplus
 {
 
+hdrplus_pipeline::hdrplus_pipeline( const hdrplus::Options& options ) : options( options )
+{
+    merge_module.options = options;
+    finish_module.params.options = options;
+
+    // Preview: binned frames merge with half size tiles (same scene area per tile),
+    // LibRaw only develops full raw images so finish uses the native demosaic
+    if ( options.previewScale > 0 )
+    {
+        merge_module.options.tilesize = std::max( options.tilesize / 2, 8 );
+        if ( finish_module.params.options.frontEnd == "libraw" )
+        {
+            finish_module.params.options.frontEnd = "bilinear";
+        }
+    }
+}
+
+// Strips start at a multiple of this many bayer rows, so that every pyramid level samples
+// the same pixels and uses the same tile grid as full frame (coarsest level tile stride is
+// 4 pixels at 1/32 of the grayscale image), and merge tile rows keep their parity.
+static const int strip_row_alignment = 256;
+
+// Bayer rows aligned and merged on each side of a strip and thrown away. Covers the coarsest
+// level tile and search window, the pyramid blur support and the largest displacement, so
+// tiles inside the strip never see the band border and the result is the same as full frame.
+static const int strip_halo_rows = 1280;
+
+// Bytes resident per padded bayer row of a band
+// band  : rows of every frame read from its spill file, 16 bit bayer and 2x2 box filtered grayscale (1/4 of the pixels)
+// merge : overlapped tiles hold 4 values per channel pixel, reference and sum DFT (2 complex)
+//         for the dft engine, spatial sum for the spatial engine and skipped tiles,
+//         plus the float channel plane of finalize
+// align : grayscale pyramid (1/4 pixels, 16 bit, 4/3 with coarser levels) of every frame
+static double band_bytes_per_row( int num_images, int cols, const hdrplus::Options& options )
+{
+    double band_bytes_per_row = num_images * cols * sizeof( uint16_t ) * ( 1 + 1 / 4.0 );
+    double merge_bytes_per_channel_pixel = 4 * sizeof( float );
+    if ( options.mergeEngine != "spatial" )
+        merge_bytes_per_channel_pixel += 4 * 4 * sizeof( float );
+    if ( options.mergeEngine == "spatial" || options.skipTrivialTiles )
+        merge_bytes_per_channel_pixel += 4 * sizeof( float );
+    double align_bytes_per_row = num_images * ( cols / 4.0 ) * sizeof( uint16_t ) * 4 / 3;
+    return band_bytes_per_row + merge_bytes_per_channel_pixel * cols + align_bytes_per_row;
+}
+
+// Bytes resident outside of the bands: the merged padded frame, written strip by strip
+static double merged_frame_bytes( int rows, int cols )
+{
+    return double( rows ) * cols * sizeof( uint16_t );
+}
+
+// Bytes of one frame being spilled by burst: LibRaw raw buffer, its 16 bit copy and grayscale image
+static double decode_frame_bytes( int rows, int cols )
+{
+    return double( rows ) * cols * sizeof( uint16_t ) * ( 2 + 1 / 4.0 );
+}
+
+int hdrplus_pipeline::min_memory_budget_mb( int num_images, int rows, int cols, const hdrplus::Options& options )
+{
+    double strip_bytes = merged_frame_bytes( rows, cols ) + \
+        ( strip_row_alignment + 2 * strip_halo_rows ) * band_bytes_per_row( num_images, cols, options );
+    double min_bytes = std::max( strip_bytes, decode_frame_bytes( rows, cols ) );
+    return int( std::ceil( min_bytes / ( 1024.0 * 1024.0 ) ) );
+}
+
+// Number of padded bayer rows per strip so that the resident bands, align and merge working set
+// and the merged frame stay within the budget
+static int strip_rows_for_budget( const hdrplus::burst& burst_images, const hdrplus::Options& options )
+{
+    int rows = burst_images.padded_size.height;
+    int cols = burst_images.padded_size.width;
+    if ( options.memoryBudgetMB <= 0 )
+    {
+        return rows;
+    }
+
+    int min_budget_mb = hdrplus_pipeline::min_memory_budget_mb( burst_images.num_images, rows, cols, options );
+    if ( options.memoryBudgetMB < min_budget_mb )
+    {
+        throw std::runtime_error("memory budget of " + std::to_string( options.memoryBudgetMB ) + " MB is below the " + \
+            std::to_string( min_budget_mb ) + " MB of one strip of " + std::to_string( strip_row_alignment ) + \
+            " rows with its halo for this burst");
+    }
+
+    double bytes_per_row = band_bytes_per_row( burst_images.num_images, cols, options );
+    double budget_rows = ( options.memoryBudgetMB * 1024.0 * 1024.0 - merged_frame_bytes( rows, cols ) ) / bytes_per_row \
+        - 2 * strip_halo_rows;
+    int strip_rows = std::max( int( budget_rows ) / strip_row_alignment, 1 ) * strip_row_alignment;
+
+    #ifndef NDEBUG
+    printf("%s::%s memory budget %d MB, %.0f bytes per row, strip of %d rows\n", \
+        __FILE__, __func__, options.memoryBudgetMB, bytes_per_row, strip_rows );
+    #endif
+
+    return strip_rows;
+}
+
+cv::Mat hdrplus_pipeline::align_merge( const hdrplus::burst& burst_images, int row_start, int row_end )
+{
+    // Same rows of every frame, views without copy, or read from the spill files
+    std::vector<cv::Mat> bayer_images( burst_images.num_images );
+    std::vector<cv::Mat> grayscale_images( burst_images.num_images );
+    for ( int img_idx = 0; img_idx < burst_images.num_images; ++img_idx )
+    {
+        burst_images.read_band( img_idx, row_start, row_end, bayer_images[ img_idx ], grayscale_images[ img_idx ] );
+    }
+    std::vector<std::vector<std::vector<std::pair<int, int>>>> alignments;
+
+    // Start merging with the reference image
+    const hdrplus::bayer_image& reference_bayer = burst_images.bayer_images[ burst_images.reference_image_idx ];
+    double lambda_shot, lambda_read;
+    std::tie( lambda_shot, lambda_read ) = reference_bayer.get_noise_params();
+    // A binned sample is the mean of binning^2 samples of its color
+    lambda_shot /= burst_images.binning * burst_images.binning;
+    lambda_read /= burst_images.binning * burst_images.binning;
+    int black_level = ( reference_bayer.black_level_per_channel[ 0 ] + reference_bayer.black_level_per_channel[ 1 ] + \
+                        reference_bayer.black_level_per_channel[ 2 ] + reference_bayer.black_level_per_channel[ 3 ] ) / 4;
+    merge_module.init( bayer_images[ burst_images.reference_image_idx ], lambda_shot, lambda_read, \
+                       reference_bayer.white_level, black_level );
+
+    if ( options.fusedTileRows > 0 )
+    {
+        // Fused align and merge, each block of finest level tile rows is merged right after
+        // its alignment while the block pixels are still in cache. Coarser levels are aligned first.
+        align_module.process( grayscale_images, burst_images.reference_image_idx, alignments, \
+            [&]( int /*img_idx*/ )
+            {
+                merge_module.end_frame();
+            },
+            [&]( int img_idx, const std::vector<std::vector<std::pair<int, int>>>& alignment, int tile_row_start, int tile_row_end )
+            {
+                merge_module.add_frame( bayer_images[ img_idx ], alignment, tile_row_start, tile_row_end );
+            },
+            options.fusedTileRows );
+
+        return merge_module.finalize();
+    }
+
+    // Run align, every alternative image is merged as soon as it is aligned.
+    // Merging of image i overlaps with alignment of image i+1.
+    std::future<void> merging;
+    align_module.process( grayscale_images, burst_images.reference_image_idx, alignments, [&]( int img_idx )
+    {
+        // accumulators are shared, one image merged at a time
+        if ( merging.valid() )
+            merging.get();
+
+        merging = std::async( std::launch::async, [&, img_idx]()
+        {
+            merge_module.add_frame( bayer_images[ img_idx ], alignments[ img_idx ] );
+        });
+    });
+    if ( merging.valid() )
+        merging.get();
+
+    // Finish merging
+    return merge_module.finalize();
+}
+
+cv::Mat hdrplus_pipeline::align_merge_strips( const hdrplus::burst& burst_images )
+{
+    // Align and merge full frame, or strip by strip within the memory budget
+    int rows = burst_images.padded_size.height;
+    int strip_rows = strip_rows_for_budget( burst_images, options );
+    cv::Mat merged_image_pad;
+    if ( strip_rows >= rows )
+    {
+        merged_image_pad = align_merge( burst_images, 0, rows );
+    }
+    else
+    {
+        merged_image_pad.create( rows, burst_images.padded_size.width, CV_16U );
+        for ( int strip_start = 0; strip_start < rows; strip_start += strip_rows )
+        {
+            int strip_end = std::min( strip_start + strip_rows, rows );
+            int band_start = std::max( strip_start - strip_halo_rows, 0 );
+            int band_end = std::min( strip_end + strip_halo_rows, rows );
+
+            #ifndef NDEBUG
+            printf("%s::%s strip rows [%d, %d) with band [%d, %d)\n", \
+                __FILE__, __func__, strip_start, strip_end, band_start, band_end );
+            #endif
+
+            cv::Mat merged_band = align_merge( burst_images, band_start, band_end );
+            merged_band.rowRange( strip_start - band_start, strip_end - band_start ).copyTo( \
+                merged_image_pad.rowRange( strip_start, strip_end ) );
+        }
+    }
+
+    // Remove padding
+    const std::vector<int>& padding = burst_images.padding_info_bayer;
+    cv::Range horizontal = cv::Range( padding[ 2 ], merged_image_pad.cols - padding[ 3 ] );
+    cv::Range vertical = cv::Range( padding[ 0 ], merged_image_pad.rows - padding[ 1 ] );
+    return merged_image_pad( vertical, horizontal );
+}
+
+cv::Mat hdrplus_pipeline::merge_burst( \
+    const std::string& burst_path, \
+    const std::string& reference_image_path )
+{
+    burst burst_images( burst_path, reference_image_path, options );
+    return align_merge_strips( burst_images );
+}
+
 void hdrplus_pipeline::run_pipeline( \
     const std::string& burst_path, \
     const std::string& reference_image_path  )
 {
+    run( burst_path, reference_image_path, true );
+
+    // Outputs are stored, nothing of this burst is kept until the next one
+    finish_module.finalImage.release();
+    finish_module.encodedOutput.clear();
+    finish_module.scaledOutputs.clear();
+}
+
+std::vector<output_image> hdrplus_pipeline::process( \
+    const std::string& burst_path, \
+    const std::string& reference_image_path )
+{
+    run( burst_path, reference_image_path, false );
+
+    std::vector<output_image> outputs;
+    outputs.push_back( output_image{ finish_module.finalImage, std::move( finish_module.encodedOutput ) } );
+    for ( auto& scaled_output : finish_module.scaledOutputs )
+    {
+        outputs.push_back( std::move( scaled_output ) );
+    }
+    finish_module.finalImage.release();
+    finish_module.encodedOutput.clear();
+    finish_module.scaledOutputs.clear();
+    return outputs;
+}
+
+void hdrplus_pipeline::run( \
+    const std::string& burst_path, \
+    const std::string& reference_image_path, \
+    bool write_final )
+{
+    // Intermediate images of this run, encoded in the background, none without artifactDir
+    std::shared_ptr<artifact_sink> artifacts;
+    if ( !options.artifactDir.empty() )
+    {
+        artifacts = std::make_shared<async_file_sink>( options.artifactDir );
+    }
+    merge_module.artifacts = artifacts;
+    finish_module.artifacts = artifacts;
+
     // Create burst of images
-    burst burst_images( burst_path, reference_image_path );
-    std::vector<std::vector<std::vector<std::pair<int, int>>>> alignments;
+    burst burst_images( burst_path, reference_image_path, options );
+
+    burst_images.merged_bayer_image = align_merge_strips( burst_images );
 
-    // Run align
-    align_module.process( burst_images, alignments );
+    // A spilled burst decodes the reference again for finish
+    burst_images.load_reference();
 
-    // Run merging
-    merge_module.process( burst_images, alignments );
+    // Bayer images keep their 16 bit raw values, PNG stores them as they are
+    if ( artifacts )
+    {
+        artifacts->write( "ref.png", burst_images.bayer_images[ burst_images.reference_image_idx ].raw_image );
+        artifacts->write( "merged.png", burst_images.merged_bayer_image );
+    }
 
     // Run finishing
-    finish_module.process( burst_images);
+    finish_module.process( burst_images, write_final );
+
+    // Release the sink of this run, its destructor stores the queued artifacts
+    merge_module.artifacts.reset();
+    finish_module.artifacts.reset();
 }
 
 } // namespace hdrplus
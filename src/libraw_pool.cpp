@@ -0,0 +1,85 @@
+#include <string>
+#include <utility> // std::move
+#include <stdexcept> // std::runtime_error
+#include <libraw/libraw.h>
+#include "hdrplus/libraw_pool.h"
+
+namespace hdrplus
+{
+
+std::shared_ptr<libraw_pool> libraw_pool::shared()
+{
+    // Contexts checked out keep the pool alive through their deleter, whatever the static destruction order
+    static std::shared_ptr<libraw_pool> pool = create();
+    return pool;
+}
+
+std::shared_ptr<libraw_pool> libraw_pool::create( size_t max_idle )
+{
+    // Constructor is private, std::make_shared cannot reach it
+    return std::shared_ptr<libraw_pool>( new libraw_pool( max_idle ) );
+}
+
+libraw_pool::libraw_pool( size_t max_idle ) : max_idle( max_idle )
+{
+}
+
+std::shared_ptr<LibRaw> libraw_pool::checkout()
+{
+    std::unique_ptr<LibRaw> context;
+    {
+        std::lock_guard<std::mutex> lock( idle_mutex );
+        if ( !idle.empty() )
+        {
+            context = std::move( idle.back() );
+            idle.pop_back();
+        }
+    }
+    if ( !context )
+    {
+        context.reset( new LibRaw() );
+    }
+
+    std::shared_ptr<libraw_pool> pool = shared_from_this();
+    return std::shared_ptr<LibRaw>( context.release(), [ pool ]( LibRaw* returned_context )
+    {
+        pool->give_back( returned_context );
+    });
+}
+
+std::shared_ptr<LibRaw> libraw_pool::checkout_unpacked( const std::string& raw_path )
+{
+    std::shared_ptr<LibRaw> context = checkout();
+
+    int return_code;
+    if ( ( return_code = context->open_file( raw_path.c_str() ) ) != LIBRAW_SUCCESS )
+    {
+        throw std::runtime_error("Error opening file " + raw_path + " " + libraw_strerror( return_code ));
+    }
+    if ( ( return_code = context->unpack() ) != LIBRAW_SUCCESS )
+    {
+        throw std::runtime_error("Error unpack file " + raw_path + " " + libraw_strerror( return_code ));
+    }
+    return context;
+}
+
+size_t libraw_pool::num_idle() const
+{
+    std::lock_guard<std::mutex> lock( idle_mutex );
+    return idle.size();
+}
+
+void libraw_pool::give_back( LibRaw* context )
+{
+    // Free the image buffers of the last use outside the lock, the object itself is kept
+    std::unique_ptr<LibRaw> returned_context( context );
+    returned_context->recycle();
+
+    std::lock_guard<std::mutex> lock( idle_mutex );
+    if ( idle.size() < max_idle )
+    {
+        idle.push_back( std::move( returned_context ) );
+    }
+}
+
+} // namespace hdrplus
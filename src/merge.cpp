@@ -1,6 +1,9 @@
 #include <opencv2/opencv.hpp> // all opencv header
 #include <vector>
+#include <string>
 #include <utility>
+#include <algorithm> // std::min, std::max
+#include <stdexcept> // std::runtime_error
 #include "hdrplus/merge.h"
 #include "hdrplus/burst.h"
 #include "hdrplus/utility.h"
@@ -8,9 +11,106 @@
 namespace hdrplus
 {
 
+    // Bayer channel i sits at (row, col) offset (i % 2, i / 2) of every 2x2 bayer block,
+    // same channel order as extract_rgb_from_bayer
+    static inline int channel_row_offset(int channel) { return channel & 1; }
+    static inline int channel_col_offset(int channel) { return channel >> 1; }
+
+    // Read a tile of one bayer channel directly from the bayer image as float
+    template< int tile_size >
+    static void load_channel_tile(const bayer_channel_view& channel, int top_left_y, int top_left_x, float* tile) {
+        for (int row_i = 0; row_i < tile_size; ++row_i) {
+            const uint16_t* bayer_row = channel.ptr(top_left_y + row_i) + 2 * top_left_x;
+            UNROLL_LOOP( tile_size )
+            for (int col_i = 0; col_i < tile_size; ++col_i) {
+                tile[row_i * tile_size + col_i] = bayer_row[2 * col_i];
+            }
+        }
+    }
+
+    // Alignment is computed on the grayscale image (same resolution as a bayer channel) with
+    // tiles of size align_tile_size and stride align_tile_size / 2. For other merge tile sizes,
+    // use the alignment tile whose center is closest to the merge tile center.
+    template< int tile_size >
+    static inline int alignment_tile_index(int tile_index, int num_align_tiles) {
+        constexpr int align_tile_size = 16;
+        constexpr int offset = tile_size / 2;
+        return std::min((tile_index * offset + offset - align_tile_size / 4) / (align_tile_size / 2), num_align_tiles - 1);
+    }
+
+    template< int tile_size >
+    static inline const std::pair<int, int>& tile_alignment( \
+        const std::vector<std::vector<std::pair<int, int>>>& alignment, int tile_row, int tile_col) {
+        int align_row = alignment_tile_index<tile_size>(tile_row, alignment.size());
+        int align_col = alignment_tile_index<tile_size>(tile_col, alignment[0].size());
+        return alignment[align_row][align_col];
+    }
+
+    // 4.2 Pairwise temporal denoising of one tile with the Wiener shrinkage, accumulated into tile_sum
+    template< int tile_size >
+    static void temporal_denoise(const float* tile, const float* alt_tile, float* tile_sum, float coeff) {
+        for (int i = 0; i < tile_size * tile_size * 2; i += 2) {
+            // Tile difference
+            float diff_re = tile[i] - alt_tile[i];
+            float diff_im = tile[i + 1] - alt_tile[i + 1];
+            float absolute_diff = diff_re * diff_re + diff_im * diff_im;
+
+            // find shrinkage operator A
+            float shrinkage = absolute_diff / (absolute_diff + coeff);
+
+            // Interpolation
+            tile_sum[i] += alt_tile[i] + diff_re * shrinkage;
+            tile_sum[i + 1] += alt_tile[i + 1] + diff_im * shrinkage;
+        }
+    }
+
+    // 4.3 Spatial denoising of one merged tile, shrinkage grows with frequency |w|
+    template< int tile_size >
+    static void spatial_denoise(float* tile, const float* distances, float coeff) {
+        for (int i = 0; i < tile_size * tile_size; ++i) {
+            float absolute_diff = tile[2 * i] * tile[2 * i] + tile[2 * i + 1] * tile[2 * i + 1];
+            float scale = absolute_diff / (absolute_diff + distances[i] * coeff);
+            tile[2 * i] *= scale;
+            tile[2 * i + 1] *= scale;
+        }
+    }
+
+    template< int tile_size >
+    static float squared_difference(const float* tile, const float* alt_tile) {
+        float squared_diff = 0;
+        for (int i = 0; i < tile_size * tile_size; ++i) {
+            float diff = tile[i] - alt_tile[i];
+            squared_diff += diff * diff;
+        }
+        return squared_diff;
+    }
+
+    template< int tile_size >
+    static void accumulate_tile(const float* tile, float* tile_sum) {
+        for (int i = 0; i < tile_size * tile_size; ++i) {
+            tile_sum[i] += tile[i];
+        }
+    }
+
+    // Spatial domain counterpart of temporal_denoise. The whole alternate tile gets one weight from
+    // its mean squared difference to the reference tile, shrinking towards the reference the same
+    // way the Wiener shrinkage does for a flat difference spectrum (Parseval).
+    template< int tile_size >
+    static void temporal_denoise_spatial(const float* tile, const float* alt_tile, float* tile_sum, float coeff) {
+        float squared_diff = squared_difference<tile_size>(tile, alt_tile);
+        float shrinkage = squared_diff / (squared_diff + coeff);
+
+        for (int i = 0; i < tile_size * tile_size; ++i) {
+            tile_sum[i] += alt_tile[i] + (tile[i] - alt_tile[i]) * shrinkage;
+        }
+    }
+
     void merge::process(hdrplus::burst& burst_images, \
-        std::vector<std::vector<std::vector<std::pair<int, int>>>>& alignments)
+        const std::vector<std::vector<std::vector<std::pair<int, int>>>>& alignments)
     {
+        if (burst_images.spilled) {
+            throw std::runtime_error("merge needs the padded frames in memory, the burst is spilled (read_band)");
+        }
         // 4.1 Noise Parameters and RMS
         // Noise parameters calculated from baseline ISO noise parameters
         double lambda_shot, lambda_read;
@@ -20,314 +120,513 @@ namespace hdrplus
 
         // Get padded bayer image
         cv::Mat reference_image = burst_images.bayer_images_pad[burst_images.reference_image_idx];
-        cv::imwrite("ref.jpg", reference_image);
-
-        // Get raw channels
-        std::vector<cv::Mat> channels(4);
-        hdrplus::extract_rgb_from_bayer<uint16_t>(reference_image, channels[0], channels[1], channels[2], channels[3]);
+        if (artifacts) {
+            artifacts->write("ref.png", reference_image);
+        }
 
-        std::vector<cv::Mat> processed_channels(4);
-        // For each channel, perform denoising and merge
-        for (int i = 0; i < 4; ++i) {
-            // Get channel mat
-            cv::Mat channel_i = channels[i];
-            // cv::imwrite("ref" + std::to_string(i) + ".jpg", channel_i);
-            
-            //we should be getting the individual channel in the same place where we call the processChannel function with the reference channel in its arguments
-            //possibly we could add another argument in the processChannel function which is the channel_i for the alternate image. maybe using a loop to cover all the other images
-
-            //create list of channel_i of alternate images:
-            std::vector<cv::Mat> alternate_channel_i_list;
-            for (int j = 0; j < burst_images.num_images; j++) {
-                if (j != burst_images.reference_image_idx) {
-
-                    //get alternate image
-                    cv::Mat alt_image = burst_images.bayer_images_pad[j];
-                    std::vector<cv::Mat> alt_channels(4);
-                    hdrplus::extract_rgb_from_bayer<uint16_t>(alt_image, alt_channels[0], alt_channels[1], alt_channels[2], alt_channels[3]);
-
-                    alternate_channel_i_list.push_back(alt_channels[i]);
-                }
+        // Fold alternate images in one at a time
+        const hdrplus::bayer_image& reference_bayer = burst_images.bayer_images[burst_images.reference_image_idx];
+        int black_level = (reference_bayer.black_level_per_channel[0] + reference_bayer.black_level_per_channel[1] + \
+                           reference_bayer.black_level_per_channel[2] + reference_bayer.black_level_per_channel[3]) / 4;
+        init(reference_image, lambda_shot, lambda_read, reference_bayer.white_level, black_level);
+        for (int j = 0; j < burst_images.num_images; j++) {
+            if (j != burst_images.reference_image_idx) {
+                add_frame(burst_images.bayer_images_pad[j], alignments[j]);
             }
+        }
+        finalize(burst_images);
+    }
 
-            // Apply merging on the channel
-            cv::Mat merged_channel = processChannel(burst_images, alignments, channel_i, alternate_channel_i_list, lambda_shot, lambda_read);
-            // cv::imwrite("merged" + std::to_string(i) + ".jpg", merged_channel);
-
-            // Put channel raw data back to channels
-            merged_channel.convertTo(processed_channels[i], CV_16U);
+    void merge::init(const cv::Mat& reference_image, double lambda_shot, double lambda_read, \
+        int white_level, int black_level) {
+        this->reference_image = reference_image;
+        this->white_level = white_level;
+        this->black_level = black_level;
+        num_clipped_tiles = num_dark_tiles = num_static_tiles = 0;
+        skip_stats = merge_skip_stats();
+        merge_tile_size = options.tilesize;
+
+        if (options.mergeEngine == "dft") {
+            spatial_engine = false;
+        } else if (options.mergeEngine == "spatial") {
+            spatial_engine = true;
+        } else {
+            throw std::runtime_error("merge engine " + options.mergeEngine + " not supported, use dft or spatial");
         }
 
-        // Write all channels back to a bayer mat
-        cv::Mat merged(reference_image.rows, reference_image.cols, CV_16U);
-        int x, y;
-        for (y = 0; y < reference_image.rows; ++y){
-            uint16_t* row = merged.ptr<uint16_t>(y);
-            if (y % 2 == 0){
-                uint16_t* i0 = processed_channels[0].ptr<uint16_t>(y / 2);
-                uint16_t* i1 = processed_channels[1].ptr<uint16_t>(y / 2);
-
-                for (x = 0; x < reference_image.cols;){
-                    //R
-                    row[x] = i0[x / 2];
-                    x++;
-
-                    //G1
-                    row[x] = i1[x / 2];
-                    x++;
-                }
-            }
-            else {
-                uint16_t* i2 = processed_channels[2].ptr<uint16_t>(y / 2);
-                uint16_t* i3 = processed_channels[3].ptr<uint16_t>(y / 2);
-
-                for(x = 0; x < reference_image.cols;){
-                    //G2
-                    row[x] = i2[x / 2];
-                    x++;
-
-                    //B
-                    row[x] = i3[x / 2];
-                    x++;
-                }
-            }
+        switch (merge_tile_size) {
+            case 8:
+                initTiles<8>(lambda_shot, lambda_read);
+                break;
+            case 16:
+                initTiles<16>(lambda_shot, lambda_read);
+                break;
+            case 32:
+                initTiles<32>(lambda_shot, lambda_read);
+                break;
+            default:
+                throw std::runtime_error("merge tile size " + std::to_string(merge_tile_size) + " not supported, use 8, 16 or 32");
         }
+    }
 
-        // Remove padding
-        std::vector<int> padding = burst_images.padding_info_bayer;
-        cv::Range horizontal = cv::Range(padding[2], reference_image.cols - padding[3]);
-        cv::Range vertical = cv::Range(padding[0], reference_image.rows - padding[1]);
-        burst_images.merged_bayer_image = merged(vertical, horizontal);
-        cv::imwrite("merged.jpg", burst_images.merged_bayer_image);
+    void merge::add_frame(const cv::Mat& alternate_image, \
+        const std::vector<std::vector<std::pair<int, int>>>& alignment) {
+        add_frame(alternate_image, alignment, 0, alignment.size());
+        end_frame();
     }
 
-    std::vector<cv::Mat> merge::getReferenceTiles(cv::Mat reference_image) {
-        std::vector<cv::Mat> reference_tiles;
-        for (int y = 0; y < reference_image.rows - offset; y += offset) {
-            for (int x = 0; x < reference_image.cols - offset; x += offset) {
-                cv::Mat tile = reference_image(cv::Rect(x, y, TILE_SIZE, TILE_SIZE));
-                reference_tiles.push_back(tile);
-            }
+    void merge::add_frame(const cv::Mat& alternate_image, \
+        const std::vector<std::vector<std::pair<int, int>>>& alignment, int align_row_start, int align_row_end) {
+        if (num_frames == 0) {
+            throw std::runtime_error("merge::add_frame called before merge::init");
+        }
+
+        switch (merge_tile_size) {
+            case 8:
+                addFrameTiles<8>(alternate_image, alignment, align_row_start, align_row_end);
+                break;
+            case 16:
+                addFrameTiles<16>(alternate_image, alignment, align_row_start, align_row_end);
+                break;
+            case 32:
+                addFrameTiles<32>(alternate_image, alignment, align_row_start, align_row_end);
+                break;
         }
-        return reference_tiles;
     }
 
-    cv::Mat merge::mergeTiles(std::vector<cv::Mat> tiles, int num_rows, int num_cols) {
-        // 1. get all four subsets: original (evenly split), horizontal overlapped,
-        // vertical overlapped, 2D overlapped
-        std::vector<std::vector<cv::Mat>> tiles_original;
-        for (int y = 0; y < num_rows / offset - 1; y += 2) {
-            std::vector<cv::Mat> row;
-            for (int x = 0; x < num_cols / offset - 1; x += 2) {
-                row.push_back(tiles[y * (num_cols / offset - 1) + x]);
-            }
-            tiles_original.push_back(row);
+    void merge::end_frame() {
+        num_frames++;
+    }
+
+    cv::Mat merge::finalize() {
+        if (num_frames == 0) {
+            throw std::runtime_error("merge::finalize called before merge::init");
         }
 
-        std::vector<std::vector<cv::Mat>> tiles_horizontal;
-        for (int y = 0; y < num_rows / offset - 1; y += 2) {
-            std::vector<cv::Mat> row;
-            for (int x = 1; x < num_cols / offset - 1; x += 2) {
-                row.push_back(tiles[y * (num_cols / offset - 1) + x]);
-            }
-            tiles_horizontal.push_back(row);
+        cv::Mat merged;
+        switch (merge_tile_size) {
+            case 8:
+                merged = finalizeTiles<8>();
+                break;
+            case 16:
+                merged = finalizeTiles<16>();
+                break;
+            case 32:
+                merged = finalizeTiles<32>();
+                break;
         }
 
-        std::vector<std::vector<cv::Mat>> tiles_vertical;
-        for (int y = 1; y < num_rows / offset - 1; y += 2) {
-            std::vector<cv::Mat> row;
-            for (int x = 0; x < num_cols / offset - 1; x += 2) {
-                row.push_back(tiles[y * (num_cols / offset - 1) + x]);
-            }
-            tiles_vertical.push_back(row);
+        // Alternate tiles merged without DFT: every alternate of a clipped tile and the static ones
+        skip_stats.num_tiles = 4LL * num_tiles_row * num_tiles_col;
+        skip_stats.num_alternate_tiles = skip_stats.num_tiles * (num_frames - 1);
+        skip_stats.num_clipped_tiles = num_clipped_tiles;
+        skip_stats.num_dark_tiles = num_dark_tiles;
+        skip_stats.num_skipped_alternates = num_clipped_tiles * (num_frames - 1) + num_static_tiles;
+
+        #ifndef NDEBUG
+        if (options.skipTrivialTiles) {
+            printf("%s::%s skipped tiles : clipped %.2f%%, dark %.2f%%, alternates without DFT %.2f%%\n", __FILE__, __func__, \
+                100. * num_clipped_tiles / skip_stats.num_tiles, 100. * num_dark_tiles / skip_stats.num_tiles, \
+                100. * skip_stats.skipped_fraction());
         }
+        #endif
 
-        std::vector<std::vector<cv::Mat>> tiles_2d;
-        for (int y = 1; y < num_rows / offset - 1; y += 2) {
-            std::vector<cv::Mat> row;
-            for (int x = 1; x < num_cols / offset - 1; x += 2) {
-                row.push_back(tiles[y * (num_cols / offset - 1) + x]);
-            }
-            tiles_2d.push_back(row);
+        // Release reference and accumulators
+        reference_image.release();
+        num_frames = 0;
+        for (int i = 0; i < 4; ++i) {
+            std::vector<float>().swap(noise_variance[i]);
+            std::vector<float>().swap(reference_tiles_DFT[i]);
+            std::vector<float>().swap(merged_tiles_DFT[i]);
+            std::vector<float>().swap(merged_tiles[i]);
+            std::vector<uint8_t>().swap(tile_class[i]);
         }
 
-        // 2. Concatenate the four subsets
-        cv::Mat img_original = cat2Dtiles(tiles_original);
-        cv::Mat img_horizontal = cat2Dtiles(tiles_horizontal);
-        cv::Mat img_vertical = cat2Dtiles(tiles_vertical);
-        cv::Mat img_2d = cat2Dtiles(tiles_2d);
+        return merged;
+    }
 
-        // 3. Add the four subsets together
-        img_original(cv::Rect(offset, 0, num_cols - TILE_SIZE, num_rows)) += img_horizontal;
-        img_original(cv::Rect(0, offset, num_cols, num_rows - TILE_SIZE)) += img_vertical;
-        img_original(cv::Rect(offset, offset, num_cols - TILE_SIZE, num_rows - TILE_SIZE)) += img_2d;
+    void merge::finalize(hdrplus::burst& burst_images) {
+        cv::Mat merged = finalize();
 
-        return img_original;
+        // Remove padding
+        const std::vector<int>& padding = burst_images.padding_info_bayer;
+        cv::Range horizontal = cv::Range(padding[2], merged.cols - padding[3]);
+        cv::Range vertical = cv::Range(padding[0], merged.rows - padding[1]);
+        burst_images.merged_bayer_image = merged(vertical, horizontal);
+        if (artifacts) {
+            artifacts->write("merged.png", burst_images.merged_bayer_image);
+        }
     }
 
-    cv::Mat merge::processChannel(hdrplus::burst& burst_images, \
-        std::vector<std::vector<std::vector<std::pair<int, int>>>>& alignments, \
-        cv::Mat channel_image, \
-        std::vector<cv::Mat> alternate_channel_i_list,\
-        float lambda_shot, \
-        float lambda_read) {
-        // Get tiles of the reference image
-        std::vector<cv::Mat> reference_tiles = getReferenceTiles(channel_image);
-
-        // Get noise variance (sigma**2 = lambda_shot * tileRMS + lambda_read)
-        std::vector<float> noise_variance = getNoiseVariance(reference_tiles, lambda_shot, lambda_read);
-
-        // Apply FFT on reference tiles (spatial to frequency)
-        std::vector<cv::Mat> reference_tiles_DFT;
-        for (auto ref_tile : reference_tiles) {
-            cv::Mat ref_tile_DFT;
-            ref_tile.convertTo(ref_tile_DFT, CV_32F);
-            cv::dft(ref_tile_DFT, ref_tile_DFT, cv::DFT_COMPLEX_OUTPUT);
-            reference_tiles_DFT.push_back(ref_tile_DFT);
+    template< int tile_size >
+    std::vector<float> merge::getNoiseVariance(const bayer_channel_view& channel_image, float lambda_shot, float lambda_read, \
+        std::vector<std::pair<uint16_t, uint16_t>>* tile_range) {
+        // Tiles overlap by half, so every tile is made of 2x2 blocks of size offset * offset.
+        // Sum of squares per block first, then per tile from its four blocks.
+        constexpr int offset = tile_size / 2;
+        int num_blocks_row = channel_image.rows / offset;
+        int num_blocks_col = channel_image.cols / offset;
+        std::vector<unsigned long long> block_sums(num_blocks_row * num_blocks_col, 0);
+
+        // Optional min and max per block, from the same pass
+        std::vector<uint16_t> block_min, block_max;
+        if (tile_range) {
+            block_min.assign(num_blocks_row * num_blocks_col, USHRT_MAX);
+            block_max.assign(num_blocks_row * num_blocks_col, 0);
+        }
+
+        #pragma omp parallel for
+        for (int block_y = 0; block_y < num_blocks_row; ++block_y) {
+            unsigned long long* block_sums_row = block_sums.data() + block_y * num_blocks_col;
+            for (int row_i = 0; row_i < offset; ++row_i) {
+                const uint16_t* channel_row = channel_image.ptr(block_y * offset + row_i);
+                for (int block_x = 0; block_x < num_blocks_col; ++block_x) {
+                    const uint16_t* block_row = channel_row + 2 * block_x * offset;
+                    unsigned int row_sum = 0;
+                    uint16_t row_min = USHRT_MAX, row_max = 0;
+                    UNROLL_LOOP( offset )
+                    for (int col_i = 0; col_i < offset; ++col_i) {
+                        // Square saturate to 16 bit (CV_16U multiply semantic)
+                        uint16_t value = block_row[2 * col_i];
+                        unsigned int squared = (unsigned int)value * value;
+                        row_sum += squared > USHRT_MAX ? USHRT_MAX : squared;
+                        row_min = std::min(row_min, value);
+                        row_max = std::max(row_max, value);
+                    }
+                    block_sums_row[block_x] += row_sum;
+
+                    if (tile_range) {
+                        int block_i = block_y * num_blocks_col + block_x;
+                        block_min[block_i] = std::min(block_min[block_i], row_min);
+                        block_max[block_i] = std::max(block_max[block_i], row_max);
+                    }
+                }
+            }
         }
 
-        // Acquire alternate tiles and apply FFT on them as well
-        std::vector<std::vector<cv::Mat>> alt_tiles_list(reference_tiles.size());
-        int num_tiles_row = alternate_channel_i_list[0].rows / offset - 1;
-        int num_tiles_col = alternate_channel_i_list[0].cols / offset - 1;
+        int num_tiles_row = num_blocks_row - 1;
+        int num_tiles_col = num_blocks_col - 1;
+        std::vector<float> noise_variance(num_tiles_row * num_tiles_col);
+        if (tile_range) {
+            tile_range->resize(num_tiles_row * num_tiles_col);
+        }
+
+        #pragma omp parallel for
         for (int y = 0; y < num_tiles_row; ++y) {
+            const unsigned long long* block_sums_row0 = block_sums.data() + y * num_blocks_col;
+            const unsigned long long* block_sums_row1 = block_sums_row0 + num_blocks_col;
             for (int x = 0; x < num_tiles_col; ++x) {
-                std::vector<cv::Mat> alt_tiles;
-                // Get reference tile location
-                int top_left_y = y * offset;
-                int top_left_x = x * offset;
-
-                for (int i = 0; i < alternate_channel_i_list.size(); ++i) {
-                    // Get alignment displacement
-                    int displacement_y, displacement_x;
-                    std::tie(displacement_y, displacement_x) = alignments[i + 1][y][x];
-                    // Get tile
-                    cv::Mat alt_tile = alternate_channel_i_list[i](cv::Rect(top_left_x + displacement_x, top_left_y + displacement_y, TILE_SIZE, TILE_SIZE));
-                    // Apply FFT
-                    cv::Mat alt_tile_DFT;
-                    alt_tile.convertTo(alt_tile_DFT, CV_32F);
-                    cv::dft(alt_tile_DFT, alt_tile_DFT, cv::DFT_COMPLEX_OUTPUT);
-                    alt_tiles.push_back(alt_tile_DFT);
+                unsigned long long tile_sum = block_sums_row0[x] + block_sums_row0[x + 1] + \
+                                              block_sums_row1[x] + block_sums_row1[x + 1];
+                float tile_rms = sqrt(double(tile_sum) / (tile_size * tile_size));
+                noise_variance[y * num_tiles_col + x] = lambda_shot * tile_rms + lambda_read;
+
+                if (tile_range) {
+                    int block_i = y * num_blocks_col + x;
+                    (*tile_range)[y * num_tiles_col + x] = std::make_pair( \
+                        std::min(std::min(block_min[block_i], block_min[block_i + 1]), \
+                                 std::min(block_min[block_i + num_blocks_col], block_min[block_i + num_blocks_col + 1])), \
+                        std::max(std::max(block_max[block_i], block_max[block_i + 1]), \
+                                 std::max(block_max[block_i + num_blocks_col], block_max[block_i + num_blocks_col + 1])));
                 }
-                alt_tiles_list[y * num_tiles_col + x] = alt_tiles;
             }
         }
 
-        // 4.2 Temporal Denoising
-        reference_tiles_DFT = temporal_denoise(reference_tiles_DFT, alt_tiles_list, noise_variance, TEMPORAL_FACTOR);
+        return noise_variance;
+    }
+
+    template< int tile_size >
+    void merge::initTiles(float lambda_shot, float lambda_read) {
+        constexpr int offset = tile_size / 2;
+        constexpr int tile_dft_size = tile_size * tile_size * 2; // complex
+
+        // Views of the raw channels, no copy
+        const bayer_channel_view channels[4] = { {reference_image, 0}, {reference_image, 1}, \
+                                                 {reference_image, 2}, {reference_image, 3} };
+
+        num_frames = 1;
+        num_tiles_row = channels[0].rows / offset - 1;
+        num_tiles_col = channels[0].cols / offset - 1;
+        int num_tiles = num_tiles_row * num_tiles_col;
+
+        for (int i = 0; i < 4; ++i) {
+            // Get noise variance (sigma**2 = lambda_shot * tileRMS + lambda_read)
+            std::vector<std::pair<uint16_t, uint16_t>> tile_range;
+            noise_variance[i] = getNoiseVariance<tile_size>(channels[i], lambda_shot, lambda_read, \
+                                                            options.skipTrivialTiles ? &tile_range : nullptr);
+
+            // Classify tiles from the reference statistics
+            tile_class[i].assign(num_tiles, TILE_MERGE);
+            if (options.skipTrivialTiles) {
+                for (int tile_i = 0; tile_i < num_tiles; ++tile_i) {
+                    if (tile_range[tile_i].first >= white_level) {
+                        tile_class[i][tile_i] = TILE_CLIPPED;
+                        num_clipped_tiles++;
+                    } else if (tile_range[tile_i].second <= black_level + 3 * sqrt(noise_variance[i][tile_i])) {
+                        tile_class[i][tile_i] = TILE_DARK;
+                        num_dark_tiles++;
+                    }
+                }
+            }
+
+            if (spatial_engine || options.skipTrivialTiles) {
+                merged_tiles[i].assign(num_tiles * tile_size * tile_size, 0);
+            }
+            if (!spatial_engine) {
+                reference_tiles_DFT[i].assign(num_tiles * tile_dft_size, 0);
+            }
 
-        // 4.3 Spatial Denoising
-        reference_tiles_DFT = spatial_denoise(reference_tiles_DFT, alternate_channel_i_list.size(), noise_variance, SPATIAL_FACTOR);
-        //now reference tiles are temporally and spatially denoised
+            #pragma omp parallel
+            {
+                float ref_tile_data[tile_size * tile_size];
+                cv::Mat ref_tile(tile_size, tile_size, CV_32F, ref_tile_data);
+
+                #pragma omp for
+                for (int tile_i = 0; tile_i < num_tiles; ++tile_i) {
+                    int y = tile_i / num_tiles_col;
+                    int x = tile_i % num_tiles_col;
+
+                    if (spatial_engine || tile_class[i][tile_i] != TILE_MERGE) {
+                        // Spatial sum starts with the reference tile
+                        load_channel_tile<tile_size>(channels[i], y * offset, x * offset, \
+                                                     merged_tiles[i].data() + tile_i * tile_size * tile_size);
+                        continue;
+                    }
+
+                    // Apply FFT on reference tiles (spatial to frequency)
+                    load_channel_tile<tile_size>(channels[i], y * offset, x * offset, ref_tile_data);
+
+                    // Write DFT straight into the accumulator
+                    cv::Mat ref_tile_DFT(tile_size, tile_size, CV_32FC2, reference_tiles_DFT[i].data() + tile_i * tile_dft_size);
+                    cv::dft(ref_tile, ref_tile_DFT, cv::DFT_COMPLEX_OUTPUT);
+                }
+            }
 
-        // Apply IFFT on reference tiles (frequency to spatial)
-        std::vector<cv::Mat> denoised_tiles;
-        for (auto dft_tile : reference_tiles_DFT) {
-            cv::Mat denoised_tile;
-            cv::divide(dft_tile, TILE_SIZE * TILE_SIZE, dft_tile);
-            cv::dft(dft_tile, denoised_tile, cv::DFT_INVERSE | cv::DFT_REAL_OUTPUT);
-            denoised_tiles.push_back(denoised_tile);
+            // Sum of pairwise merged tiles starts with the reference tile
+            if (!spatial_engine) {
+                merged_tiles_DFT[i] = reference_tiles_DFT[i];
+            }
         }
-        reference_tiles = denoised_tiles;
+    }
+
+    template< int tile_size >
+    void merge::addFrameTiles(const cv::Mat& alternate_image, \
+        const std::vector<std::vector<std::pair<int, int>>>& alignment, int align_row_start, int align_row_end) {
+        constexpr int offset = tile_size / 2;
+        constexpr int tile_dft_size = tile_size * tile_size * 2; // complex
 
-        // 4.4 Cosine Window Merging
-        // Process tiles through 2D cosine window
-        std::vector<cv::Mat> windowed_tiles;
-        for (auto tile : reference_tiles) {
-            windowed_tiles.push_back(cosineWindow2D(tile));
+        // Merge tile rows whose alignment tile row is in range (monotonic mapping)
+        int tile_row_start = 0;
+        while (tile_row_start < num_tiles_row && alignment_tile_index<tile_size>(tile_row_start, alignment.size()) < align_row_start) {
+            tile_row_start++;
+        }
+        int tile_row_end = tile_row_start;
+        while (tile_row_end < num_tiles_row && alignment_tile_index<tile_size>(tile_row_end, alignment.size()) < align_row_end) {
+            tile_row_end++;
         }
 
-        // Merge tiles
-        return mergeTiles(windowed_tiles, channel_image.rows, channel_image.cols);
-    }
-        
-    std::vector<cv::Mat> merge::temporal_denoise(std::vector<cv::Mat> tiles, std::vector<std::vector<cv::Mat>> alt_tiles, std::vector<float> noise_variance, float temporal_factor) {
-        // goal: temporially denoise using the weiner filter
-        // input:
-        // 1. array of 2D dft tiles of the reference image
-        // 2. array of 2D dft tiles of the aligned alternate image
-        // 3. estimated noise variance
-        // 4. temporal factor
-        // return: merged image patches dft
+        int channel_rows = alternate_image.rows / 2;
+        int channel_cols = alternate_image.cols / 2;
 
         // calculate noise scaling
-        double temporal_noise_scaling = (TILE_SIZE * TILE_SIZE * (2.0 / 16)) * TEMPORAL_FACTOR;
-        
-        // loop across tiles
-        std::vector<cv::Mat> denoised;
-        for (int i = 0; i < tiles.size(); ++i) {
-            // sum of pairwise denoising
-            cv::Mat tile_sum = tiles[i].clone();
-            double coeff = temporal_noise_scaling * noise_variance[i];
-
-            // Ref tile
-            cv::Mat tile = tiles[i];
-            // Alt tiles
-            std::vector<cv::Mat> alt_tiles_i = alt_tiles[i];
-
-            for (int j = 0; j < alt_tiles_i.size(); ++j) {
-                // Alt tile
-                cv::Mat alt_tile = alt_tiles_i[j];
-                // Tile difference
-                cv::Mat diff = tile - alt_tile;
-
-                // Calculate absolute difference
-                cv::Mat complexMats[2];
-                cv::split(diff, complexMats);               // planes[0] = Re(DFT(I)), planes[1] = Im(DFT(I))
-                cv::magnitude(complexMats[0], complexMats[1], complexMats[0]); // planes[0] = magnitude
-                cv::Mat absolute_diff = complexMats[0].mul(complexMats[0]);
-
-                // find shrinkage operator A
-                cv::Mat shrinkage;
-                cv::divide(absolute_diff, absolute_diff + coeff, shrinkage);
-                cv::merge(std::vector<cv::Mat>{shrinkage, shrinkage}, shrinkage);
-                
-                // Interpolation
-                tile_sum += alt_tile + diff.mul(shrinkage);
+        double temporal_noise_scaling = (tile_size * tile_size * (2.0 / 16)) * options.temporalfactor;
+
+        // Difference of two tiles matching up to noise has variance 2 * sigma**2 per pixel
+        float static_noise_scaling = tile_size * tile_size * 2;
+        long long num_static = 0;
+        long long num_dark_moving = 0;
+
+        const bayer_channel_view ref_channels[4] = { {reference_image, 0}, {reference_image, 1}, \
+                                                     {reference_image, 2}, {reference_image, 3} };
+        const bayer_channel_view alt_channels[4] = { {alternate_image, 0}, {alternate_image, 1}, \
+                                                     {alternate_image, 2}, {alternate_image, 3} };
+
+        #pragma omp parallel
+        {
+            float ref_tile_data[tile_size * tile_size];
+            float alt_tile_data[tile_size * tile_size];
+            cv::Mat alt_tile(tile_size, tile_size, CV_32F, alt_tile_data);
+            cv::Mat alt_tile_DFT(tile_size, tile_size, CV_32FC2);
+
+            #pragma omp for collapse(2) reduction(+:num_static, num_dark_moving)
+            for (int y = tile_row_start; y < tile_row_end; ++y) {
+                for (int x = 0; x < num_tiles_col; ++x) {
+                    int tile_i = y * num_tiles_col + x;
+
+                    // Get alignment displacement, keep displaced tile inside the channel image
+                    int displacement_y, displacement_x;
+                    std::tie(displacement_y, displacement_x) = tile_alignment<tile_size>(alignment, y, x);
+                    int alt_top_left_y = std::max(0, std::min(y * offset + displacement_y, channel_rows - tile_size));
+                    int alt_top_left_x = std::max(0, std::min(x * offset + displacement_x, channel_cols - tile_size));
+
+                    // Every channel share the same alignment
+                    for (int i = 0; i < 4; ++i) {
+                        uint8_t& curr_tile_class = tile_class[i][tile_i];
+                        if (curr_tile_class == TILE_CLIPPED) {
+                            continue;
+                        }
+
+                        load_channel_tile<tile_size>(alt_channels[i], alt_top_left_y, alt_top_left_x, alt_tile_data);
+                        float* tile_sum = spatial_engine || options.skipTrivialTiles ? \
+                                          merged_tiles[i].data() + tile_i * tile_size * tile_size : nullptr;
+                        if (spatial_engine || options.skipTrivialTiles) {
+                            load_channel_tile<tile_size>(ref_channels[i], y * offset, x * offset, ref_tile_data);
+                        }
+
+                        // Shortcut only for an alternate matching the reference within noise, dark tiles included:
+                        // something moving into a dark tile must not be averaged in. Sum it without DFT.
+                        // DFT is linear, the spatial sum is folded into the DFT sum once in finalize().
+                        if (options.skipTrivialTiles && (!spatial_engine || curr_tile_class == TILE_DARK)) {
+                            float squared_diff = squared_difference<tile_size>(ref_tile_data, alt_tile_data);
+                            if (squared_diff <= static_noise_scaling * noise_variance[i][tile_i]) {
+                                accumulate_tile<tile_size>(alt_tile_data, tile_sum);
+                                if (curr_tile_class == TILE_MERGE) {
+                                    curr_tile_class = TILE_STATIC;
+                                }
+                                num_static++;
+                                continue;
+                            }
+                        }
+
+                        if (curr_tile_class == TILE_DARK) {
+                            // The dark tile leaves the shortcut and is merged as any other. Its spatial sum holds the
+                            // reference and the static alternates so far: the reference moves to the DFT sum.
+                            if (!spatial_engine) {
+                                float* ref_tile_DFT_ptr = reference_tiles_DFT[i].data() + tile_i * tile_dft_size;
+                                cv::Mat ref_tile(tile_size, tile_size, CV_32F, ref_tile_data);
+                                cv::Mat ref_tile_DFT(tile_size, tile_size, CV_32FC2, ref_tile_DFT_ptr);
+                                cv::dft(ref_tile, ref_tile_DFT, cv::DFT_COMPLEX_OUTPUT);
+                                std::copy(ref_tile_DFT_ptr, ref_tile_DFT_ptr + tile_dft_size, \
+                                          merged_tiles_DFT[i].data() + tile_i * tile_dft_size);
+                                for (int k = 0; k < tile_size * tile_size; ++k) {
+                                    tile_sum[k] -= ref_tile_data[k];
+                                }
+                                curr_tile_class = TILE_STATIC;
+                            } else {
+                                curr_tile_class = TILE_MERGE;
+                            }
+                            num_dark_moving++;
+                        }
+
+                        if (spatial_engine) {
+                            temporal_denoise_spatial<tile_size>(ref_tile_data, alt_tile_data, tile_sum, \
+                                                                temporal_noise_scaling * noise_variance[i][tile_i]);
+                            continue;
+                        }
+
+                        // Apply FFT on alternate tile
+                        cv::dft(alt_tile, alt_tile_DFT, cv::DFT_COMPLEX_OUTPUT);
+
+                        // 4.2 Temporal Denoising
+                        temporal_denoise<tile_size>(reference_tiles_DFT[i].data() + tile_i * tile_dft_size, \
+                                                    (const float*)alt_tile_DFT.data, \
+                                                    merged_tiles_DFT[i].data() + tile_i * tile_dft_size, \
+                                                    temporal_noise_scaling * noise_variance[i][tile_i]);
+                    }
+                }
             }
-            // Average by num of frames
-            cv::divide(tile_sum, alt_tiles_i.size() + 1, tile_sum);
-            denoised.push_back(tile_sum);
         }
 
-        return denoised;
+        num_static_tiles += num_static;
+        num_dark_tiles -= num_dark_moving;
     }
 
-    std::vector<cv::Mat> merge::spatial_denoise(std::vector<cv::Mat> tiles, int num_alts, std::vector<float> noise_variance, float spatial_factor) {
-        
-        double spatial_noise_scaling = (TILE_SIZE * TILE_SIZE * (1.0 / 16)) * spatial_factor;
+    template< int tile_size >
+    cv::Mat merge::finalizeTiles() {
+        constexpr int offset = tile_size / 2;
+        constexpr int tile_dft_size = tile_size * tile_size * 2; // complex
 
-        // Calculate |w| using ifftshift
-        cv::Mat row_distances = cv::Mat::zeros(1, TILE_SIZE, CV_32F);
-        for(int i = 0; i < TILE_SIZE; ++i) {
-            row_distances.at<float>(i) = i - offset;
-        }
-        row_distances = cv::repeat(row_distances.t(), 1, TILE_SIZE);
-        cv::Mat col_distances = row_distances.t();
-        cv::Mat distances;
-        cv::sqrt(row_distances.mul(row_distances) + col_distances.mul(col_distances), distances);
-        ifftshift(distances);
-        
-        std::vector<cv::Mat> denoised;
-        // Loop through all tiles
-        for (int i = 0; i < tiles.size(); ++i) {
-            cv::Mat tile = tiles[i];
-            float coeff = noise_variance[i] / (num_alts + 1) * spatial_noise_scaling;
-
-            // Calculate absolute difference
-            cv::Mat complexMats[2];
-            cv::split(tile, complexMats);               // planes[0] = Re(DFT(I)), planes[1] = Im(DFT(I))
-            cv::magnitude(complexMats[0], complexMats[1], complexMats[0]); // planes[0] = magnitude
-            cv::Mat absolute_diff = complexMats[0].mul(complexMats[0]);
-            
-            // Division
-            cv::Mat scale;
-            cv::divide(absolute_diff, absolute_diff + distances * coeff, scale);
-            cv::merge(std::vector<cv::Mat>{scale, scale}, scale);
-            denoised.push_back(tile.mul(scale));
+        const merge_tables<tile_size>& tables = merge_tables<tile_size>::get();
+        double spatial_noise_scaling = (tile_size * tile_size * (1.0 / 16)) * options.spatialfactor;
+
+        cv::Mat merged(reference_image.rows, reference_image.cols, CV_16U);
+        for (int i = 0; i < 4; ++i) {
+            cv::Mat merged_channel = cv::Mat::zeros(reference_image.rows / 2, reference_image.cols / 2, CV_32F);
+
+            // Tiles of every other tile row do not overlap. Two passes over the tile rows keep
+            // the accumulation race free and its order independent of the number of threads.
+            for (int row_parity = 0; row_parity < 2; ++row_parity) {
+                #pragma omp parallel
+                {
+                    cv::Mat tile_DFT(tile_size, tile_size, CV_32FC2);
+                    cv::Mat static_tile_DFT(tile_size, tile_size, CV_32FC2);
+                    cv::Mat denoised_tile(tile_size, tile_size, CV_32F);
+                    float* tile_DFT_ptr = (float*)tile_DFT.data;
+
+                    #pragma omp for
+                    for (int y = row_parity; y < num_tiles_row; y += 2) {
+                        for (int x = 0; x < num_tiles_col; ++x) {
+                            int tile_i = y * num_tiles_col + x;
+                            float* denoised_ptr = (float*)denoised_tile.data;
+                            uint8_t curr_tile_class = tile_class[i][tile_i];
+
+                            if (curr_tile_class == TILE_CLIPPED) {
+                                // Reference tile as is
+                                const float* ref_tile = merged_tiles[i].data() + tile_i * tile_size * tile_size;
+                                std::copy(ref_tile, ref_tile + tile_size * tile_size, denoised_ptr);
+                            } else if (spatial_engine || curr_tile_class == TILE_DARK) {
+                                // Average by num of frames, no spatial denoising
+                                const float* tile_sum = merged_tiles[i].data() + tile_i * tile_size * tile_size;
+                                for (int k = 0; k < tile_size * tile_size; ++k) {
+                                    denoised_ptr[k] = tile_sum[k] / num_frames;
+                                }
+                            } else {
+                                // Average by num of frames
+                                const float* tile_sum = merged_tiles_DFT[i].data() + tile_i * tile_dft_size;
+                                for (int k = 0; k < tile_dft_size; ++k) {
+                                    tile_DFT_ptr[k] = tile_sum[k] / num_frames;
+                                }
+
+                                // Fold in the alternates summed in spatial domain
+                                if (curr_tile_class == TILE_STATIC) {
+                                    cv::Mat static_tile_sum(tile_size, tile_size, CV_32F, merged_tiles[i].data() + tile_i * tile_size * tile_size);
+                                    cv::dft(static_tile_sum, static_tile_DFT, cv::DFT_COMPLEX_OUTPUT);
+                                    const float* static_tile_DFT_ptr = (const float*)static_tile_DFT.data;
+                                    for (int k = 0; k < tile_dft_size; ++k) {
+                                        tile_DFT_ptr[k] += static_tile_DFT_ptr[k] / num_frames;
+                                    }
+                                }
+
+                                // 4.3 Spatial Denoising
+                                float coeff = noise_variance[i][tile_i] / num_frames * spatial_noise_scaling;
+                                spatial_denoise<tile_size>(tile_DFT_ptr, tables.frequency_distances, coeff);
+
+                                // Apply IFFT (frequency to spatial)
+                                for (int k = 0; k < tile_dft_size; ++k) {
+                                    tile_DFT_ptr[k] /= tile_size * tile_size;
+                                }
+                                cv::dft(tile_DFT, denoised_tile, cv::DFT_INVERSE | cv::DFT_REAL_OUTPUT);
+                            }
+
+                            // 4.4 Cosine Window Merging
+                            for (int row_i = 0; row_i < tile_size; ++row_i) {
+                                float* merged_row = merged_channel.ptr<float>(y * offset + row_i) + x * offset;
+                                const float* window_row = tables.cosine_window_2d + row_i * tile_size;
+                                const float* denoised_row = denoised_ptr + row_i * tile_size;
+                                UNROLL_LOOP( tile_size )
+                                for (int col_i = 0; col_i < tile_size; ++col_i) {
+                                    merged_row[col_i] += denoised_row[col_i] * window_row[col_i];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Write channel back to its bayer position
+            int row_offset = channel_row_offset(i);
+            int col_offset = channel_col_offset(i);
+            #pragma omp parallel for
+            for (int y = 0; y < merged_channel.rows; ++y) {
+                const float* merged_channel_row = merged_channel.ptr<float>(y);
+                uint16_t* merged_row = merged.ptr<uint16_t>(2 * y + row_offset) + col_offset;
+                for (int x = 0; x < merged_channel.cols; ++x) {
+                    merged_row[2 * x] = cv::saturate_cast<uint16_t>(merged_channel_row[x]);
+                }
+            }
         }
-        return denoised;
+
+        return merged;
     }
-    
 
-} // namespace hdrplus
\ No newline at end of file
+} // namespace hdrplus
@@ -0,0 +1,257 @@
+#include <string>
+#include <vector>
+#include <cmath> // std::lround
+#include <future> // std::async
+#include <algorithm> // std::min, std::max
+#include <stdexcept> // std::runtime_error
+#include <opencv2/opencv.hpp> // all opencv header
+#include "hdrplus/output_encoder.h"
+#include "hdrplus/pointwise.h"
+
+namespace hdrplus
+{
+
+// Image rows aimed at per strip, enough strips for the cores on common sensor sizes
+static const int target_strip_rows = 256;
+
+// Layout of a JPEG file written by the encoder, up to the start of the entropy coded data
+struct jpeg_layout
+{
+    bool baseline = false;    // SOF0 / SOF1 (sequential Huffman), restart markers can join strips
+    size_t height_offset = 0; // 16 bit image height in the frame header
+    size_t scan_offset = 0;   // SOS marker
+    size_t data_offset = 0;   // first entropy coded byte
+    int mcu_width = 8;
+    int mcu_height = 8;
+};
+
+static jpeg_layout parse_jpeg( const std::vector<uchar>& jpeg )
+{
+    jpeg_layout layout;
+    size_t pos = 2; // after SOI
+    while ( pos + 4 <= jpeg.size() )
+    {
+        if ( jpeg[ pos ] != 0xFF )
+        {
+            throw std::runtime_error("unexpected byte between JPEG segments");
+        }
+        uchar marker = jpeg[ pos + 1 ];
+        if ( marker == 0xFF ) // fill byte
+        {
+            ++pos;
+            continue;
+        }
+        size_t length = ( size_t( jpeg[ pos + 2 ] ) << 8 ) | jpeg[ pos + 3 ];
+
+        if ( marker == 0xC0 || marker == 0xC1 )
+        {
+            layout.baseline = true;
+            layout.height_offset = pos + 5;
+            int num_components = jpeg[ pos + 9 ];
+            int max_horizontal = 1, max_vertical = 1;
+            for ( int component_i = 0; component_i < num_components; ++component_i )
+            {
+                uchar sampling = jpeg[ pos + 11 + 3 * component_i ];
+                max_horizontal = std::max( max_horizontal, sampling >> 4 );
+                max_vertical = std::max( max_vertical, sampling & 15 );
+            }
+            layout.mcu_width = 8 * max_horizontal;
+            layout.mcu_height = 8 * max_vertical;
+        }
+        else if ( marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC )
+        {
+            layout.baseline = false; // progressive, lossless or arithmetic coding
+        }
+        else if ( marker == 0xDA )
+        {
+            layout.scan_offset = pos;
+            layout.data_offset = pos + 2 + length;
+            return layout;
+        }
+        pos += 2 + length;
+    }
+    throw std::runtime_error("no scan found in JPEG");
+}
+
+static std::vector<uchar> encode_jpeg( const cv::Mat& bgr_image, int quality )
+{
+    std::vector<uchar> encoded;
+    if ( !cv::imencode( ".jpg", bgr_image, encoded, { cv::IMWRITE_JPEG_QUALITY, quality } ) )
+    {
+        throw std::runtime_error("JPEG encoding failed");
+    }
+    return encoded;
+}
+
+jpeg_strip_encoder::jpeg_strip_encoder( int rows, int cols, int quality ) : \
+    rows( rows ), cols( cols ), quality( quality ), rows_per_strip( rows )
+{
+    // MCU size (chroma subsampling) of the encoder settings, from a tiny probe image
+    jpeg_layout probe = parse_jpeg( encode_jpeg( cv::Mat::zeros( 16, 16, CV_8UC3 ), quality ) );
+    if ( !probe.baseline )
+    {
+        return; // single strip
+    }
+
+    int mcus_per_row = ( cols + probe.mcu_width - 1 ) / probe.mcu_width;
+    int mcu_rows_per_strip = std::min( std::max( target_strip_rows / probe.mcu_height, 1 ), 65535 / mcus_per_row );
+    if ( mcu_rows_per_strip < 1 || mcu_rows_per_strip * probe.mcu_height >= rows )
+    {
+        return; // restart interval does not fit 16 bit, or a single strip anyway
+    }
+    rows_per_strip = mcu_rows_per_strip * probe.mcu_height;
+    mcus_per_strip = mcu_rows_per_strip * mcus_per_row;
+}
+
+void jpeg_strip_encoder::add_strip( const cv::Mat& bgr_strip )
+{
+    int strip_i = int( strips.size() );
+    int expected_rows = std::min( rows_per_strip, rows - strip_i * rows_per_strip );
+    if ( bgr_strip.type() != CV_8UC3 || bgr_strip.cols != cols || bgr_strip.rows != expected_rows )
+    {
+        throw std::runtime_error("jpeg_strip_encoder strip does not match the image layout");
+    }
+
+    int strip_quality = quality;
+    strips.push_back( std::async( std::launch::async, [ strip_quality ]( cv::Mat strip ) \
+    {
+        return encode_jpeg( strip, strip_quality );
+    }, bgr_strip ) );
+}
+
+std::vector<uchar> jpeg_strip_encoder::finish()
+{
+    std::vector<std::vector<uchar>> encoded_strips;
+    for ( auto& strip : strips )
+    {
+        encoded_strips.push_back( strip.get() );
+    }
+    strips.clear();
+
+    if ( encoded_strips.size() == 1 )
+    {
+        return encoded_strips[ 0 ];
+    }
+    if ( encoded_strips.empty() || mcus_per_strip == 0 || int( encoded_strips.size() ) * rows_per_strip < rows )
+    {
+        throw std::runtime_error("jpeg_strip_encoder finished before every strip was added");
+    }
+
+    // Header of the first strip with the full image height and a restart interval of one strip
+    jpeg_layout first = parse_jpeg( encoded_strips[ 0 ] );
+    std::vector<uchar> jpeg( encoded_strips[ 0 ].begin(), encoded_strips[ 0 ].begin() + first.scan_offset );
+    jpeg[ first.height_offset ] = uchar( rows >> 8 );
+    jpeg[ first.height_offset + 1 ] = uchar( rows & 0xFF );
+    const uchar restart_interval[ 6 ] = { 0xFF, 0xDD, 0x00, 0x04, uchar( mcus_per_strip >> 8 ), uchar( mcus_per_strip & 0xFF ) };
+    jpeg.insert( jpeg.end(), restart_interval, restart_interval + 6 );
+    jpeg.insert( jpeg.end(), encoded_strips[ 0 ].begin() + first.scan_offset, encoded_strips[ 0 ].begin() + first.data_offset );
+
+    // Entropy coded data of every strip (each one starts with reset DC predictors, as after a restart marker)
+    for ( size_t strip_i = 0; strip_i < encoded_strips.size(); ++strip_i )
+    {
+        const std::vector<uchar>& strip = encoded_strips[ strip_i ];
+        jpeg_layout layout = parse_jpeg( strip );
+        if ( strip.size() < layout.data_offset + 2 || strip[ strip.size() - 2 ] != 0xFF || strip[ strip.size() - 1 ] != 0xD9 )
+        {
+            throw std::runtime_error("JPEG strip does not end with EOI");
+        }
+        jpeg.insert( jpeg.end(), strip.begin() + layout.data_offset, strip.end() - 2 );
+        if ( strip_i + 1 < encoded_strips.size() )
+        {
+            jpeg.push_back( 0xFF );
+            jpeg.push_back( uchar( 0xD0 + strip_i % 8 ) ); // RST0 - RST7
+        }
+    }
+    jpeg.push_back( 0xFF );
+    jpeg.push_back( 0xD9 );
+    return jpeg;
+}
+
+std::vector<uchar> encode_output( const cv::Mat& rgb_image, const std::string& format, int jpeg_quality )
+{
+    std::vector<uchar> encoded;
+    if ( format == "mat" )
+    {
+        return encoded;
+    }
+
+    static const pointwise_chain identity;
+    bool success = true;
+    if ( format == "jpeg" )
+    {
+        jpeg_strip_encoder encoder( rgb_image.rows, rgb_image.cols, jpeg_quality );
+        for ( int row_start = 0; row_start < rgb_image.rows; row_start += encoder.strip_rows() )
+        {
+            int row_end = std::min( row_start + encoder.strip_rows(), rgb_image.rows );
+            encoder.add_strip( identity.apply( rgb_image.rowRange( row_start, row_end ), CV_8U, true ) );
+        }
+        return encoder.finish();
+    }
+    else if ( format == "png" )
+    {
+        success = cv::imencode( ".png", identity.apply( rgb_image, CV_8U, true ), encoded );
+    }
+    else if ( format == "tiff" )
+    {
+        success = cv::imencode( ".tiff", identity.apply( rgb_image, CV_16U, true ), encoded );
+    }
+    else
+    {
+        throw std::runtime_error("output format " + format + " not supported, use mat, jpeg, png or tiff");
+    }
+
+    if ( !success )
+    {
+        throw std::runtime_error("encoding final image as " + format + " failed");
+    }
+    return encoded;
+}
+
+std::vector<cv::Mat> downscale_outputs( const cv::Mat& image, const std::vector<int>& long_sides )
+{
+    auto long_side_of = []( const cv::Mat& level ) { return std::max( level.rows, level.cols ); };
+
+    std::vector<cv::Mat> pyramid{ image }; // level i is image halved i times
+    std::vector<cv::Mat> outputs( long_sides.size() );
+    for ( size_t output_i = 0; output_i < long_sides.size(); ++output_i )
+    {
+        int long_side = long_sides[ output_i ];
+        if ( long_side <= 0 )
+        {
+            throw std::runtime_error("output size must be positive, got " + std::to_string( long_side ));
+        }
+        if ( long_side >= long_side_of( image ) )
+        {
+            outputs[ output_i ] = image;
+            continue;
+        }
+
+        while ( long_side_of( pyramid.back() ) >= 2 * long_side )
+        {
+            cv::Mat level;
+            cv::pyrDown( pyramid.back(), level );
+            pyramid.push_back( level );
+        }
+        // Smallest level not below the target, less than 2x larger
+        size_t level_i = pyramid.size() - 1;
+        while ( long_side_of( pyramid[ level_i ] ) < long_side )
+        {
+            --level_i;
+        }
+
+        double scale = double( long_side ) / long_side_of( image );
+        cv::Size size( std::max( int( std::lround( image.cols * scale ) ), 1 ), \
+                       std::max( int( std::lround( image.rows * scale ) ), 1 ) );
+        if ( size == pyramid[ level_i ].size() )
+        {
+            outputs[ output_i ] = pyramid[ level_i ];
+        }
+        else
+        {
+            cv::resize( pyramid[ level_i ], outputs[ output_i ], size, 0, 0, cv::INTER_AREA );
+        }
+    }
+    return outputs;
+}
+
+} // namespace hdrplus
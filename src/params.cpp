@@ -1,5 +1,7 @@
 #include <opencv2/opencv.hpp> // all opencv header
 #include <hdrplus/params.h>
+#include <string>
+#include <stdexcept> // std::runtime_error
 
 namespace hdrplus
 {
@@ -23,10 +25,16 @@ cv::Mat postprocess(std::shared_ptr<LibRaw>& libraw_ptr, RawpyArgs rawpyArgs){
 
     std::cout<<"conversion to 16 bit using black and white levels, demosaicking, white balance, color correction..."<<std::endl;
 
-    libraw_ptr->dcraw_process();
-    int errorcode;
+    int errorcode = libraw_ptr->dcraw_process();
+    if(errorcode != LIBRAW_SUCCESS){
+        throw std::runtime_error(std::string("Error dcraw_process ") + libraw_strerror(errorcode));
+    }
 
-    libraw_processed_image_t *ret_img = libraw_ptr->dcraw_make_mem_image(&errorcode);
+    // owned until the pixels are copied, released with dcraw_clear_mem
+    libraw_image_ptr ret_img(libraw_ptr->dcraw_make_mem_image(&errorcode));
+    if(!ret_img){
+        throw std::runtime_error(std::string("Error dcraw_make_mem_image ") + libraw_strerror(errorcode));
+    }
 
     int opencv_type = CV_16UC3; // 16bit RGB
     if(ret_img->colors==1){ // grayscale
@@ -43,7 +51,7 @@ cv::Mat postprocess(std::shared_ptr<LibRaw>& libraw_ptr, RawpyArgs rawpyArgs){
         }
     }
 
-    cv::Mat processedImg(ret_img->height,ret_img->width,opencv_type,ret_img->data);
+    cv::Mat processedImg = cv::Mat(ret_img->height,ret_img->width,opencv_type,ret_img->data).clone();
 
     std::cout<<"postprocess finished!"<<std::endl;
     return processedImg;
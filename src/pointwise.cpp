@@ -0,0 +1,112 @@
+#include <vector>
+#include <climits> // USHRT_MAX
+#include <stdexcept> // std::runtime_error
+#include <opencv2/opencv.hpp> // all opencv header
+#include "hdrplus/pointwise.h"
+
+namespace hdrplus
+{
+
+pointwise_chain::pointwise_chain() : lut( USHRT_MAX + 1 )
+{
+    for ( int value = 0; value <= USHRT_MAX; ++value )
+    {
+        lut[ value ] = value;
+    }
+}
+
+pointwise_chain& pointwise_chain::then( const stage_t& stage )
+{
+    #pragma omp parallel for
+    for ( int value = 0; value <= USHRT_MAX; ++value )
+    {
+        lut[ value ] = stage( lut[ value ] );
+    }
+    return *this;
+}
+
+// One read and one write per sample. src and dst may be the same image.
+template< typename T >
+static void apply_table( const cv::Mat& src, cv::Mat& dst, const T* table, bool swap_rb )
+{
+    int num_channels = src.channels();
+    int row_length = src.cols * num_channels;
+
+    // Static schedule hands every thread one contiguous block of rows
+    #pragma omp parallel for schedule( static )
+    for ( int row = 0; row < src.rows; ++row )
+    {
+        const uint16_t* src_row = src.ptr<uint16_t>( row );
+        T* dst_row = dst.ptr<T>( row );
+
+        if ( swap_rb && num_channels == 3 )
+        {
+            for ( int i = 0; i < row_length; i += 3 )
+            {
+                T c0 = table[ src_row[ i ] ];
+                T c1 = table[ src_row[ i + 1 ] ];
+                T c2 = table[ src_row[ i + 2 ] ];
+                dst_row[ i ] = c2;
+                dst_row[ i + 1 ] = c1;
+                dst_row[ i + 2 ] = c0;
+            }
+        }
+        else
+        {
+            for ( int i = 0; i < row_length; ++i )
+            {
+                dst_row[ i ] = table[ src_row[ i ] ];
+            }
+        }
+    }
+}
+
+cv::Mat pointwise_chain::apply( const cv::Mat& image, int depth, bool swap_rb ) const
+{
+    cv::Mat result;
+    apply( image, result, depth, swap_rb );
+    return result;
+}
+
+void pointwise_chain::apply( const cv::Mat& image, cv::Mat& result, int depth, bool swap_rb ) const
+{
+    if ( image.depth() != CV_16U )
+    {
+        throw std::runtime_error("pointwise_chain only supports 16 bit input");
+    }
+    if ( result.data == image.data && depth != CV_16U )
+    {
+        throw std::runtime_error("pointwise_chain in place output must be 16 bit");
+    }
+
+    result.create( image.rows, image.cols, CV_MAKETYPE( depth, image.channels() ) );
+    if ( depth == CV_16U )
+    {
+        apply_table<uint16_t>( image, result, lut.data(), swap_rb );
+    }
+    else if ( depth == CV_8U )
+    {
+        // Same truncation as convert16bit2_8bit_ on the chain output
+        std::vector<uint8_t> lut_8bit( USHRT_MAX + 1 );
+        for ( int value = 0; value <= USHRT_MAX; ++value )
+        {
+            lut_8bit[ value ] = uint16_t( lut[ value ] * ( 255.0 / USHRT_MAX ) );
+        }
+        apply_table<uint8_t>( image, result, lut_8bit.data(), swap_rb );
+    }
+    else
+    {
+        throw std::runtime_error("pointwise_chain output depth must be CV_16U or CV_8U");
+    }
+}
+
+void pointwise_chain::apply_inplace( cv::Mat& image, bool swap_rb ) const
+{
+    if ( image.depth() != CV_16U )
+    {
+        throw std::runtime_error("pointwise_chain only supports 16 bit input");
+    }
+    apply_table<uint16_t>( image, image, lut.data(), swap_rb );
+}
+
+} // namespace hdrplus
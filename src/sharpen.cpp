@@ -0,0 +1,179 @@
+#include <vector>
+#include <cmath>
+#include <climits> // USHRT_MAX
+#include <algorithm> // std::fill, std::min, std::max
+#include <stdexcept> // std::runtime_error
+#include <opencv2/opencv.hpp> // all opencv header
+#include "hdrplus/sharpen.h"
+#include "hdrplus/utility.h" // reflect_101
+
+namespace hdrplus
+{
+
+static const int num_scales = 3;
+
+// Output rows per band. Input rows of a band and its halo stay in cache between neighbouring output rows.
+static const int band_rows = 16;
+
+// Same kernel as cv::GaussianBlur( 16 bit image, Size( 0, 0 ), sigma ) builds with cv::getGaussianKernel
+static std::vector<float> gaussian_kernel( float sigma )
+{
+    int kernel_size = int( std::lround( sigma * 4 * 2 + 1 ) ) | 1;
+    double scale = -0.5 / ( double( sigma ) * sigma );
+    std::vector<double> weights( kernel_size );
+    double sum = 0;
+    for ( int i = 0; i < kernel_size; ++i )
+    {
+        double x = i - ( kernel_size - 1 ) * 0.5;
+        weights[ i ] = std::exp( scale * x * x );
+        sum += weights[ i ];
+    }
+
+    std::vector<float> kernel( kernel_size );
+    for ( int i = 0; i < kernel_size; ++i )
+    {
+        kernel[ i ] = weights[ i ] / sum;
+    }
+    return kernel;
+}
+
+void sharpen_triple_banded( const cv::Mat& image, \
+                            const std::vector<float>& amounts, \
+                            const std::vector<float>& sigmas, \
+                            const std::vector<float>& thresholds, \
+                            cv::Mat& result, int row_start, int row_end )
+{
+    if ( image.depth() != CV_16U )
+    {
+        throw std::runtime_error("sharpen_triple_banded only supports 16 bit images");
+    }
+    if ( amounts.size() != num_scales || sigmas.size() != num_scales || thresholds.size() != num_scales )
+    {
+        throw std::runtime_error("sharpen_triple_banded expects amount, sigma and threshold of three scales");
+    }
+    if ( result.size() != image.size() || result.type() != image.type() )
+    {
+        throw std::runtime_error("sharpen_triple_banded result must be allocated with the image size and type");
+    }
+    row_start = std::max( row_start, 0 );
+    row_end = std::min( row_end, image.rows );
+
+    int height = image.rows;
+    int width = image.cols;
+    int num_channels = image.channels();
+    int row_length = width * num_channels;
+
+    std::vector<float> kernels[ num_scales ];
+    int radius[ num_scales ];
+    float threshold_values[ num_scales ];
+    int max_radius = 0;
+    for ( int scale_i = 0; scale_i < num_scales; ++scale_i )
+    {
+        kernels[ scale_i ] = gaussian_kernel( sigmas[ scale_i ] );
+        radius[ scale_i ] = int( kernels[ scale_i ].size() ) / 2;
+        threshold_values[ scale_i ] = thresholds[ scale_i ] * USHRT_MAX;
+        max_radius = std::max( max_radius, radius[ scale_i ] );
+    }
+
+    int num_bands = ( std::max( row_end - row_start, 0 ) + band_rows - 1 ) / band_rows;
+
+    #pragma omp parallel
+    {
+        // Per thread row buffers, the vertical ones have max_radius mirrored columns on both sides
+        int padding = max_radius * num_channels;
+        std::vector<float> vertical[ num_scales ];
+        std::vector<float> blurred[ num_scales ];
+        for ( int scale_i = 0; scale_i < num_scales; ++scale_i )
+        {
+            vertical[ scale_i ].resize( row_length + 2 * padding );
+            blurred[ scale_i ].resize( row_length );
+        }
+
+        #pragma omp for schedule( static )
+        for ( int band_i = 0; band_i < num_bands; ++band_i )
+        {
+            int band_start = row_start + band_i * band_rows;
+            int band_end = std::min( band_start + band_rows, row_end );
+            for ( int row = band_start; row < band_end; ++row )
+            {
+                // Vertical pass, every input row of the largest kernel is read once for all scales
+                for ( int scale_i = 0; scale_i < num_scales; ++scale_i )
+                {
+                    std::fill( vertical[ scale_i ].begin(), vertical[ scale_i ].end(), 0.f );
+                }
+                for ( int dy = -max_radius; dy <= max_radius; ++dy )
+                {
+                    const uint16_t* input_row = image.ptr<uint16_t>( reflect_101( row + dy, height ) );
+                    for ( int scale_i = 0; scale_i < num_scales; ++scale_i )
+                    {
+                        if ( std::abs( dy ) > radius[ scale_i ] )
+                            continue;
+                        float weight = kernels[ scale_i ][ dy + radius[ scale_i ] ];
+                        float* vertical_row = vertical[ scale_i ].data() + padding;
+                        for ( int i = 0; i < row_length; ++i )
+                        {
+                            vertical_row[ i ] += weight * input_row[ i ];
+                        }
+                    }
+                }
+
+                // Mirrored columns, then horizontal pass on the padded row
+                for ( int scale_i = 0; scale_i < num_scales; ++scale_i )
+                {
+                    float* vertical_row = vertical[ scale_i ].data() + padding;
+                    for ( int col = 1; col <= max_radius; ++col )
+                    {
+                        for ( int channel = 0; channel < num_channels; ++channel )
+                        {
+                            vertical_row[ -col * num_channels + channel ] = \
+                                vertical_row[ reflect_101( -col, width ) * num_channels + channel ];
+                            vertical_row[ ( width - 1 + col ) * num_channels + channel ] = \
+                                vertical_row[ reflect_101( width - 1 + col, width ) * num_channels + channel ];
+                        }
+                    }
+
+                    float* blurred_row = blurred[ scale_i ].data();
+                    std::fill( blurred_row, blurred_row + row_length, 0.f );
+                    for ( int dx = -radius[ scale_i ]; dx <= radius[ scale_i ]; ++dx )
+                    {
+                        float weight = kernels[ scale_i ][ dx + radius[ scale_i ] ];
+                        const float* shifted_row = vertical_row + dx * num_channels;
+                        for ( int i = 0; i < row_length; ++i )
+                        {
+                            blurred_row[ i ] += weight * shifted_row[ i ];
+                        }
+                    }
+                }
+
+                // Thresholded unsharp combine, blurs rounded to 16 bit as cv::GaussianBlur output
+                const uint16_t* input_row = image.ptr<uint16_t>( row );
+                uint16_t* result_row = result.ptr<uint16_t>( row );
+                for ( int i = 0; i < row_length; ++i )
+                {
+                    float x = input_row[ i ];
+                    float sum = 0;
+                    for ( int scale_i = 0; scale_i < num_scales; ++scale_i )
+                    {
+                        float blur = std::min( std::max( std::nearbyint( blurred[ scale_i ][ i ] ), 0.f ), float( USHRT_MAX ) );
+                        sum += std::fabs( blur - x ) < threshold_values[ scale_i ] ? x : x + amounts[ scale_i ] * ( x - blur );
+                    }
+                    float value = std::min( std::max( sum / 3, 0.f ), float( USHRT_MAX ) );
+                    result_row[ i ] = uint16_t( value );
+                }
+            }
+        }
+    }
+
+}
+
+cv::Mat sharpen_triple_banded( const cv::Mat& image, \
+                               const std::vector<float>& amounts, \
+                               const std::vector<float>& sigmas, \
+                               const std::vector<float>& thresholds )
+{
+    cv::Mat result( image.rows, image.cols, image.type() );
+    sharpen_triple_banded( image, amounts, sigmas, thresholds, result, 0, image.rows );
+    return result;
+}
+
+} // namespace hdrplus
@@ -0,0 +1,260 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include <libraw/libraw.h>
+#include "hdrplus/demosaic.h"
+#include "hdrplus/bayer_image.h"
+#include "hdrplus/params.h"
+#include "hdrplus/utility.h"
+
+// LibRaw metadata of a synthetic RGGB frame as read at unpack
+static std::shared_ptr<LibRaw> synthetic_libraw( int raw_height, int raw_width, int margin )
+{
+    std::shared_ptr<LibRaw> libraw_processor = std::make_shared<LibRaw>();
+    libraw_image_sizes_t& sizes = libraw_processor->imgdata.rawdata.sizes;
+    sizes.raw_height = raw_height;
+    sizes.raw_width = raw_width;
+    sizes.top_margin = margin;
+    sizes.left_margin = margin;
+    sizes.height = raw_height - 2 * margin;
+    sizes.width = raw_width - 2 * margin;
+    sizes.flip = 0;
+    libraw_processor->imgdata.rawdata.iparams.filters = 0x94949494; // RGGB
+
+    libraw_colordata_t& color = libraw_processor->imgdata.rawdata.color;
+    color.black = 512;
+    for ( int c = 0; c < 4; ++c )
+        color.cblack[ c ] = 0;
+    color.cblack[ 4 ] = color.cblack[ 5 ] = 0;
+    color.maximum = 16383;
+    const float cam_mul[ 4 ] = { 2.0f, 1.0f, 1.5f, 0.0f }; // second green from the first
+    const float pre_mul[ 4 ] = { 1.8f, 1.0f, 1.2f, 1.0f };
+    const float rgb_cam[ 3 ][ 3 ] = { { 1.6f, -0.4f, -0.2f }, { -0.2f, 1.4f, -0.2f }, { 0.05f, -0.5f, 1.45f } };
+    for ( int c = 0; c < 4; ++c )
+    {
+        color.cam_mul[ c ] = cam_mul[ c ];
+        color.pre_mul[ c ] = pre_mul[ c ];
+    }
+    for ( int i = 0; i < 3; ++i )
+    {
+        for ( int j = 0; j < 4; ++j )
+            color.rgb_cam[ i ][ j ] = j < 3 ? rgb_cam[ i ][ j ] : 0;
+    }
+    return libraw_processor;
+}
+
+// A flat value per bayer channel stays flat through both kernels: every output pixel is the
+// black / white level normalized and white balanced channel values, then the color matrix.
+// With binning 2 the raw image is binned as in preview (bin_bayer_2x2), an odd margin checks
+// that the binned margins keep the bayer pattern of the visible area.
+void test_flat_bayer( bool use_camera_wb, int output_color, hdrplus::demosaic_algorithm algorithm, \
+                      int binning = 1, int margin = 4 )
+{
+    printf("\n###Test test_flat_bayer( use_camera_wb %d, output_color %d, algorithm %d, binning %d, margin %d )###\n", \
+        use_camera_wb, output_color, algorithm, binning, margin );
+
+    const int raw_height = 68 + 2 * ( margin - 4 ), raw_width = 100 + 2 * ( margin - 4 );
+    std::shared_ptr<LibRaw> libraw_processor = synthetic_libraw( raw_height, raw_width, margin );
+    const libraw_colordata_t& color = libraw_processor->imgdata.rawdata.color;
+
+    // R, G, B values of the RGGB quads, RGGB in visible area coordinates
+    const float channel_value[ 3 ] = { 4000, 6000, 3000 };
+    cv::Mat bayer_image( raw_height, raw_width, CV_16UC1 );
+    for ( int row = 0; row < raw_height; ++row )
+    {
+        for ( int col = 0; col < raw_width; ++col )
+        {
+            int c = ( ( row - margin ) & 1 ) + ( ( col - margin ) & 1 ); // 0 R, 1 G, 2 B
+            bayer_image.at<uint16_t>( row, col ) = uint16_t( channel_value[ c ] );
+        }
+    }
+    if ( binning == 2 )
+    {
+        bayer_image = hdrplus::bin_bayer_2x2<uint16_t>( bayer_image );
+    }
+
+    hdrplus::RawpyArgs rawpyArgs;
+    rawpyArgs.use_camera_wb = use_camera_wb;
+    rawpyArgs.output_color = output_color;
+    cv::Mat rgb_image = hdrplus::demosaic_process( libraw_processor, bayer_image, rawpyArgs, algorithm, binning );
+
+    // Expected camera RGB, then output RGB
+    const float* multipliers = use_camera_wb ? color.cam_mul : color.pre_mul;
+    float min_multiplier = std::min( { multipliers[ 0 ], multipliers[ 1 ], multipliers[ 2 ] } );
+    if ( !use_camera_wb )
+        min_multiplier = std::min( min_multiplier, multipliers[ 3 ] );
+    float cam[ 3 ];
+    for ( int c = 0; c < 3; ++c )
+    {
+        float value = ( channel_value[ c ] - color.black ) * multipliers[ c ] / min_multiplier * 65535.f / ( color.maximum - color.black );
+        cam[ c ] = std::min( std::max( value, 0.f ), 65535.f );
+    }
+    int expected[ 3 ];
+    for ( int c = 0; c < 3; ++c )
+    {
+        float out = cam[ c ];
+        if ( output_color == LIBRAW_COLORSPACE_sRGB )
+            out = color.rgb_cam[ c ][ 0 ] * cam[ 0 ] + color.rgb_cam[ c ][ 1 ] * cam[ 1 ] + color.rgb_cam[ c ][ 2 ] * cam[ 2 ];
+        expected[ c ] = int( std::lround( std::min( std::max( out, 0.f ), 65535.f ) ) );
+    }
+
+    // Visible area, half of it rounded down to whole bayer quads with binning 2
+    int visible_rows = raw_height - 2 * margin, visible_cols = raw_width - 2 * margin;
+    if ( binning == 2 )
+    {
+        visible_rows = visible_rows / 4 * 2;
+        visible_cols = visible_cols / 4 * 2;
+    }
+    bool same_size = rgb_image.rows == visible_rows && rgb_image.cols == visible_cols && rgb_image.type() == CV_16UC3;
+    int max_diff = 0;
+    for ( int row = 0; same_size && row < rgb_image.rows; ++row )
+    {
+        for ( int col = 0; col < rgb_image.cols; ++col )
+        {
+            const cv::Vec3w& pixel = rgb_image.at<cv::Vec3w>( row, col );
+            for ( int c = 0; c < 3; ++c )
+                max_diff = std::max( max_diff, std::abs( int( pixel[ c ] ) - expected[ c ] ) );
+        }
+    }
+    printf("output %dx%d (expected %dx%d), expected RGB %d %d %d, max diff %d\n", rgb_image.cols, rgb_image.rows, \
+        visible_cols, visible_rows, expected[ 0 ], expected[ 1 ], expected[ 2 ], max_diff );
+    printf("test_flat_bayer %s\n", same_size && max_diff <= 1 ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+// Output color spaces other than raw and sRGB are rejected, not silently left in camera RGB
+void test_unsupported_output_color()
+{
+    printf("\n###Test test_unsupported_output_color()###\n");
+    std::shared_ptr<LibRaw> libraw_processor = synthetic_libraw( 16, 16, 0 );
+    cv::Mat bayer_image( 16, 16, CV_16UC1, cv::Scalar( 1000 ) );
+    hdrplus::RawpyArgs rawpyArgs;
+    rawpyArgs.output_color = 2; // Adobe RGB
+    bool thrown = false;
+    try
+    {
+        hdrplus::demosaic_process( libraw_processor, bayer_image, rawpyArgs );
+    }
+    catch ( const std::runtime_error& error )
+    {
+        printf("%s\n", error.what() );
+        thrown = true;
+    }
+    printf("test_unsupported_output_color %s\n", thrown ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+// Native bilinear demosaic against LibRaw dcraw_process linear interpolation of the same raw image.
+// Both interpolate the same neighbours, differences come from dcraw rounding, its 16 bit intermediate
+// image and edge handling, so the image border is excluded and a PSNR bound is checked.
+void test_against_dcraw( const char* raw_image_path )
+{
+    printf("\n###Test test_against_dcraw( %s )###\n", raw_image_path );
+
+    hdrplus::bayer_image raw_bayer_image( raw_image_path );
+    hdrplus::RawpyArgs rawpyArgs;
+    rawpyArgs.demosaic_algorithm = 0; // linear
+
+    // Native first, dcraw_process changes the LibRaw state
+    cv::Mat native_rgb = hdrplus::demosaic_process( raw_bayer_image.libraw_processor, raw_bayer_image.raw_image, \
+                                                    rawpyArgs, hdrplus::DEMOSAIC_BILINEAR );
+    cv::Mat dcraw_rgb = hdrplus::postprocess( raw_bayer_image.libraw_processor, rawpyArgs );
+
+    if ( native_rgb.size() != dcraw_rgb.size() || native_rgb.type() != dcraw_rgb.type() )
+    {
+        printf("size native %dx%d dcraw %dx%d\n", native_rgb.cols, native_rgb.rows, dcraw_rgb.cols, dcraw_rgb.rows );
+        printf("test_against_dcraw FAIL\n" ); fflush(stdout);
+        return;
+    }
+
+    const int border = 8;
+    cv::Rect inner( border, border, native_rgb.cols - 2 * border, native_rgb.rows - 2 * border );
+    cv::Mat native_inner, dcraw_inner;
+    native_rgb( inner ).convertTo( native_inner, CV_64FC3 );
+    dcraw_rgb( inner ).convertTo( dcraw_inner, CV_64FC3 );
+    cv::Mat difference = cv::abs( native_inner - dcraw_inner );
+    cv::Scalar mean_difference = cv::mean( difference );
+    double mse = cv::mean( difference.mul( difference ) ).val[ 0 ];
+    double psnr = 10 * log10( 65535.0 * 65535.0 / std::max( mse, 1e-12 ) );
+
+    printf("mean abs diff R %.2f G %.2f B %.2f, PSNR %.2f dB\n", \
+        mean_difference[ 0 ], mean_difference[ 1 ], mean_difference[ 2 ], psnr );
+    printf("test_against_dcraw %s (PSNR >= 35 dB)\n", psnr >= 35 ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+// Preview development of a raw image: binned bayer (bin_bayer_2x2) through the native demosaic,
+// halved again for preview scale 4 as finish does. The output is 1/scale of the full resolution
+// demosaic (within one pixel), and the full resolution demosaic downscaled to the same size must
+// match it: a bayer pattern shifted by the binned margins swaps or mixes the colors, each channel
+// mean must stay within 2% and the PSNR at or above 30 dB.
+void test_preview( const char* raw_image_path, int preview_scale )
+{
+    printf("\n###Test test_preview( %s, preview_scale %d )###\n", raw_image_path, preview_scale );
+
+    hdrplus::bayer_image raw_bayer_image( raw_image_path );
+    hdrplus::RawpyArgs rawpyArgs;
+
+    cv::Mat full_rgb = hdrplus::demosaic_process( raw_bayer_image.libraw_processor, raw_bayer_image.raw_image, rawpyArgs );
+    cv::Mat binned_bayer = hdrplus::bin_bayer_2x2<uint16_t>( raw_bayer_image.raw_image );
+    cv::Mat preview_rgb = hdrplus::demosaic_process( raw_bayer_image.libraw_processor, binned_bayer, rawpyArgs, \
+                                                     hdrplus::DEMOSAIC_MHC, 2 );
+    if ( preview_scale == 4 )
+    {
+        cv::Mat quarter;
+        cv::resize( preview_rgb, quarter, cv::Size( preview_rgb.cols / 2, preview_rgb.rows / 2 ), 0, 0, cv::INTER_AREA );
+        preview_rgb = quarter;
+    }
+
+    bool size_pass = std::abs( preview_rgb.rows - full_rgb.rows / preview_scale ) <= 1 && \
+                     std::abs( preview_rgb.cols - full_rgb.cols / preview_scale ) <= 1;
+    printf("full %dx%d, preview %dx%d\n", full_rgb.cols, full_rgb.rows, preview_rgb.cols, preview_rgb.rows );
+
+    cv::Mat full_downscaled, full_reference, preview_reference;
+    cv::resize( full_rgb, full_downscaled, preview_rgb.size(), 0, 0, cv::INTER_AREA );
+    full_downscaled.convertTo( full_reference, CV_64FC3 );
+    preview_rgb.convertTo( preview_reference, CV_64FC3 );
+    cv::Scalar full_mean = cv::mean( full_reference );
+    cv::Scalar preview_mean = cv::mean( preview_reference );
+    bool parity_pass = true;
+    for ( int c = 0; c < 3; ++c )
+    {
+        parity_pass = parity_pass && std::abs( preview_mean[ c ] - full_mean[ c ] ) <= 0.02 * std::max( full_mean[ c ], 1. );
+    }
+    cv::Mat difference = preview_reference - full_reference;
+    double mse = cv::mean( difference.mul( difference ) ).val[ 0 ];
+    double psnr = 10 * log10( 65535.0 * 65535.0 / std::max( mse, 1e-12 ) );
+    parity_pass = parity_pass && psnr >= 30;
+
+    printf("mean R G B full %.1f %.1f %.1f, preview %.1f %.1f %.1f, PSNR %.2f dB\n", full_mean[ 0 ], full_mean[ 1 ], \
+        full_mean[ 2 ], preview_mean[ 0 ], preview_mean[ 1 ], preview_mean[ 2 ], psnr );
+    printf("test_preview %s (size %s, CFA parity %s)\n", size_pass && parity_pass ? "pass" : "FAIL", \
+        size_pass ? "pass" : "FAIL", parity_pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+int main( int argc, char** argv )
+{
+    if ( argc > 2 )
+    {
+        printf("Usage: ./test_demosaic [RAW_IMAGE_PATH]\n");
+        exit(1);
+    }
+
+    test_flat_bayer( true, LIBRAW_COLORSPACE_sRGB, hdrplus::DEMOSAIC_MHC );
+    test_flat_bayer( true, 0, hdrplus::DEMOSAIC_MHC );
+    test_flat_bayer( false, LIBRAW_COLORSPACE_sRGB, hdrplus::DEMOSAIC_BILINEAR );
+    test_flat_bayer( false, 0, hdrplus::DEMOSAIC_BILINEAR );
+    test_flat_bayer( true, LIBRAW_COLORSPACE_sRGB, hdrplus::DEMOSAIC_MHC, 1, 5 );
+    test_flat_bayer( true, LIBRAW_COLORSPACE_sRGB, hdrplus::DEMOSAIC_MHC, 2, 4 );
+    test_flat_bayer( true, LIBRAW_COLORSPACE_sRGB, hdrplus::DEMOSAIC_MHC, 2, 5 );
+    test_flat_bayer( false, 0, hdrplus::DEMOSAIC_BILINEAR, 2, 5 );
+    test_unsupported_output_color();
+
+    if ( argc == 2 )
+    {
+        test_against_dcraw( argv[ 1 ] );
+        test_preview( argv[ 1 ], 2 );
+        test_preview( argv[ 1 ], 4 );
+    }
+}
@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <climits>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "hdrplus/exposure_fusion.h"
+#include "hdrplus/finish.h"
+
+// Two exposure fusion against cv::MergeMertens on 8 bit copies (what localToneMap used to run).
+// The 8 bit round trip alone moves the inputs by up to 1 / 255, tolerance is stated in those units.
+void test_exposure_fusion( int height, int width )
+{
+    printf("\n###Test test_exposure_fusion()###\n");
+
+    // Underexposed scene with texture, long exposure is 4x gain, both gamma corrected as in localToneMap
+    cv::Mat short_linear( height, width, CV_16UC1 );
+    cv::Mat long_linear( height, width, CV_16UC1 );
+    for ( int row = 0; row < height; ++row )
+    {
+        for ( int col = 0; col < width; ++col )
+        {
+            double base = 0.02 + 0.3 * col / width + 0.05 * sin( row * 0.07 ) * cos( col * 0.11 );
+            base = std::min( std::max( base, 0. ), 1. );
+            short_linear.at<uint16_t>( row, col ) = cv::saturate_cast<uint16_t>( base * USHRT_MAX );
+            long_linear.at<uint16_t>( row, col ) = cv::saturate_cast<uint16_t>( 4 * base * USHRT_MAX );
+        }
+    }
+    cv::Mat short_exposure, long_exposure;
+    hdrplus::gammasRGB( short_linear, short_exposure, true );
+    hdrplus::gammasRGB( long_linear, long_exposure, true );
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<cv::Mat> exposures_8bit( 2 );
+    short_exposure.convertTo( exposures_8bit[ 0 ], CV_8U, 255.0 / USHRT_MAX );
+    long_exposure.convertTo( exposures_8bit[ 1 ], CV_8U, 255.0 / USHRT_MAX );
+    cv::Mat mertens;
+    cv::createMergeMertens()->process( exposures_8bit, mertens );
+    auto end = std::chrono::steady_clock::now();
+    printf("cv::MergeMertens %.2f ms\n", std::chrono::duration<double, std::milli>( end - start ).count() );
+
+    hdrplus::exposure_fusion fusion;
+    cv::Mat fused;
+    for ( int run = 0; run < 2; ++run ) // second run reuses the pyramid buffers
+    {
+        start = std::chrono::steady_clock::now();
+        fusion.process( short_exposure, long_exposure, fused );
+        end = std::chrono::steady_clock::now();
+        printf("exposure_fusion run %d %.2f ms\n", run, std::chrono::duration<double, std::milli>( end - start ).count() );
+    }
+
+    double max_diff = 0, sum_diff = 0;
+    for ( int row = 0; row < height; ++row )
+    {
+        for ( int col = 0; col < width; ++col )
+        {
+            double diff = std::fabs( fused.at<float>( row, col ) - mertens.at<float>( row, col ) );
+            max_diff = std::max( max_diff, diff );
+            sum_diff += diff;
+        }
+    }
+    double mean_diff = sum_diff / ( double( height ) * width );
+    printf("max |diff| %.2f / 255, mean |diff| %.3f / 255\n", max_diff * 255, mean_diff * 255 );
+
+    bool pass = mean_diff * 255 < 1 && max_diff * 255 < 4;
+    printf("test_exposure_fusion %s (tolerance mean < 1 / 255, max < 4 / 255)\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+int main()
+{
+    test_exposure_fusion( 1512, 2016 );
+}
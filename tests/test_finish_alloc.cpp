@@ -0,0 +1,94 @@
+#include <cstdio>
+#include <cmath>
+#include <atomic>
+#include <climits>
+#include <random>
+#include <opencv2/opencv.hpp>
+#include "hdrplus/finish.h"
+#include "hdrplus/params.h"
+
+// cv::Mat allocator that counts the bytes of every buffer allocated through it
+class counting_allocator : public cv::MatAllocator
+{
+    public:
+        explicit counting_allocator( const cv::MatAllocator* std_allocator ) : std_allocator( std_allocator ) {}
+
+        cv::UMatData* allocate( int dims, const int* sizes, int type, void* data, size_t* step, \
+                                cv::AccessFlag flags, cv::UMatUsageFlags usage_flags ) const override
+        {
+            cv::UMatData* u = std_allocator->allocate( dims, sizes, type, data, step, flags, usage_flags );
+            if ( u && !data ) // user data is not an allocation
+            {
+                allocated_bytes += u->size;
+            }
+            return u;
+        }
+
+        bool allocate( cv::UMatData* u, cv::AccessFlag flags, cv::UMatUsageFlags usage_flags ) const override
+        {
+            return std_allocator->allocate( u, flags, usage_flags );
+        }
+
+        void deallocate( cv::UMatData* u ) const override
+        {
+            std_allocator->deallocate( u );
+        }
+
+        mutable std::atomic<size_t> allocated_bytes{ 0 };
+
+    private:
+        const cv::MatAllocator* std_allocator;
+};
+
+// Finish stages 5 - 7 (local tone mapping, global tone mapping, sharpening with the default engine) run twice
+// on the same buffers. The second run must not allocate full frame images again.
+void test_finish_alloc( int height, int width, int ltm_downsample )
+{
+    printf("\n###Test test_finish_alloc( ltmDownsample %d )###\n", ltm_downsample);
+
+    cv::Mat developed( height, width, CV_16UC3 );
+    std::mt19937 rng( 0 );
+    for ( int row = 0; row < height; ++row )
+    {
+        uint16_t* developed_row = developed.ptr<uint16_t>( row );
+        for ( int i = 0; i < width * 3; ++i )
+            developed_row[ i ] = uint16_t( 6000 + 5000 * sin( row * 0.03 + i * 0.007 ) + rng() % 1000 );
+    }
+
+    hdrplus::Parameters params;
+    params.options.ltmDownsample = ltm_downsample;
+
+    counting_allocator allocator( cv::Mat::getStdAllocator() );
+    cv::Mat::setDefaultAllocator( &allocator );
+
+    hdrplus::ltm_buffers buffers;
+    hdrplus::sharpen_buffers sharpen_buffers;
+    cv::Mat image, sharpened;
+    size_t run_bytes[ 2 ];
+    for ( int run = 0; run < 2; ++run )
+    {
+        size_t start_bytes = allocator.allocated_bytes;
+        developed.copyTo( image );
+        int gain = 0;
+        hdrplus::localToneMap( image, params.options, buffers, gain );
+        hdrplus::globalToneMap( image, params.options );
+        hdrplus::sharpenTriple( image, sharpened, params.tuning, params.options, sharpen_buffers );
+        run_bytes[ run ] = allocator.allocated_bytes - start_bytes;
+    }
+
+    cv::Mat::setDefaultAllocator( nullptr );
+
+    double frame_bytes = double( developed.total() ) * developed.elemSize();
+    printf("allocated: first run %.2f frames, second run %.4f frames (%zu bytes)\n", \
+        run_bytes[ 0 ] / frame_bytes, run_bytes[ 1 ] / frame_bytes, run_bytes[ 1 ] );
+
+    // only small images remain per run (gain search thumbnail, guided filter at low resolution)
+    bool pass = run_bytes[ 1 ] < 0.05 * frame_bytes;
+    printf("test_finish_alloc %s (second run < 0.05 frames)\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+int main()
+{
+    test_finish_alloc( 1512, 2016, 1 );
+    test_finish_alloc( 1512, 2016, 4 );
+}
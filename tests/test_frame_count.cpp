@@ -0,0 +1,56 @@
+#include <cstdio>
+#include <cmath>
+#include <opencv2/opencv.hpp>
+#include "hdrplus/burst.h"
+#include "hdrplus/params.h"
+
+// Frame count of a synthetic flat reference with fixed noise parameters against the count derived by hand
+static bool check_frames( const char* name, double level, int binning, float target_snr, float min_gain, int expected )
+{
+    const double black_level = 64, lambda_shot = 0.5, lambda_read = 20;
+    cv::Mat grayscale_image( 32, 32, CV_16U, cv::Scalar( level ) );
+
+    hdrplus::Options options;
+    options.targetSNR = target_snr;
+    options.minFrameSNRGain = min_gain;
+    int num_frames = hdrplus::num_frames_for_snr( grayscale_image, black_level, lambda_shot, lambda_read, binning, options, 15 );
+
+    printf("%s: %d frames (expected %d)\n", name, num_frames, expected );
+    return num_frames == expected;
+}
+
+void test_frame_count()
+{
+    printf("\n###Test test_frame_count()###\n");
+    bool pass = true;
+
+    // signal 1000 above black: variance 0.5 * 1000 + 20 = 520, single frame SNR 43.85.
+    // Target 100 needs ceil( ( 100 / 43.85 )^2 ) = 6 frames, binned (variance / 4, SNR 87.7) 2 frames
+    pass = check_frames( "bright, target snr", 1064, 1, 100, 0, 6 ) && pass;
+    pass = check_frames( "bright, target snr, binned", 1064, 2, 100, 0, 2 ) && pass;
+
+    // signal 100: variance 70, SNR 11.95, target 100 needs 71 frames, capped by the burst
+    pass = check_frames( "dark, target snr", 164, 1, 100, 0, 15 ) && pass;
+
+    // Black level is not signal: a black frame keeps every frame, the SNR stays far below the target
+    pass = check_frames( "black, target snr", 64, 1, 100, 0, 15 ) && pass;
+
+    // Marginal gain only, scene independent: frame N + 1 adds sqrt( ( N + 1 ) / N ) - 1,
+    // 0.0541 for the 10th frame, 0.0488 for the 11th: a 5% threshold keeps 10 frames
+    pass = check_frames( "marginal gain", 164, 1, 0, 0.05f, 10 ) && pass;
+    pass = check_frames( "marginal gain, bright", 1064, 1, 0, 0.05f, 10 ) && pass;
+
+    // Both: the first to stop wins
+    pass = check_frames( "target snr and marginal gain", 1064, 1, 100, 0.05f, 6 ) && pass;
+    pass = check_frames( "dark, target snr and marginal gain", 164, 1, 100, 0.05f, 10 ) && pass;
+
+    // Neither set: every frame
+    pass = check_frames( "no policy", 1064, 1, 0, 0, 15 ) && pass;
+
+    printf("test_frame_count %s\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+int main()
+{
+    test_frame_count();
+}
@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <algorithm> // std::max
+#include <string>
+#include <unistd.h> // syscall
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <opencv2/opencv.hpp>
+#include "hdrplus/hdrplus_pipeline.h"
+
+// Last level cache misses of this process (all threads created after start), the memory traffic
+// proxy: every miss moves one 64 byte line from DRAM. Unavailable without perf_event permission.
+class cache_miss_counter
+{
+    public:
+        cache_miss_counter()
+        {
+            perf_event_attr attr;
+            memset( &attr, 0, sizeof( attr ) );
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof( attr );
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+        }
+        ~cache_miss_counter() { if ( fd >= 0 ) close( fd ); }
+
+        bool available() const { return fd >= 0; }
+        void start() { if ( fd >= 0 ) { ioctl( fd, PERF_EVENT_IOC_RESET, 0 ); ioctl( fd, PERF_EVENT_IOC_ENABLE, 0 ); } }
+        long long stop()
+        {
+            long long count = 0;
+            if ( fd >= 0 )
+            {
+                ioctl( fd, PERF_EVENT_IOC_DISABLE, 0 );
+                if ( read( fd, &count, sizeof( count ) ) != sizeof( count ) )
+                    count = 0;
+            }
+            return count;
+        }
+
+    private:
+        int fd;
+};
+
+// Merged bayer image of the burst with fusedTileRows set or 0, time and cache misses of load, align and merge
+static cv::Mat merge_burst( const char* burst_path, const char* reference_path, int tile_size, int fused_tile_rows, \
+    cache_miss_counter& counter, double& merge_ms, long long& cache_misses )
+{
+    hdrplus::Options options;
+    options.tilesize = tile_size;
+    options.fusedTileRows = fused_tile_rows;
+    hdrplus::hdrplus_pipeline pipeline( options );
+
+    auto start = std::chrono::steady_clock::now();
+    counter.start();
+    cv::Mat merged = pipeline.merge_burst( burst_path, reference_path ).clone();
+    cache_misses = counter.stop();
+    merge_ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    return merged;
+}
+
+// Fused align and merge (fusedTileRows) and frame by frame align then merge of the same burst,
+// for every merge tile size. The merged bayer images must be identical, time and memory traffic
+// (last level cache misses, 64 bytes each) of both are printed.
+int main( int argc, char** argv )
+{
+    if ( argc != 3 && argc != 4 )
+    {
+        printf("Usage: ./test_fused BURST_FOLDER_PATH(no / at end) REFERENCE_IMAGE_PATH [FUSED_TILE_ROWS]\n");
+        exit(1);
+    }
+    int fused_tile_rows = argc == 4 ? atoi( argv[ 3 ] ) : 4;
+    printf("fused tile rows %d\n", fused_tile_rows );
+
+    cache_miss_counter counter;
+    if ( !counter.available() )
+    {
+        printf("last level cache miss counter unavailable (perf_event_paranoid), timing only\n");
+    }
+
+    bool all_identical = true;
+    const int tile_sizes[ 3 ] = { 8, 16, 32 };
+    for ( int tile_size : tile_sizes )
+    {
+        double merge_ms[ 2 ];
+        long long cache_misses[ 2 ];
+        cv::Mat frame_merged = merge_burst( argv[ 1 ], argv[ 2 ], tile_size, 0, counter, merge_ms[ 0 ], cache_misses[ 0 ] );
+        cv::Mat fused_merged = merge_burst( argv[ 1 ], argv[ 2 ], tile_size, fused_tile_rows, counter, merge_ms[ 1 ], cache_misses[ 1 ] );
+
+        bool same_size = fused_merged.size() == frame_merged.size() && fused_merged.type() == frame_merged.type();
+        long num_different = 0;
+        for ( int row = 0; same_size && row < frame_merged.rows; ++row )
+        {
+            for ( int col = 0; col < frame_merged.cols; ++col )
+            {
+                num_different += fused_merged.at<uint16_t>( row, col ) != frame_merged.at<uint16_t>( row, col );
+            }
+        }
+        bool identical = same_size && num_different == 0;
+        all_identical = all_identical && identical;
+
+        printf("tile size %d: frame by frame %.1f ms, fused %.1f ms, %ld different samples %s\n", \
+            tile_size, merge_ms[ 0 ], merge_ms[ 1 ], num_different, identical ? "" : "FAIL" );
+        if ( counter.available() )
+        {
+            printf("tile size %d: DRAM traffic frame by frame %.1f MB, fused %.1f MB (%.2fx)\n", tile_size, \
+                cache_misses[ 0 ] * 64 / ( 1024.0 * 1024.0 ), cache_misses[ 1 ] * 64 / ( 1024.0 * 1024.0 ), \
+                double( cache_misses[ 0 ] ) / std::max( cache_misses[ 1 ], 1LL ) );
+        }
+        fflush(stdout);
+    }
+
+    printf("test_fused %s\n", all_identical ? "pass" : "FAIL" ); fflush(stdout);
+    return all_identical ? 0 : 1;
+}
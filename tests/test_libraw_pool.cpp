@@ -0,0 +1,73 @@
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <libraw/libraw.h>
+#include "hdrplus/libraw_pool.h"
+
+// Contexts are reused after release, never handed to two owners at once, and the pool stays bounded
+void test_libraw_pool()
+{
+    printf("\n###Test test_libraw_pool()###\n");
+    std::shared_ptr<hdrplus::libraw_pool> pool = hdrplus::libraw_pool::create( 2 );
+    bool pass = true;
+
+    std::shared_ptr<LibRaw> first = pool->checkout();
+    LibRaw* first_address = first.get();
+    std::shared_ptr<LibRaw> first_copy = first;
+    first.reset();
+    pass = pass && pool->num_idle() == 0; // a copy still owns it
+    first_copy.reset();
+    pass = pass && pool->num_idle() == 1;
+
+    std::shared_ptr<LibRaw> reused = pool->checkout();
+    pass = pass && reused.get() == first_address && pool->num_idle() == 0;
+    std::shared_ptr<LibRaw> second = pool->checkout();
+    std::shared_ptr<LibRaw> third = pool->checkout();
+    pass = pass && second.get() != reused.get() && third.get() != second.get() && third.get() != reused.get();
+    reused.reset();
+    second.reset();
+    third.reset();
+    pass = pass && pool->num_idle() == 2; // max_idle
+    printf("reuse and bound %s\n", pass ? "pass" : "FAIL" );
+
+    // Concurrent checkout: every thread holds 2 contexts at once, all distinct
+    const int num_threads = 8;
+    std::vector<LibRaw*> held( num_threads * 2 );
+    std::atomic<bool> distinct( true );
+    std::vector<std::thread> threads;
+    std::vector<std::shared_ptr<LibRaw>> keep( num_threads * 2 );
+    for ( int thread_i = 0; thread_i < num_threads; ++thread_i )
+    {
+        threads.emplace_back( [ &, thread_i ]()
+        {
+            for ( int iteration = 0; iteration < 100; ++iteration )
+            {
+                std::shared_ptr<LibRaw> a = pool->checkout();
+                std::shared_ptr<LibRaw> b = pool->checkout();
+                if ( a.get() == b.get() )
+                    distinct = false;
+            }
+            keep[ thread_i * 2 ] = pool->checkout();
+            keep[ thread_i * 2 + 1 ] = pool->checkout();
+            held[ thread_i * 2 ] = keep[ thread_i * 2 ].get();
+            held[ thread_i * 2 + 1 ] = keep[ thread_i * 2 + 1 ].get();
+        });
+    }
+    for ( auto& thread : threads )
+        thread.join();
+    for ( size_t i = 0; i < held.size(); ++i )
+        for ( size_t j = i + 1; j < held.size(); ++j )
+            pass = pass && held[ i ] != held[ j ];
+    pass = pass && distinct;
+    keep.clear();
+    pass = pass && pool->num_idle() == 2;
+
+    printf("test_libraw_pool %s\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+int main()
+{
+    test_libraw_pool();
+}
@@ -0,0 +1,250 @@
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "hdrplus/align.h"
+#include "hdrplus/merge.h"
+#include "hdrplus/burst.h"
+
+// Synthetic raw burst: 10 bit data, noise model sigma**2 = lambda_shot * ( value - black ) + lambda_read
+static const int synthetic_rows = 256;
+static const int synthetic_cols = 384;
+static const int synthetic_white_level = 1023;
+static const int synthetic_black_level = 64;
+static const double synthetic_lambda_shot = 0.3;
+static const double synthetic_lambda_read = 4;
+
+// Noise free scene, three regions side by side: clipped highlights, static texture, black
+static cv::Mat synthetic_scene()
+{
+    cv::Mat scene( synthetic_rows, synthetic_cols, CV_32F );
+    for ( int row = 0; row < synthetic_rows; ++row )
+    {
+        for ( int col = 0; col < synthetic_cols; ++col )
+        {
+            float value = synthetic_black_level;
+            if ( col < 128 )
+                value = 1200; // above white level
+            else if ( col < 256 )
+                value = 300 + 100 * std::sin( row * 0.2 ) * std::cos( col * 0.15 );
+            scene.at<float>( row, col ) = value;
+        }
+    }
+    return scene;
+}
+
+// One noisy frame of the scene, optionally with a bright square (object moving through the black region)
+static cv::Mat synthetic_frame( const cv::Mat& scene, std::mt19937& rng, int square_row = -1, int square_col = -1 )
+{
+    std::normal_distribution<double> unit_noise( 0, 1 );
+    cv::Mat frame( scene.rows, scene.cols, CV_16U );
+    for ( int row = 0; row < scene.rows; ++row )
+    {
+        for ( int col = 0; col < scene.cols; ++col )
+        {
+            double value = scene.at<float>( row, col );
+            if ( square_row >= 0 && row >= square_row && row < square_row + 24 && col >= square_col && col < square_col + 24 )
+                value = 800;
+            double signal = std::max( value - synthetic_black_level, 0. );
+            value += std::sqrt( synthetic_lambda_shot * signal + synthetic_lambda_read ) * unit_noise( rng );
+            frame.at<uint16_t>( row, col ) = uint16_t( std::min( std::max( std::lround( value ), 0L ), long( synthetic_white_level ) ) );
+        }
+    }
+    return frame;
+}
+
+// 8 frame burst of the scene, a bright 24x24 object moves through the black region in the alternates only
+static std::vector<cv::Mat> synthetic_burst( const cv::Mat& scene, int seed )
+{
+    std::mt19937 rng( seed );
+    std::vector<cv::Mat> frames;
+    frames.push_back( synthetic_frame( scene, rng ) ); // reference, no object
+    for ( int frame_i = 1; frame_i < 8; ++frame_i )
+    {
+        frames.push_back( synthetic_frame( scene, rng, 100, 280 + 8 * frame_i ) );
+    }
+    return frames;
+}
+
+// Zero displacement for every alignment tile (16x16, stride 8, on the half resolution grayscale)
+static std::vector<std::vector<std::pair<int, int>>> zero_alignment()
+{
+    return std::vector<std::vector<std::pair<int, int>>>( synthetic_rows / 2 / 8 - 1, \
+        std::vector<std::pair<int, int>>( synthetic_cols / 2 / 8 - 1, std::make_pair( 0, 0 ) ) );
+}
+
+static cv::Mat merge_frames( hdrplus::merge& merge_module, const std::vector<cv::Mat>& frames, double* merge_ms = nullptr )
+{
+    auto start = std::chrono::steady_clock::now();
+    merge_module.init( frames[ 0 ], synthetic_lambda_shot, synthetic_lambda_read, synthetic_white_level, synthetic_black_level );
+    for ( size_t frame_i = 1; frame_i < frames.size(); ++frame_i )
+    {
+        merge_module.add_frame( frames[ frame_i ], zero_alignment() );
+    }
+    cv::Mat merged = merge_module.finalize();
+    if ( merge_ms )
+        *merge_ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    return merged;
+}
+
+// RMS of merged - scene (clipped at white level) over a rectangle
+static double rms_error( const cv::Mat& merged, const cv::Mat& scene, const cv::Rect& region )
+{
+    double sum = 0;
+    for ( int row = region.y; row < region.y + region.height; ++row )
+    {
+        for ( int col = region.x; col < region.x + region.width; ++col )
+        {
+            double truth = std::min( double( scene.at<float>( row, col ) ), double( synthetic_white_level ) );
+            double diff = merged.at<uint16_t>( row, col ) - truth;
+            sum += diff * diff;
+        }
+    }
+    return std::sqrt( sum / region.area() );
+}
+
+// Tile skipping on and off on a synthetic burst with clipped, static and black regions and a bright object
+// moving through the black region in the alternates only. The shortcut must not change the result:
+// per region the RMS error to the scene with skipping is at most 10% + 1 DN above the one without,
+// far below the ghost left by averaging the object into the black tiles (over 200 DN on the object).
+void test_skip_trivial_tiles( int tile_size )
+{
+    printf("\n###Test test_skip_trivial_tiles( tile_size %d )###\n", tile_size );
+
+    cv::Mat scene = synthetic_scene();
+    std::vector<cv::Mat> frames = synthetic_burst( scene, tile_size );
+
+    cv::Mat merged[ 2 ];
+    double merge_ms[ 2 ];
+    hdrplus::merge_skip_stats skip_stats;
+    for ( int skip = 0; skip < 2; ++skip )
+    {
+        hdrplus::merge merge_module;
+        merge_module.options.tilesize = tile_size;
+        merge_module.options.skipTrivialTiles = skip;
+        merged[ skip ] = merge_frames( merge_module, frames, &merge_ms[ skip ] );
+        skip_stats = merge_module.skip_stats;
+    }
+    printf("skip off %.1f ms, skip on %.1f ms, alternate tiles without DFT %.1f%% (clipped %lld, dark %lld of %lld tiles)\n", \
+        merge_ms[ 0 ], merge_ms[ 1 ], 100 * skip_stats.skipped_fraction(), \
+        skip_stats.num_clipped_tiles, skip_stats.num_dark_tiles, skip_stats.num_tiles );
+
+    // Region interiors, away from the image border and region edges
+    const char* region_names[ 4 ] = { "clipped", "static", "black", "moving object" };
+    const cv::Rect regions[ 4 ] = { cv::Rect( 32, 32, 64, 192 ), cv::Rect( 160, 32, 64, 192 ), \
+                                    cv::Rect( 288, 160, 64, 64 ), cv::Rect( 288, 100, 80, 24 ) };
+    bool pass = skip_stats.num_clipped_tiles > 0 && skip_stats.num_dark_tiles > 0;
+    for ( int region_i = 0; region_i < 4; ++region_i )
+    {
+        double error_off = rms_error( merged[ 0 ], scene, regions[ region_i ] );
+        double error_on = rms_error( merged[ 1 ], scene, regions[ region_i ] );
+        bool region_pass = error_on <= 1.1 * error_off + 1;
+        printf("%s: RMS error skip off %.2f, skip on %.2f %s\n", region_names[ region_i ], error_off, error_on, region_pass ? "" : "FAIL" );
+        pass = pass && region_pass;
+    }
+    printf("test_skip_trivial_tiles %s\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+// Both merge engines on the synthetic burst. The static texture is averaged over 8 frames, the noise
+// drops by up to sqrt(8): both engines must reach at least half of that (RMS error below 0.7 x the single
+// frame noise). The moving object must be rejected, not averaged in (a plain average leaves over 200 DN).
+// The spatial engine must stay within 20% + 0.5 DN of the dft engine in both regions.
+void test_spatial_engine( int tile_size )
+{
+    printf("\n###Test test_spatial_engine( tile_size %d )###\n", tile_size );
+
+    cv::Mat scene = synthetic_scene();
+    std::vector<cv::Mat> frames = synthetic_burst( scene, 100 + tile_size );
+
+    const cv::Rect static_region( 160, 32, 64, 192 );
+    const cv::Rect moving_region( 288, 100, 80, 24 );
+    double frame_error = rms_error( frames[ 0 ], scene, static_region );
+
+    const char* engines[ 2 ] = { "dft", "spatial" };
+    double static_error[ 2 ], moving_error[ 2 ];
+    for ( int engine_i = 0; engine_i < 2; ++engine_i )
+    {
+        hdrplus::merge merge_module;
+        merge_module.options.tilesize = tile_size;
+        merge_module.options.mergeEngine = engines[ engine_i ];
+        cv::Mat merged = merge_frames( merge_module, frames );
+        static_error[ engine_i ] = rms_error( merged, scene, static_region );
+        moving_error[ engine_i ] = rms_error( merged, scene, moving_region );
+    }
+
+    bool pass = static_error[ 0 ] < 0.7 * frame_error && static_error[ 1 ] < 0.7 * frame_error && \
+                static_error[ 1 ] <= 1.2 * static_error[ 0 ] + 0.5 && moving_error[ 1 ] <= 1.2 * moving_error[ 0 ] + 0.5;
+    printf("static texture RMS error: single frame %.2f, dft %.2f, spatial %.2f\n", \
+        frame_error, static_error[ 0 ], static_error[ 1 ] );
+    printf("moving object RMS error: dft %.2f, spatial %.2f\n", moving_error[ 0 ], moving_error[ 1 ] );
+    printf("test_spatial_engine %s\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+// Time both merge engines on the same burst and alignment (same tile size and factors),
+// and the dft engine with and without tile skipping
+void test_merge_engines(int argc, char** argv)
+{
+    printf("\n###Test test_merge_engines()###\n");
+    printf("Burst img dir %s\n", argv[1]);
+    printf("Ref img path %s\n", argv[2]);
+
+    hdrplus::burst burst_images( argv[1], argv[2] );
+    std::vector<std::vector<std::vector<std::pair<int, int>>>> alignments;
+
+    hdrplus::align align_module;
+    align_module.process( burst_images, alignments );
+
+    const char* engines[ 3 ] = { "dft", "spatial", "dft" };
+    double engine_ms[ 3 ];
+    for ( int engine_i = 0; engine_i < 3; ++engine_i )
+    {
+        hdrplus::merge merge_module;
+        merge_module.options.mergeEngine = engines[ engine_i ];
+        merge_module.options.skipTrivialTiles = engine_i == 2;
+        if ( argc > 3 )
+        {
+            merge_module.options.tilesize = atoi( argv[3] );
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        merge_module.process( burst_images, alignments );
+        auto end = std::chrono::steady_clock::now();
+
+        engine_ms[ engine_i ] = std::chrono::duration<double, std::milli>( end - start ).count();
+        printf("merge engine %s%s : %.1f ms\n", engines[ engine_i ], engine_i == 2 ? " skipTrivialTiles" : "", engine_ms[ engine_i ] );
+        if ( engine_i == 2 )
+        {
+            printf("alternate tiles without DFT %.1f%%, time saved %.1f ms (%.1f%%)\n", \
+                100 * merge_module.skip_stats.skipped_fraction(), engine_ms[ 0 ] - engine_ms[ 2 ], \
+                100 * ( engine_ms[ 0 ] - engine_ms[ 2 ] ) / engine_ms[ 0 ] );
+        }
+    }
+
+    printf("spatial engine speedup %.2fx\n", engine_ms[ 0 ] / engine_ms[ 1 ] );
+
+} // end of test_merge_engines
+
+
+int main(int argc, char** argv)
+{
+    if ( argc != 1 && argc < 3 )
+    {
+        printf("Usage ./test_merge [BUTST_PATH REF_PATH [TILE_SIZE]]\n");
+        exit(-1);
+    }
+
+    test_skip_trivial_tiles( 8 );
+    test_skip_trivial_tiles( 16 );
+    test_skip_trivial_tiles( 32 );
+    test_spatial_engine( 8 );
+    test_spatial_engine( 16 );
+    test_spatial_engine( 32 );
+
+    // Timing on a real burst
+    if ( argc >= 3 )
+    {
+        test_merge_engines(argc, argv);
+    }
+}
@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "hdrplus/output_encoder.h"
+
+// Strips are cut on MCU rows and keep the settings of a full frame encode, so the stitched JPEG
+// must decode to exactly the same pixels as cv::imencode of the whole image.
+void test_jpeg_strip_encoder( int height, int width, int quality )
+{
+    printf("\n###Test test_jpeg_strip_encoder()###\n");
+    cv::Mat image( height, width, CV_8UC3 );
+    std::mt19937 rng( 0 );
+    for ( int row = 0; row < height; ++row )
+    {
+        uchar* image_row = image.ptr<uchar>( row );
+        for ( int i = 0; i < width * 3; ++i )
+            image_row[ i ] = uchar( 128 + 100 * sin( row * 0.03 + i * 0.007 ) + rng() % 16 );
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uchar> reference;
+    cv::imencode( ".jpg", image, reference, { cv::IMWRITE_JPEG_QUALITY, quality } );
+    auto end = std::chrono::steady_clock::now();
+    printf("imencode %.2f ms, %zu bytes\n", std::chrono::duration<double, std::milli>( end - start ).count(), reference.size() );
+
+    start = std::chrono::steady_clock::now();
+    hdrplus::jpeg_strip_encoder encoder( height, width, quality );
+    for ( int row_start = 0; row_start < height; row_start += encoder.strip_rows() )
+        encoder.add_strip( image.rowRange( row_start, std::min( row_start + encoder.strip_rows(), height ) ) );
+    std::vector<uchar> stitched = encoder.finish();
+    end = std::chrono::steady_clock::now();
+    printf("jpeg_strip_encoder %.2f ms, %zu bytes, %d rows per strip\n", \
+        std::chrono::duration<double, std::milli>( end - start ).count(), stitched.size(), encoder.strip_rows() );
+
+    cv::Mat reference_decoded = cv::imdecode( reference, cv::IMREAD_COLOR );
+    cv::Mat stitched_decoded = cv::imdecode( stitched, cv::IMREAD_COLOR );
+    bool pass = !stitched_decoded.empty() && stitched_decoded.size() == reference_decoded.size();
+    long long num_diff = 0;
+    for ( int row = 0; pass && row < height; ++row )
+    {
+        for ( int i = 0; i < width * 3; ++i )
+            num_diff += stitched_decoded.ptr<uchar>( row )[ i ] != reference_decoded.ptr<uchar>( row )[ i ];
+    }
+    pass = pass && num_diff == 0;
+    printf("%lld samples differ\n", num_diff );
+    printf("test_jpeg_strip_encoder %s\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+// Pyramid outputs against a direct cv::resize INTER_AREA of the full image: exact sizes, close pixels
+void test_downscale_outputs( int height, int width )
+{
+    printf("\n###Test test_downscale_outputs()###\n");
+    cv::Mat image( height, width, CV_16UC3 );
+    for ( int row = 0; row < height; ++row )
+    {
+        uint16_t* image_row = image.ptr<uint16_t>( row );
+        for ( int i = 0; i < width * 3; ++i )
+            image_row[ i ] = uint16_t( 30000 + 20000 * sin( row * 0.002 + i * 0.0007 ) );
+    }
+
+    std::vector<int> long_sides{ 2048, 320, 10000 };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<cv::Mat> outputs = hdrplus::downscale_outputs( image, long_sides );
+    auto end = std::chrono::steady_clock::now();
+    printf("downscale_outputs %.2f ms\n", std::chrono::duration<double, std::milli>( end - start ).count() );
+
+    bool pass = outputs.size() == long_sides.size();
+    for ( size_t i = 0; pass && i < outputs.size(); ++i )
+    {
+        int expected_long_side = std::min( long_sides[ i ], std::max( height, width ) );
+        pass = std::max( outputs[ i ].rows, outputs[ i ].cols ) == expected_long_side;
+
+        cv::Mat reference;
+        cv::resize( image, reference, outputs[ i ].size(), 0, 0, cv::INTER_AREA );
+        int max_diff = 0;
+        for ( int row = 0; row < reference.rows; ++row )
+        {
+            for ( int j = 0; j < reference.cols * 3; ++j )
+                max_diff = std::max( max_diff, std::abs( int( outputs[ i ].ptr<uint16_t>( row )[ j ] ) - int( reference.ptr<uint16_t>( row )[ j ] ) ) );
+        }
+        printf("%dx%d max |diff| %d\n", outputs[ i ].cols, outputs[ i ].rows, max_diff );
+        pass = pass && max_diff < 256;
+    }
+    printf("test_downscale_outputs %s\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+int main()
+{
+    test_jpeg_strip_encoder( 3024, 4032, 95 );
+    test_jpeg_strip_encoder( 1001, 1003, 75 ); // partial last MCU row and column
+    test_downscale_outputs( 3024, 4032 );
+}
@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <climits>
+#include <random>
+#include <opencv2/opencv.hpp>
+#include "hdrplus/sharpen.h"
+#include "hdrplus/finish.h"
+#include "hdrplus/params.h"
+
+// Banded sharpening against cv::GaussianBlur + per sample combine (sharpenTriple with sharpenEngine 'opencv').
+// Blurs are computed in float and rounded instead of with OpenCV's kernels, so a blur may differ by one unit.
+// Away from the thresholds a sample may then differ by one unit. Where an OpenCV blur is within one unit of
+// a threshold the two may take different sides of it and differ by the full sharpening amount: those
+// samples are excluded from the one unit bound and their number is bounded separately.
+void test_sharpen_triple_banded( int height, int width )
+{
+    printf("\n###Test test_sharpen_triple_banded()###\n");
+    std::vector<float> amounts{ 1, 0.5, 0.5 };
+    std::vector<float> sigmas{ 1, 2, 4 };
+    std::vector<float> thresholds{ 0.02, 0.04, 0.06 };
+
+    cv::Mat image( height, width, CV_16UC3 );
+    std::mt19937 rng( 0 );
+    for ( int row = 0; row < height; ++row )
+    {
+        uint16_t* image_row = image.ptr<uint16_t>( row );
+        for ( int i = 0; i < width * 3; ++i )
+            image_row[ i ] = uint16_t( 30000 + 20000 * sin( row * 0.05 + i * 0.01 ) + rng() % 4000 );
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    cv::Mat blurs[ 3 ];
+    for ( int scale_i = 0; scale_i < 3; ++scale_i )
+        cv::GaussianBlur( image, blurs[ scale_i ], cv::Size( 0, 0 ), sigmas[ scale_i ] );
+    cv::Mat reference( height, width, CV_16UC3 );
+    cv::Mat near_threshold( height, width * 3, CV_8U, cv::Scalar( 0 ) );
+    for ( int row = 0; row < height; ++row )
+    {
+        for ( int i = 0; i < width * 3; ++i )
+        {
+            double x = image.ptr<uint16_t>( row )[ i ];
+            double sum = 0;
+            for ( int scale_i = 0; scale_i < 3; ++scale_i )
+            {
+                double blur = blurs[ scale_i ].ptr<uint16_t>( row )[ i ];
+                double low = fabs( blur - x ) / USHRT_MAX;
+                sum += low < thresholds[ scale_i ] ? x : x + amounts[ scale_i ] * ( x - blur );
+                if ( fabs( fabs( blur - x ) - thresholds[ scale_i ] * USHRT_MAX ) <= 1 )
+                    near_threshold.ptr<uint8_t>( row )[ i ] = 1;
+            }
+            reference.ptr<uint16_t>( row )[ i ] = uint16_t( std::min( std::max( sum / 3, 0. ), double( USHRT_MAX ) ) );
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("GaussianBlur + combine %.2f ms\n", std::chrono::duration<double, std::milli>( end - start ).count() );
+
+    start = std::chrono::steady_clock::now();
+    cv::Mat banded = hdrplus::sharpen_triple_banded( image, amounts, sigmas, thresholds );
+    end = std::chrono::steady_clock::now();
+    printf("sharpen_triple_banded %.2f ms\n", std::chrono::duration<double, std::milli>( end - start ).count() );
+
+    int max_diff = 0;
+    long long num_diff = 0;
+    long long num_near_threshold = 0;
+    int max_near_threshold_diff = 0;
+    for ( int row = 0; row < height; ++row )
+    {
+        for ( int i = 0; i < width * 3; ++i )
+        {
+            int diff = std::abs( int( banded.ptr<uint16_t>( row )[ i ] ) - int( reference.ptr<uint16_t>( row )[ i ] ) );
+            num_diff += diff != 0;
+            if ( near_threshold.ptr<uint8_t>( row )[ i ] )
+            {
+                num_near_threshold++;
+                max_near_threshold_diff = std::max( max_near_threshold_diff, diff );
+            }
+            else
+            {
+                max_diff = std::max( max_diff, diff );
+            }
+        }
+    }
+    double near_threshold_fraction = double( num_near_threshold ) / ( double( height ) * width * 3 );
+    printf("max |diff| %d away from thresholds, %lld samples differ\n", max_diff, num_diff );
+    printf("%lld samples (%.4f%%) within one unit of a threshold, max |diff| %d\n", \
+        num_near_threshold, 100 * near_threshold_fraction, max_near_threshold_diff );
+
+    // Blurs within one unit of a threshold: 2 units per scale of the |blur - image| distribution
+    bool pass = max_diff <= 1 && near_threshold_fraction < 0.01;
+    printf("test_sharpen_triple_banded %s (max |diff| <= 1 away from thresholds, < 1%% samples near thresholds)\n", \
+        pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+// Strip by strip sharpening (sharpenBlurs, then sharpenRows per strip as the JPEG strip encoder does)
+// against sharpenTriple of the whole image, for both engines: the images must be identical.
+void test_sharpen_rows( const char* engine, int height, int width, int strip_rows )
+{
+    printf("\n###Test test_sharpen_rows( %s, strip_rows %d )###\n", engine, strip_rows );
+    hdrplus::Tuning tuning;
+    hdrplus::Options options;
+    options.sharpenEngine = engine;
+
+    cv::Mat image( height, width, CV_16UC3 );
+    std::mt19937 rng( 1 );
+    for ( int row = 0; row < height; ++row )
+    {
+        uint16_t* image_row = image.ptr<uint16_t>( row );
+        for ( int i = 0; i < width * 3; ++i )
+            image_row[ i ] = uint16_t( 30000 + 20000 * sin( row * 0.05 + i * 0.01 ) + rng() % 4000 );
+    }
+
+    hdrplus::sharpen_buffers buffers;
+    cv::Mat full;
+    hdrplus::sharpenTriple( image, full, tuning, options, buffers );
+
+    hdrplus::sharpen_buffers strip_buffers;
+    cv::Mat strips( height, width, CV_16UC3 );
+    hdrplus::sharpenBlurs( image, tuning, options, strip_buffers );
+    for ( int row_start = 0; row_start < height; row_start += strip_rows )
+    {
+        hdrplus::sharpenRows( image, strips, tuning, options, strip_buffers, row_start, std::min( row_start + strip_rows, height ) );
+    }
+
+    long long num_diff = 0;
+    for ( int row = 0; row < height; ++row )
+    {
+        for ( int i = 0; i < width * 3; ++i )
+            num_diff += full.ptr<uint16_t>( row )[ i ] != strips.ptr<uint16_t>( row )[ i ];
+    }
+    printf("%lld samples differ\n", num_diff );
+    printf("test_sharpen_rows %s\n", num_diff == 0 ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+int main()
+{
+    test_sharpen_triple_banded( 3024, 4032 );
+    test_sharpen_rows( "opencv", 500, 640, 64 );
+    test_sharpen_rows( "banded", 500, 640, 64 );
+}
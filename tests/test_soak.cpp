@@ -0,0 +1,60 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h> // sysconf
+#ifdef __GLIBC__
+#include <malloc.h> // malloc_trim
+#endif
+#include "hdrplus/hdrplus_pipeline.h"
+
+// Resident set size of this process in MB
+static double resident_mb()
+{
+    long pages_total = 0, pages_resident = 0;
+    FILE* statm = fopen( "/proc/self/statm", "r" );
+    if ( statm == nullptr || fscanf( statm, "%ld %ld", &pages_total, &pages_resident ) != 2 )
+    {
+        printf("unable to read /proc/self/statm\n");
+        exit(1);
+    }
+    fclose( statm );
+    return pages_resident * double( sysconf( _SC_PAGESIZE ) ) / ( 1024.0 * 1024.0 );
+}
+
+// Runs the pipeline on the same burst again and again in one process, as a long running worker does.
+// After warm up (thread pools, OpenCV buffers, tone mapping buffers kept in finish::ltmBuffers), RSS must stay flat.
+int main( int argc, char** argv )
+{
+    if ( argc != 3 && argc != 4 )
+    {
+        printf("Usage: ./test_soak BURST_FOLDER_PATH(no / at end) REFERENCE_IMAGE_PATH [ITERATIONS]\n");
+        exit(1);
+    }
+    int num_iterations = argc == 4 ? atoi( argv[ 3 ] ) : 10;
+    int num_warm_up = 2;
+    double max_growth_mb = 64;
+
+    hdrplus::hdrplus_pipeline pipeline;
+    double baseline_mb = 0;
+    double last_mb = 0;
+    for ( int iteration = 0; iteration < num_warm_up + num_iterations; ++iteration )
+    {
+        std::vector<hdrplus::output_image> outputs = pipeline.process( argv[ 1 ], argv[ 2 ] );
+        outputs.clear();
+
+        #ifdef __GLIBC__
+        malloc_trim( 0 ); // freed blocks returned to the system, RSS then counts live memory
+        #endif
+        last_mb = resident_mb();
+        if ( iteration == num_warm_up - 1 )
+        {
+            baseline_mb = last_mb;
+        }
+        printf("iteration %d RSS %.1f MB\n", iteration, last_mb ); fflush(stdout);
+    }
+
+    double growth_mb = last_mb - baseline_mb;
+    printf("RSS growth over %d iterations after warm up %.1f MB (limit %.1f MB)\n", num_iterations, growth_mb, max_growth_mb );
+    printf("test_soak %s\n", growth_mb <= max_growth_mb ? "pass" : "FAIL" ); fflush(stdout);
+    return growth_mb <= max_growth_mb ? 0 : 1;
+}
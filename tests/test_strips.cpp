@@ -0,0 +1,82 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <opencv2/opencv.hpp>
+#include "hdrplus/hdrplus_pipeline.h"
+#include "hdrplus/burst.h"
+
+// Peak (VmHWM) or current (VmRSS) resident set size of this process in MB
+static double status_mb( const char* field )
+{
+    FILE* status = fopen( "/proc/self/status", "r" );
+    if ( status == nullptr )
+    {
+        printf("unable to read /proc/self/status\n");
+        exit(1);
+    }
+    char line[ 256 ];
+    double kb = 0;
+    while ( fgets( line, sizeof( line ), status ) )
+    {
+        if ( strncmp( line, field, strlen( field ) ) == 0 )
+        {
+            kb = atof( line + strlen( field ) + 1 );
+        }
+    }
+    fclose( status );
+    return kb / 1024.0;
+}
+
+// Align and merge of the same burst in strips within a memory budget and full frame, the merged
+// bayer images must be identical. The budget run goes first so that the peak RSS it reaches is its own.
+// Default budget is the smallest one accepted, strips of 256 rows: as many strip borders as possible.
+int main( int argc, char** argv )
+{
+    if ( argc != 3 && argc != 4 )
+    {
+        printf("Usage: ./test_strips BURST_FOLDER_PATH(no / at end) REFERENCE_IMAGE_PATH [MEMORY_BUDGET_MB]\n");
+        exit(1);
+    }
+
+    hdrplus::Options strip_options;
+    if ( argc == 4 )
+    {
+        strip_options.memoryBudgetMB = atoi( argv[ 3 ] );
+    }
+    else
+    {
+        // Frame count and padded size only, the burst is spilled
+        strip_options.memoryBudgetMB = 1;
+        hdrplus::burst burst_images( argv[ 1 ], argv[ 2 ], strip_options );
+        strip_options.memoryBudgetMB = hdrplus::hdrplus_pipeline::min_memory_budget_mb( burst_images.num_images, \
+            burst_images.padded_size.height, burst_images.padded_size.width, strip_options );
+    }
+    printf("memory budget %d MB\n", strip_options.memoryBudgetMB ); fflush(stdout);
+
+    double start_mb = status_mb( "VmRSS:" );
+    hdrplus::hdrplus_pipeline strip_pipeline( strip_options );
+    cv::Mat strip_merged = strip_pipeline.merge_burst( argv[ 1 ], argv[ 2 ] ).clone();
+    double peak_growth_mb = status_mb( "VmHWM:" ) - start_mb;
+    printf("strips: peak RSS growth %.1f MB\n", peak_growth_mb ); fflush(stdout);
+
+    hdrplus::hdrplus_pipeline full_pipeline;
+    cv::Mat full_merged = full_pipeline.merge_burst( argv[ 1 ], argv[ 2 ] );
+
+    bool same_size = strip_merged.size() == full_merged.size() && strip_merged.type() == full_merged.type();
+    long num_different = 0;
+    for ( int row = 0; same_size && row < full_merged.rows; ++row )
+    {
+        for ( int col = 0; col < full_merged.cols; ++col )
+        {
+            num_different += strip_merged.at<uint16_t>( row, col ) != full_merged.at<uint16_t>( row, col );
+        }
+    }
+    printf("merged bayer %dx%d, %ld different samples\n", full_merged.rows, full_merged.cols, num_different );
+
+    bool identical = same_size && num_different == 0;
+    bool within_budget = peak_growth_mb <= strip_options.memoryBudgetMB;
+    printf("test_strips %s (identical %s, peak RSS growth within budget %s)\n", \
+        identical && within_budget ? "pass" : "FAIL", identical ? "yes" : "no", within_budget ? "yes" : "no" ); fflush(stdout);
+    return identical && within_budget ? 0 : 1;
+}
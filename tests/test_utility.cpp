@@ -70,6 +70,36 @@ void test_box_filter_kxk()
 }
 
 
+void test_bin_bayer_2x2()
+{
+    printf("\n###Test test_bin_bayer_2x2()###\n");
+    // Intialize input data, each bayer color has its own range
+    int src_width = 12;
+    int src_height = 8;
+    std::vector<uint16_t> src_data( src_width * src_height );
+
+    for ( int i = 0; i < src_width * src_height; ++i )
+    {
+        int row = i / src_width;
+        int col = i % src_width;
+        src_data[ i ] = ( ( row % 2 ) * 2 + ( col % 2 ) ) * 1000 + i;
+    }
+
+    // Create input cv::mat
+    cv::Mat src_image( src_height, src_width, CV_16U, src_data.data() );
+
+    printf("src cv::Mat is \n");
+    hdrplus::print_cvmat<uint16_t>( src_image );
+
+    cv::Mat dst_image = hdrplus::bin_bayer_2x2<uint16_t>( src_image );
+
+    printf("dst cv::Mat binned 2x2 is (%d x %d), colors stay in their thousand\n", dst_image.rows, dst_image.cols );
+    hdrplus::print_cvmat<uint16_t>( dst_image );
+
+    printf("test_bin_bayer_2x2 finish\n"); fflush(stdout);
+}
+
+
 void test_extract_rgb_from_bayer()
 {
     printf("\n###Test test_extract_rgb_from_bayer()###\n");
@@ -137,12 +167,30 @@ void test_rgb_2_gray()
 }
 
 
+void test_reflect_101()
+{
+    printf("\n###Test test_reflect_101()###\n");
+    // Same index as OpenCV BORDER_REFLECT_101, also for single pixel images and offsets beyond the image
+    bool pass = true;
+    for ( int size = 1; size <= 9; ++size )
+    {
+        for ( int i = -3 * size - 2; i < 4 * size + 2; ++i )
+        {
+            pass = pass && hdrplus::reflect_101( i, size ) == cv::borderInterpolate( i, size, cv::BORDER_REFLECT_101 );
+        }
+    }
+    printf("test_reflect_101 %s\n", pass ? "pass" : "FAIL" ); fflush(stdout);
+}
+
+
 int main()
 {
     //test_downsample_nearest_neighbour();
     //test_box_filter_kxk();
+    test_bin_bayer_2x2();
     //test_extract_rgb_from_bayer();
     test_rgb_2_gray();
+    test_reflect_101();
 
     printf("\ntest_utility finish\n");
 }
\ No newline at end of file